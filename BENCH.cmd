@@ -0,0 +1,5 @@
+@echo off
+for /f "delims=" %%i in ('python3 -c "import sysconfig; print(sysconfig.get_paths()['include'])"') do set PYABI_INCLUDE=%%i
+for /f "delims=" %%i in ('python3 -c "import os, sys; print(os.path.join(sys.base_prefix, 'libs'))"') do set PYABI_LIBS=%%i
+cl /nologo /std:c++17 /O2 /EHsc /I src /I "%PYABI_INCLUDE%" PyABI_bench.cpp /link /LIBPATH:"%PYABI_LIBS%"
+PyABI_bench.exe %*
@@ -18,100 +18,683 @@ its also possible to match the number of cores on the host with:
 
 auto PyABI_threads = std::thread::hardware_concurrency();
 
+or at runtime with resize_pool("default", n), the default pool can grow to one
+worker per core, create_pool() makes pools of any size
+
 ***/
 
 auto PyABI_threads = 4;
 
+/***
+
+how many calls a pool lets queue up before its overflow policy kicks in, see
+limit_pool(), 0 is unbounded
+
+***/
+
+auto PyABI_max_queued = 1 << 16;
+
 #include "PyABI.hpp"
 
 #include "src/singleton.hpp"
 
 #include "src/body.hpp"
 
-// Module method definitions
-static PyObject* hello_world(PyObject* module, PyObject* args, PyObject* kwargs) {
+/***
+
+hello_world, hello and the other exported functions are generated from their
+Singleton methods, see Export in PyABI.hpp
+
+submit_many(function, calls) queues function(*args) for every args tuple in calls
+in one crossing and returns the range of their CallIDs, which is contiguous,
+priority, deadline and timeout apply to the whole batch
+
+everything is parsed and marshaled up front, an error in any call raises and
+queues none of them
+
+***/
+
+static PyObject* submit_many(PyObject* module, PyObject* args, PyObject* kwargs) {
+  PyObject* function = nullptr;
+  PyObject* iterable = nullptr;
+  PyObject* priority = nullptr;
+  PyObject* deadline = nullptr;
+  PyObject* timeout = nullptr;
 
-  PY_DEFAULT_ARGUMENT_INIT(encoding, PyUnicode_FromString("utf-8"), nullptr);
-  PY_DEFAULT_ARGUMENT_INIT(the_id, PyLong_FromLong(0L), nullptr);
-  PY_DEFAULT_ARGUMENT_INIT(must_log, PyBool_FromLong(1L), nullptr);
+  static const char* kwlist[] = { "function", "calls", "priority", "deadline", "timeout", nullptr };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|OOO", const_cast<char**>(kwlist), &function, &iterable, &priority, &deadline, &timeout)) {
+    return nullptr;
+  }
 
-  static const char* kwlist[] = { "encoding", "the_id", "must_log", nullptr };
-  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|Oip", const_cast<char**>(kwlist), &encoding, &the_id, &must_log)) {
+  Schedule schedule;
+  Call_Options options;
+  if (!schedule_from(priority, deadline, timeout, schedule, options)) {
     return nullptr;
   }
 
-  PY_DEFAULT_ARGUMENT_SET(encoding);
-  PY_DEFAULT_ARGUMENT_SET(the_id);
-  PY_DEFAULT_ARGUMENT_SET(must_log);
+  Buffer_Pin::release_pending();
 
-  PyObject* defargs = PyList_New(3);
-  PyList_SetItem(defargs, 0, encoding);
-  PyList_SetItem(defargs, 1, the_id);
-  PyList_SetItem(defargs, 2, must_log);
-	uint64_t call_id = 0;
+  const Export_Method* batch = Exported::find(function, "submit_many");
+  if (!batch) {
+    return nullptr;
+  }
+
+  auto_pyptr calls = PySequence_Fast(iterable, "submit_many() expects an iterable of argument tuples");
+  if (!calls) {
+    return nullptr;
+  }
+
+  const Py_ssize_t count = PySequence_Fast_GET_SIZE(calls.get());
+  PyObject** items = PySequence_Fast_ITEMS(calls.get());
+
+  for (Py_ssize_t i = 0; i < count; i++) {
+    if (!PyTuple_Check(items[i])) {
+      PyErr_Format(PyExc_TypeError, "submit_many() call %zd is a '%.200s', not an argument tuple", i, Py_TYPE(items[i])->tp_name);
+      return nullptr;
+    }
+  }
+
+  uint64_t first = 0;
   try {
-    call_id = hello_world__(args, kwargs, defargs);
+    first = batch->many(items, (size_t)count, schedule, options);
   }
   catch (...) {
+    PyABI_raise_caught();
+    return nullptr;
+  }
 
-  };
-  Py_DECREF(defargs);
+  return PyObject_CallFunction((PyObject*)&PyRange_Type, "KK",
+    (unsigned long long)first, (unsigned long long)(first + count));
+}
+
+/***
 
-  Py_DECREF(encoding);
-  Py_DECREF(the_id);
-  Py_DECREF(must_log);
+(call_id, success, result), the shape every finished call is handed back in
 
-  return PyLong_FromUnsignedLong(call_id);
+result is whatever the call returned, a buffer it returned comes as a read-only
+memoryview over the worker's own memory; a failed call's result is the exception
+it failed with: DeadlineExceeded, Overloaded, Cancelled or a RuntimeError with
+its message
+
+***/
+
+static PyObject* results_tuple(Results& results) {
+  PyObject* result = nullptr;
+  switch (results.Reason) {
+  case Results::Failure::Expired:
+    result = PyObject_CallFunction(DeadlineExceeded, "s", "the call missed its deadline");
+    break;
+  case Results::Failure::Shed:
+    result = PyObject_CallFunction(Overloaded, "s", "the call was shed to make room");
+    break;
+  case Results::Failure::Cancelled:
+    result = PyObject_CallFunction(Cancelled, "s", "the call was cancelled");
+    break;
+  case Results::Failure::Timed_Out:
+    result = PyObject_CallFunction(DeadlineExceeded, "s", "the call ran past its timeout");
+    break;
+  case Results::Failure::Raised: {
+    auto_pyptr message = results.result();
+    result = message ? PyObject_CallFunctionObjArgs(PyExc_RuntimeError, message.get(), nullptr) : nullptr;
+    break;
+  }
+  default:
+    result = results.result();
+    break;
+  }
+
+  return Py_BuildValue("(KON)",
+    (unsigned long long)results.CallID,
+    results.Success ? Py_True : Py_False,
+    result);
 }
 
+/***
+
+drains up to max_n finished calls in one go and hands them back as a list of
+(call_id, success, result) tuples, max_n < 0 means everything queued right now
+
+***/
+
+static PyObject* deque_results(PyObject* module, PyObject* args, PyObject* kwargs) {
+  Py_ssize_t max_n = -1;
+
+  static const char* kwlist[] = { "max_n", nullptr };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|n", const_cast<char**>(kwlist), &max_n)) {
+    return nullptr;
+  }
+
+  Buffer_Pin::release_pending();
+
+  // one per call, results_tuple() can run Python (a finalizer, the GC) that calls back in here
+  std::vector<Results> batch;
+  deque_results__(batch, max_n < 0 ? SIZE_MAX : (size_t)max_n);
 
-static PyObject* hello(PyObject* module, PyObject* args, PyObject* kwargs) {
+  PyObject* list = PyList_New(batch.size());
+  if (!list) {
+    collected__(batch, 0);
+    return nullptr;
+  }
+
+  for (size_t i = 0; i < batch.size(); i++) {
+    PyObject* item = results_tuple(batch[i]);
+    if (!item) {
+      // the one that failed is gone with the error, the ones after it wait for the next call
+      collected__(batch, i + 1);
+      Py_DECREF(list);
+      return nullptr;
+    }
+    PyList_SET_ITEM(list, i, item);
+  }
+
+  collected__(batch, batch.size());
+  return list;
+}
+
+/***
+
+blocks until call_id has finished and returns its (call_id, success, result),
+or None once timeout seconds have passed, the GIL is released while blocked
+
+***/
+
+static PyObject* wait(PyObject* module, PyObject* args, PyObject* kwargs) {
+  unsigned long long call_id = 0;
+  PyObject* timeout = Py_None;
+
+  static const char* kwlist[] = { "call_id", "timeout", nullptr };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "K|O", const_cast<char**>(kwlist), &call_id, &timeout)) {
+    return nullptr;
+  }
+
+  auto deadline = std::chrono::steady_clock::time_point::max();
+  if (timeout != Py_None) {
+    const double seconds = PyFloat_AsDouble(timeout);
+    if (seconds == -1.0 && PyErr_Occurred()) {
+      return nullptr;
+    }
+    deadline = std::chrono::steady_clock::now()
+      + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(std::max(seconds, 0.0)));
+  }
+
+  Results results;
+  bool found = false;
+  while (!found) {
+    // wake up now and then so Ctrl-C still works during a long wait
+    const auto slice = std::min(deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds(100));
+
+    Py_BEGIN_ALLOW_THREADS
+    found = wait__(call_id, results, slice);
+    Py_END_ALLOW_THREADS
+
+    Buffer_Pin::release_pending();
+
+    if (found) {
+      break;
+    }
+    if (PyErr_CheckSignals() < 0) {
+      return nullptr;
+    }
+    if (slice == deadline) {
+      Py_RETURN_NONE;
+    }
+  }
+
+  return results_tuple(results);
+}
+
+// readable whenever deque_results() has something, -1 where the platform has no such fd
+static PyObject* completion_fd(PyObject* module, PyObject* args) {
+  return PyLong_FromLong(completion_fd__());
+}
+
+/***
+
+thread pools
+
+create_pool(name, workers, max_workers=0, cpus=None, numa_node=None) makes a new
+pool that resize_pool() can grow to max_workers (0 is one per core), cpus or
+numa_node pin its workers
+
+pin_pool(name, cpus=None, numa_node=None) repins a pool, neither unpins it
+
+route(function, name) runs every later call of function on that pool
+
+limit_pool(name, max_queued, overflow="block") bounds how many calls may wait to
+start, once full a call "block"s (GIL released) until there is room, is rejected
+with Overloaded ("reject") or sheds the oldest queued calls ("shed_oldest"), whose
+results are Overloaded instances; max_queued=0 lifts the bound
+
+***/
+
+// cpus (an iterable of ints) or numa_node into a CPU set, false with an error set
+static bool parse_cpus(PyObject* cpus, PyObject* numa_node, std::vector<int>& out) {
+  if (cpus != Py_None && numa_node != Py_None) {
+    PyErr_SetString(PyExc_ValueError, "give cpus or numa_node, not both");
+    return false;
+  }
+
+  if (numa_node != Py_None) {
+    const long node = PyLong_AsLong(numa_node);
+    if (node == -1 && PyErr_Occurred()) {
+      return false;
+    }
+    out = PyABI_numa_cpus((int)node);
+    if (out.empty()) {
+      PyErr_Format(PyExc_ValueError, "NUMA node %ld has no CPUs on this host", node);
+      return false;
+    }
+    return true;
+  }
+
+  if (cpus != Py_None) {
+    auto_pyptr sequence = PySequence_Fast(cpus, "cpus must be an iterable of CPU numbers");
+    if (!sequence) {
+      return false;
+    }
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(sequence.get()); i++) {
+      const long cpu = PyLong_AsLong(PySequence_Fast_GET_ITEM(sequence.get(), i));
+      if (cpu == -1 && PyErr_Occurred()) {
+        return false;
+      }
+      out.push_back((int)cpu);
+    }
+    if (out.empty()) {
+      PyErr_SetString(PyExc_ValueError, "cpus is empty, pass None to unpin");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static PyObject* create_pool(PyObject* module, PyObject* args, PyObject* kwargs) {
   const char* name;
-  if (!PyArg_ParseTuple(args, "s", &name)) {
+  Py_ssize_t workers;
+  Py_ssize_t max_workers = 0;
+  PyObject* cpus = Py_None;
+  PyObject* numa_node = Py_None;
+
+  static const char* kwlist[] = { "name", "workers", "max_workers", "cpus", "numa_node", nullptr };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sn|nOO", const_cast<char**>(kwlist), &name, &workers, &max_workers, &cpus, &numa_node)) {
     return nullptr;
   }
 
+  std::vector<int> set;
+  if (!parse_cpus(cpus, numa_node, set)) {
+    return nullptr;
+  }
+
+  const size_t capacity = max_workers > 0
+    ? (size_t)max_workers
+    : std::max<size_t>(std::max<Py_ssize_t>(workers, 0), std::thread::hardware_concurrency());
 
-  PyObject* defargs = PyList_New(0);
-	uint64_t call_id = 0;
   try {
-    call_id = hello__(args, kwargs, defargs);
+    create_pool__(name, (size_t)std::max<Py_ssize_t>(workers, 0), capacity, std::move(set));
   }
   catch (...) {
+    PyABI_raise_caught();
+    return nullptr;
+  }
 
-  };
-  Py_DECREF(defargs);
+  Py_RETURN_NONE;
+}
+
+static PyObject* resize_pool(PyObject* module, PyObject* args, PyObject* kwargs) {
+  const char* name;
+  Py_ssize_t workers;
+
+  static const char* kwlist[] = { "name", "workers", nullptr };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sn", const_cast<char**>(kwlist), &name, &workers)) {
+    return nullptr;
+  }
+
+  try {
+    resize_pool__(name, (size_t)std::max<Py_ssize_t>(workers, 0));
+  }
+  catch (...) {
+    PyABI_raise_caught();
+    return nullptr;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* pin_pool(PyObject* module, PyObject* args, PyObject* kwargs) {
+  const char* name;
+  PyObject* cpus = Py_None;
+  PyObject* numa_node = Py_None;
+
+  static const char* kwlist[] = { "name", "cpus", "numa_node", nullptr };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|OO", const_cast<char**>(kwlist), &name, &cpus, &numa_node)) {
+    return nullptr;
+  }
+
+  std::vector<int> set;
+  if (!parse_cpus(cpus, numa_node, set)) {
+    return nullptr;
+  }
+
+  try {
+    pin_pool__(name, std::move(set));
+  }
+  catch (...) {
+    PyABI_raise_caught();
+    return nullptr;
+  }
 
-  Py_INCREF(Py_None);
-  return Py_None;
+  Py_RETURN_NONE;
+}
+
+static PyObject* limit_pool(PyObject* module, PyObject* args, PyObject* kwargs) {
+  const char* name;
+  Py_ssize_t max_queued;
+  const char* overflow = "block";
+
+  static const char* kwlist[] = { "name", "max_queued", "overflow", nullptr };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sn|s", const_cast<char**>(kwlist), &name, &max_queued, &overflow)) {
+    return nullptr;
+  }
+
+  Overflow policy;
+  if (strcmp(overflow, "block") == 0) {
+    policy = Overflow::Block;
+  }
+  else if (strcmp(overflow, "reject") == 0) {
+    policy = Overflow::Reject;
+  }
+  else if (strcmp(overflow, "shed_oldest") == 0) {
+    policy = Overflow::Shed_Oldest;
+  }
+  else {
+    PyErr_Format(PyExc_ValueError, "overflow must be 'block', 'reject' or 'shed_oldest', not '%s'", overflow);
+    return nullptr;
+  }
+
+  try {
+    limit_pool__(name, (size_t)std::max<Py_ssize_t>(max_queued, 0), policy);
+  }
+  catch (...) {
+    PyABI_raise_caught();
+    return nullptr;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* route(PyObject* module, PyObject* args, PyObject* kwargs) {
+  PyObject* function;
+  const char* name;
+
+  static const char* kwlist[] = { "function", "pool", nullptr };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Os", const_cast<char**>(kwlist), &function, &name)) {
+    return nullptr;
+  }
+
+  const Export_Method* method = Exported::find(function, "route");
+  if (!method) {
+    return nullptr;
+  }
+
+  try {
+    route__(method->function, name);
+  }
+  catch (...) {
+    PyABI_raise_caught();
+    return nullptr;
+  }
+
+  Py_RETURN_NONE;
+}
+
+// {name: {"workers", "max_workers", "pending", "cpus", "queued", "max_queued", "overflow", "rejected", "shed", "blocked"}}
+static PyObject* pools(PyObject* module, PyObject* args) {
+  auto_pyptr result = PyDict_New();
+  if (!result) {
+    return nullptr;
+  }
+
+  for (auto& pool : pools__()) {
+    auto_pyptr cpus = PyList_New(pool.cpus.size());
+    if (!cpus) {
+      return nullptr;
+    }
+    for (size_t i = 0; i < pool.cpus.size(); i++) {
+      PyList_SET_ITEM(cpus.get(), i, PyLong_FromLong(pool.cpus[i]));
+    }
+    static const char* overflows[] = { "block", "reject", "shed_oldest" };
+    auto_pyptr info = Py_BuildValue("{snsnsnsOsnsnsssnsnsn}",
+      "workers", (Py_ssize_t)pool.workers,
+      "max_workers", (Py_ssize_t)pool.capacity,
+      "pending", (Py_ssize_t)pool.pending,
+      "cpus", cpus.get(),
+      "queued", (Py_ssize_t)pool.queued,
+      "max_queued", (Py_ssize_t)pool.max_queued,
+      "overflow", overflows[(int)pool.overflow],
+      "rejected", (Py_ssize_t)pool.rejected,
+      "shed", (Py_ssize_t)pool.shed,
+      "blocked", (Py_ssize_t)pool.blocked);
+    if (!info || PyDict_SetItemString(result, pool.name.c_str(), info) < 0) {
+      return nullptr;
+    }
+  }
+
+  return result.release();
+}
+
+// count, mean, min, p50, p99, p999 and max of a histogram, divided by scale
+static PyObject* summary_dict(const Histogram::Summary& summary, const double scale) {
+  return Py_BuildValue("{sKsdsdsdsdsdsd}",
+    "count", (unsigned long long)summary.count,
+    "mean", summary.mean() / scale,
+    "min", summary.min() / scale,
+    "p50", summary.percentile(0.50) / scale,
+    "p99", summary.percentile(0.99) / scale,
+    "p999", summary.percentile(0.999) / scale,
+    "max", summary.max() / scale);
+}
+
+/***
+
+how long calls spend in each stage of the pipeline, in microseconds:
+
+queue    submitted -> picked up by a worker
+execute  picked up -> finished
+return   finished -> handed to Python by deque_results() or wait()
+total    submitted -> handed to Python
+
+depth has the same figures for the number of calls outstanding at each submit,
+and pending how many are sitting in each queue right now
+
+reset=True starts the next stats() from zero
+
+***/
+
+static PyObject* stats(PyObject* module, PyObject* args, PyObject* kwargs) {
+  int reset = 0;
+
+  static const char* kwlist[] = { "reset", nullptr };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|p", const_cast<char**>(kwlist), &reset)) {
+    return nullptr;
+  }
+
+  auto_pyptr result = PyDict_New();
+  if (!result) {
+    return nullptr;
+  }
+
+  for (size_t stage = 0; stage < Call_Stats::STAGES; stage++) {
+    const auto which = (Call_Stats::Stage)stage;
+    auto_pyptr summary = summary_dict(stats__(which), which == Call_Stats::Depth ? 1.0 : 1000.0);
+    if (!summary || PyDict_SetItemString(result, Call_Stats::name(which), summary) < 0) {
+      return nullptr;
+    }
+  }
+
+  const auto depths = depths__();
+  auto_pyptr pending = Py_BuildValue("{snsnsnsK}",
+    "pool", (Py_ssize_t)depths.pool,
+    "returns", (Py_ssize_t)depths.returns,
+    "parked", (Py_ssize_t)depths.parked,
+    "outstanding", (unsigned long long)depths.outstanding);
+  if (!pending || PyDict_SetItemString(result, "pending", pending) < 0) {
+    return nullptr;
+  }
+
+  if (reset) {
+    stats_reset__();
+  }
+
+  return result.release();
+}
+
+/***
+
+cancel(call_id) asks for call_id to stop, a call that is still queued is never
+run and one that is running sees its token go off (Results::cancelled()); either
+way it finishes failed with Cancelled, unless it had finished already; a
+queued call stops counting against its pool's max_queued at once
+
+returns False when call_id is too old (or too new) to be cancelled, has finished
+already, or shares its slot with an older call that was cancelled and is still
+running (see Cancellations)
+
+***/
+
+static PyObject* cancel(PyObject* module, PyObject* args, PyObject* kwargs) {
+  unsigned long long call_id = 0;
+  static const char* kwlist[] = { "call_id", nullptr };
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "K", const_cast<char**>(kwlist), &call_id)) {
+    return nullptr;
+  }
+
+  return PyBool_FromLong(cancel__(call_id));
+}
+
+/***
+
+registered with atexit by PyInit_PyABI_pyd: the workers (and their interpreters,
+see call_python) have to be gone before Python finalizes
+
+***/
+
+static PyObject* shutdown(PyObject* module, PyObject* args) {
+  Py_BEGIN_ALLOW_THREADS
+  shutdown__();
+  Py_END_ALLOW_THREADS
+
+  Py_RETURN_NONE;
 }
 
 //static PyObject* PyABI_main(PyObject* module, PyObject* args, PyObject* kwargs);
 //static PyObject* PyABI_stop(PyObject* module, PyObject* args, PyObject* kwargs);
 
-static PyMethodDef abi_methods[] = {
+// the exported functions come first, see Exported
+static PyMethodDef module_methods[] = {
+    {
+        "submit_many", (PyCFunction)submit_many, METH_VARARGS | METH_KEYWORDS,
+        "Queue function(*args) for every args tuple in calls, returns the range of their call ids."
+    },
+    {
+        "deque_results", (PyCFunction)deque_results, METH_VARARGS | METH_KEYWORDS,
+        "Return a list of (call_id, success, result) for up to max_n finished calls."
+    },
+    {
+        "wait", (PyCFunction)wait, METH_VARARGS | METH_KEYWORDS,
+        "Block (without the GIL) until call_id has finished, None on timeout."
+    },
     {
-        "hello_world", (PyCFunction)hello_world, METH_VARARGS | METH_KEYWORDS,
-        "Print 'hello world' from a method defined in a C extension."
+        "cancel", (PyCFunction)cancel, METH_VARARGS | METH_KEYWORDS,
+        "Ask call_id to stop, it finishes failed with Cancelled; False if it is too old or already finished."
     },
     {
-        "hello", (PyCFunction)hello, METH_VARARGS | METH_KEYWORDS,
-        "Print 'hello xxx' from a method defined in a C extension."
+        "completion_fd", (PyCFunction)completion_fd, METH_NOARGS,
+        "File descriptor that is readable whenever deque_results() has something."
+    },
+    {
+        "create_pool", (PyCFunction)create_pool, METH_VARARGS | METH_KEYWORDS,
+        "Create a named pool of workers, optionally pinned to cpus or a numa_node."
+    },
+    {
+        "resize_pool", (PyCFunction)resize_pool, METH_VARARGS | METH_KEYWORDS,
+        "Start or retire workers until the pool has that many."
+    },
+    {
+        "pin_pool", (PyCFunction)pin_pool, METH_VARARGS | METH_KEYWORDS,
+        "Pin a pool's workers to cpus or a numa_node, neither unpins them."
+    },
+    {
+        "limit_pool", (PyCFunction)limit_pool, METH_VARARGS | METH_KEYWORDS,
+        "Bound how many calls may wait in a pool and what happens once it is full."
+    },
+    {
+        "route", (PyCFunction)route, METH_VARARGS | METH_KEYWORDS,
+        "Run every later call of function on the named pool."
+    },
+    {
+        "pools", (PyCFunction)pools, METH_NOARGS,
+        "Every pool with its workers, max_workers, pending tasks and cpus."
+    },
+    {
+        "stats", (PyCFunction)stats, METH_VARARGS | METH_KEYWORDS,
+        "Per stage latency percentiles (microseconds) and queue depths, reset=True starts over."
+    },
+    {
+        "_shutdown", (PyCFunction)shutdown, METH_NOARGS,
+        "Stop every worker of every pool, runs at interpreter exit."
     },
-    {nullptr, nullptr, 0, nullptr}
 };
 
+static auto abi_methods = Exported::method_table(module_methods);
+
 static struct PyModuleDef abi_definition = {
     PyModuleDef_HEAD_INIT,
     "PyABI_pyd",
     "PyABI C++",
     -1,
-    abi_methods
+    abi_methods.data()
 };
 
 PyMODINIT_FUNC PyInit_PyABI_pyd(void) {
   Py_Initialize();
-  return PyModule_Create(&abi_definition);
+  PyObject* module = PyModule_Create(&abi_definition);
+  if (!module) {
+    return nullptr;
+  }
+
+  DeadlineExceeded = PyErr_NewException("PyABI_pyd.DeadlineExceeded", PyExc_TimeoutError, nullptr);
+  Overloaded = PyErr_NewException("PyABI_pyd.Overloaded", PyExc_RuntimeError, nullptr);
+  Cancelled = PyErr_NewException("PyABI_pyd.Cancelled", PyExc_Exception, nullptr);
+
+  const std::pair<const char*, PyObject*> exceptions[] = {
+    { "DeadlineExceeded", DeadlineExceeded },
+    { "Overloaded", Overloaded },
+    { "Cancelled", Cancelled },
+  };
+  for (auto& exception : exceptions) {
+    Py_XINCREF(exception.second);
+    if (PyModule_AddObject(module, exception.first, exception.second) < 0) {
+      Py_XDECREF(exception.second);
+      Py_DECREF(module);
+      return nullptr;
+    }
+  }
+
+  // how call_python() runs Python on the workers: "subinterpreter", "free-threaded" or "shared-gil"
+  if (PyModule_AddStringConstant(module, "python_workers", Worker_Interpreter::mode_name()) < 0) {
+    Py_DECREF(module);
+    return nullptr;
+  }
+
+  auto_pyptr atexit = PyImport_ImportModule("atexit");
+  auto_pyptr stop = atexit ? PyObject_GetAttrString(module, "_shutdown") : nullptr;
+  auto_pyptr registered = stop ? PyObject_CallMethod(atexit, "register", "O", stop.get()) : nullptr;
+  if (!registered) {
+    Py_DECREF(module);
+    return nullptr;
+  }
+
+  return module;
 }
 
 // Create some work to test the Thread Pool
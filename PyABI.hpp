@@ -10,32 +10,361 @@ Author: Copyright (c) 2020-2020, Scott McCallum (github.com scott91e1)
 
 #include "src/header.hpp"
 
+/***
+
+the module's exception types, created by PyInit_PyABI_pyd
+
+DeadlineExceeded is the result of a call that could not start before its deadline
+or ran past its timeout, Overloaded is raised when a full pool turns a call away
+and is the result of a call that was shed to make room, Cancelled is the result
+of a call that cancel() stopped
+
+***/
+
+inline PyObject* DeadlineExceeded = nullptr;
+inline PyObject* Overloaded = nullptr;
+inline PyObject* Cancelled = nullptr;
+
+/***
+
+called from a catch (...) around anything that may throw on the calling thread,
+turns what was thrown into the Python error: a PyABI_Exception has set one
+already (and is freed here), anything else becomes a MemoryError or RuntimeError
+
+***/
+
+static void PyABI_raise_caught() {
+    try {
+        throw;
+    }
+    catch (PyABI_Exception* exception) {
+        delete exception;
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_RuntimeError, "the call failed without saying why");
+        }
+    }
+    catch (const std::bad_alloc&) {
+        PyErr_NoMemory();
+    }
+    catch (const std::exception& exception) {
+        PyErr_SetString(PyExc_RuntimeError, exception.what());
+    }
+    catch (...) {
+        PyErr_SetString(PyExc_RuntimeError, "the call threw something that is not an exception");
+    }
+}
+
+/***
+
+what a call asks for that its pool has no say in, it stays with the call and never
+reaches the ThreadPool (see Schedule for what does)
+
+***/
+
+struct Call_Options {
+    // the PyABI_now() the call's cancellation token goes off at, 0 for never
+    uint64_t expires = 0;
+    // the CallIDs that have to finish before the call is queued at all
+    std::vector<uint64_t> after;
+};
+
 class Singleton final {
 
 public:
 
-    Singleton() : NextID(1) {
+    /***
 
+    every exported function, route() sends each one to a pool of its own choosing
+
+    ***/
+
+    enum Function : size_t { Function_hello_world, Function_hello, Function_hello_results, Function_hello_lookup, Function_call_python, FUNCTIONS };
+
+    Singleton() : NextID(1) {
+        const size_t capacity = std::max<size_t>(PyABI_threads, std::thread::hardware_concurrency());
+        ThreadPool* pool = Pools.emplace("default", std::make_unique<ThreadPool>(PyABI_threads, 1 << 16, capacity)).first->second.get();
+        pool->limit(PyABI_max_queued, Overflow::Block);
+        for (auto& route : Routes) {
+            route.store(pool, std::memory_order_relaxed);
+        }
     };
 
     ~Singleton() {
 
     };
 
-    void Return(Results& result) {
-      Mutex.lock();
-      try {
-        Returns.push(result);
+    /***
+
+    called from the workers, many producers and no locks
+
+    if Python has fallen a whole ring behind the result is parked instead, the
+    worker never waits on Python (which may itself be waiting for the pool to
+    make room, see Admit)
+
+    ***/
+
+    void Return(Results&& result) {
+      if (!Returns.try_push(std::move(result))) {
+        std::lock_guard<std::mutex> lock(ConsumerMutex);
+        const uint64_t ID = result.CallID;
+        Parked.emplace(ID, std::move(result));
       }
-      catch (...) {
+      Notify.signal();
+    }
+
+    /***
+
+    called from Python, ConsumerMutex keeps it the single consumer even while
+    wait() runs with the GIL released
+
+    moves up to max_n results into out and returns how many were moved, they only
+    count as taken once collected() says so
+
+    ***/
+
+    size_t deque_results(std::vector<Results>& out, const size_t max_n) {
+      std::lock_guard<std::mutex> lock(ConsumerMutex);
+      Notify.clear();
+
+      size_t count = 0;
 
+      // whatever wait() pulled out of the ring on its way to another CallID
+      auto parked = Parked.begin();
+      while (count < max_n && parked != Parked.end()) {
+        out.push_back(std::move(parked->second));
+        parked = Parked.erase(parked);
+        count++;
       }
-      Mutex.unlock();
+
+      Results result;
+      while (count < max_n && Returns.try_pop(result)) {
+        out.push_back(std::move(result));
+        count++;
+      }
+
+      // only part of the backlog was taken, keep the fd readable for the rest
+      if (!Parked.empty() || Returns.size_approx() > 0) {
+        Notify.signal();
+      }
+
+      return count;
+    }
+
+    // the first taken of what deque_results() moved into batch reached Python, the rest is parked again for next time
+    void collected(std::vector<Results>& batch, const size_t taken) {
+      std::lock_guard<std::mutex> lock(ConsumerMutex);
+      const uint64_t now = PyABI_now();
+      for (size_t i = 0; i < batch.size(); i++) {
+        if (i < taken) {
+          Collect(batch[i], now);
+        }
+        else {
+          const uint64_t ID = batch[i].CallID;
+          Parked.emplace(ID, std::move(batch[i]));
+        }
+      }
+      if (taken < batch.size()) {
+        Notify.signal();
+      }
+    }
+
+    /***
+
+    blocks the calling thread until CallID has been returned or the deadline passes
+
+    Results for other CallIDs found along the way are parked for deque_results()
+
+    ***/
+
+    bool wait(const uint64_t CallID, Results& out, const std::chrono::steady_clock::time_point deadline) {
+      Completion::Waiter waiter(Notify);
+      while (true) {
+        const uint64_t seen = waiter.generation();
+        {
+          std::lock_guard<std::mutex> lock(ConsumerMutex);
+          Results result;
+          while (Returns.try_pop(result)) {
+            const uint64_t ID = result.CallID;
+            Parked.emplace(ID, std::move(result));
+          }
+          auto found = Parked.find(CallID);
+          if (found != Parked.end()) {
+            Collect(found->second, PyABI_now());
+            out = std::move(found->second);
+            Parked.erase(found);
+            return true;
+          }
+        }
+        if (!waiter.wait(seen, deadline)) {
+          return false;
+        }
+      }
+    }
+
+    int completion_fd() const {
+      return Notify.fd();
+    }
+
+    /***
+
+    the per stage histograms (see Call_Stats) and how deep each queue is right now
+
+    ***/
+
+    Histogram::Summary stats(const Call_Stats::Stage stage) {
+      return Stats.summary(stage);
+    }
+
+    void stats_reset() {
+      Stats.reset();
+    }
+
+    struct Depths {
+      size_t pool;
+      size_t returns;
+      size_t parked;
+      uint64_t outstanding;
+    };
+
+    Depths depths() {
+      std::lock_guard<std::mutex> lock(ConsumerMutex);
+      size_t pool = 0;
+      {
+        std::lock_guard<std::mutex> pools(PoolsMutex);
+        for (auto& named : Pools) {
+          pool += named.second->pending();
+        }
+      }
+      return Depths{ pool, Returns.size_approx(), Parked.size(), Outstanding() };
     }
 
+    /***
 
-    void hello_world(const uint64_t CallID, const List& args, const Dict& kwargs, const Tuple& defargs) {
-        Results Result(CallID);
+    named pools, "default" starts with PyABI_threads workers and may grow to one
+    per core, every function runs on "default" until it is routed elsewhere
+
+    a pool is never destroyed, so the routes can be plain atomic pointers
+
+    these are called from Python with the GIL held, errors are raised as Python
+    exceptions
+
+    ***/
+
+    void create_pool(const std::string& name, const size_t workers, const size_t capacity, std::vector<int> cpus) {
+        std::lock_guard<std::mutex> lock(PoolsMutex);
+        if (Pools.count(name)) {
+            PyErr_Format(PyExc_ValueError, "pool '%s' already exists", name.c_str());
+            throw new PyABI_Exception;
+        }
+        if (workers == 0 || workers > capacity) {
+            PyErr_Format(PyExc_ValueError, "pool '%s' needs between 1 and %zu workers", name.c_str(), capacity);
+            throw new PyABI_Exception;
+        }
+        auto pool = std::make_unique<ThreadPool>(workers, 1 << 16, capacity);
+        pool->limit(PyABI_max_queued, Overflow::Block);
+        if (!cpus.empty()) {
+            pool->pin(std::move(cpus));
+        }
+        Pools.emplace(name, std::move(pool));
+    }
+
+    // returns once the retired workers have exited, with the GIL released meanwhile
+    void resize_pool(const std::string& name, const size_t workers) {
+        ThreadPool& pool = Pool(name);
+        if (workers == 0 || workers > pool.capacity()) {
+            PyErr_Format(PyExc_ValueError, "pool '%s' needs between 1 and %zu workers", name.c_str(), pool.capacity());
+            throw new PyABI_Exception;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        pool.resize(workers);
+        Py_END_ALLOW_THREADS
+    }
+
+    void pin_pool(const std::string& name, std::vector<int> cpus) {
+        Pool(name).pin(std::move(cpus));
+    }
+
+    // max_queued 0 lifts the bound
+    void limit_pool(const std::string& name, const size_t max_queued, const Overflow overflow) {
+        Pool(name).limit(max_queued, overflow);
+    }
+
+    void route(const Function function, const std::string& name) {
+        Routes[function].store(&Pool(name), std::memory_order_release);
+    }
+
+    struct Pool_Info {
+        std::string name;
+        size_t workers;
+        size_t capacity;
+        size_t pending;
+        std::vector<int> cpus;
+        size_t queued;
+        size_t max_queued;
+        Overflow overflow;
+        size_t rejected;
+        size_t shed;
+        size_t blocked;
+    };
+
+    /***
+
+    cancels call_id: not run at all if it has not started, its token goes off if
+    it has; false when call_id is not one of the latest calls or has finished
+    (see Cancellations)
+
+    a queued call stops counting against its pool's max_queued at once, a call
+    still waiting for its after= inputs was not counted yet
+
+    ***/
+
+    bool cancel(const uint64_t call_id) {
+        bool queued = false;
+        if (!Cancels.cancel(call_id, NextID.load(std::memory_order_acquire), queued)) {
+            return false;
+        }
+        ThreadPool* pool = Queued_On[call_id & (Cancellations::WINDOW - 1)].load(std::memory_order_relaxed);
+        if (queued && pool) {
+            pool->withdraw(1);
+        }
+        return true;
+    }
+
+    /***
+
+    joins every worker of every pool, called (GIL released) when the interpreter
+    exits so the workers' interpreters and thread states are gone before Python
+    finalizes; anything still queued is dropped
+
+    ***/
+
+    void shutdown() {
+        std::lock_guard<std::mutex> lock(PoolsMutex);
+        for (auto& named : Pools) {
+            named.second->shutdown();
+        }
+    }
+
+    std::vector<Pool_Info> pools() {
+        std::lock_guard<std::mutex> lock(PoolsMutex);
+        std::vector<Pool_Info> info;
+        for (auto& named : Pools) {
+            ThreadPool& pool = *named.second;
+            info.push_back(Pool_Info{ named.first, pool.size(), pool.capacity(), pool.pending(), pool.cpus(),
+                pool.queued(), pool.max_queued(), pool.overflow(), pool.rejected(), pool.shed(), pool.blocked() });
+        }
+        return info;
+    }
+
+
+    /***
+
+    the exported functions, each runs on a worker with its arguments already
+    converted, see Export below for how Python reaches them
+
+    ***/
+
+    void hello_world([[maybe_unused]] Results& Result, [[maybe_unused]] std::string_view encoding, [[maybe_unused]] std::int64_t the_id, [[maybe_unused]] bool must_log) {
 
         /***
 
@@ -43,18 +372,9 @@ public:
 
         ***/
 
-        Return(Result);
     }
-    uint64_t hello_world__(const List& args, const Dict& kwargs = Dict(), const Tuple& defargs = Tuple()) {
-        const uint64_t ID = NextID++;
-        Threads.enqueue(std::bind(&Singleton::hello_world, this, ID, args, kwargs, defargs));
-        return ID;
-    };
-
-    void hello(const uint64_t CallID, const List& Args, const Dict& kwArgs, const Tuple& defargs) {
-        Results Result(CallID);
 
-        const char* name = "scott";
+    void hello([[maybe_unused]] Results& Result, std::string_view name) {
 
         std::cout << "Hello, " << name << std::endl;
 
@@ -64,34 +384,866 @@ public:
 
         ***/
 
-        Return(Result);
     }
-    uint64_t hello__(const List& args, const Dict& kwargs = Dict(), const Tuple& defargs = Tuple()) {
+
+    // a rows x cols matrix counting up from 0 as a memoryview, on its own or with nested containers around it
+    void hello_results(Results& Result, std::int64_t rows, std::int64_t cols, bool nested) {
+        if (rows < 0 || cols < 0) {
+            Result.Fail("rows and cols cannot be negative");
+            return;
+        }
+        std::vector<double> matrix((size_t)(rows * cols));
+        for (size_t i = 0; i < matrix.size(); i++) {
+            matrix[i] = (double)i;
+        }
+        if (!nested) {
+            Result.Return(std::move(matrix), { (size_t)rows, (size_t)cols });
+            return;
+        }
+        std::vector<Object> labels;
+        for (std::int64_t row = 0; row < rows; row++) {
+            labels.push_back(Result.tuple({ Result.number(row), Result.string("row " + std::to_string(row)) }));
+        }
+        Result.Return(Result.dict({
+            { Result.string("matrix"), Result.buffer(std::move(matrix), { (size_t)rows, (size_t)cols }) },
+            { Result.string("rows"), Result.list(labels) },
+            { Result.string("shape"), Result.tuple({ Result.number(rows), Result.number(cols) }) }
+        }));
+    }
+
+    // table[key] for each of keys, None where it is missing
+    void hello_lookup(Results& Result, const Dict& table, const List& keys) {
+        std::vector<Object> found;
+        for (const Object& key : keys.objects()) {
+            const Object* value = table.find(key);
+            found.push_back(value ? *value : Object());
+        }
+        Result.Return(Result.list(found));
+    }
+
+    // target(*args, **kwargs) in the worker's own interpreter, see Worker_Interpreter
+    void call_python(Results& Result, Python_Target target, const List& args, const Dict& kwargs) {
+        Worker_Interpreter::call(Result, target.name, args, kwargs);
+    }
+
+    /***
+
+    marshals the arguments into a fresh Arena on the calling thread (GIL held), the
+    worker reads them in place and writes its Results into the same Arena, which
+    goes away with the Results once Python has taken them
+
+    unpack(Arena&) returns the parameters of method as a tuple, converted from
+    Python (see Export), it only runs once the call has been admitted
+
+    the Arena, its control block and the task all come off free lists, so once warm
+    a call that fits the Arena's inline block costs no heap allocation here at all
+
+    a call with options.after is held back until those calls have finished and is
+    then queued with their Results as its Inputs, see Continue
+
+    ***/
+
+    template<class... Args, class Unpack>
+    uint64_t Dispatch(const Function function, void (Singleton::*method)(Results&, Args...), Unpack&& unpack, const Schedule& schedule, const Call_Options& options) {
+        Depends_On(options.after);
+
+        ThreadPool& pool = *Routes[function].load(std::memory_order_acquire);
+        Admit(pool, 1);
+
+        auto memory = make_arena();
+        std::tuple<std::decay_t<Args>...> values = unpack(*memory);
+
+        Stats.record(Call_Stats::Depth, Outstanding());
+
         const uint64_t ID = NextID++;
-        Threads.enqueue(std::bind(&Singleton::hello, this, ID, args, kwargs, defargs));
+        Queued_On[ID & (Cancellations::WINDOW - 1)].store(options.after.empty() ? &pool : nullptr, std::memory_order_relaxed);
+        auto run = [this, method, ID, memory = std::move(memory), values = std::move(values), enqueued = PyABI_now(), deadline = schedule.deadline, expires = options.expires](std::vector<std::shared_ptr<const Results>>&& inputs) mutable {
+            Results Result(ID, std::move(memory));
+            Result.Enqueued = enqueued;
+            Result.Expires = expires;
+            Result.Inputs = std::move(inputs);
+            Run(Result, deadline, [&]() {
+                std::apply([&](auto&... value) { (this->*method)(Result, value...); }, values);
+            });
+        };
+
+        if (!options.after.empty()) {
+            Continue(pool, schedule, options.after, std::move(run));
+            return ID;
+        }
+
+        auto call = [run = std::move(run)]() mutable { run({}); };
+        static_assert(ThreadPool::fits_inline<decltype(call)>, "a call has to fit in a Task without being boxed");
+
+        pool.post(std::move(call), schedule);
         return ID;
-    };
+    }
+
+    /***
+
+    Dispatch for a whole batch: everything is marshaled before anything is queued,
+    so a bad argument anywhere fails the batch as a whole, then the batch gets one
+    contiguous block of CallIDs and is handed to the pool in a few chunks per worker
+    (enough to keep stealing useful, at most 256 calls each) with a single wakeup
+
+    a chunk runs start to finish on one worker, so its calls share one Arena which
+    is freed once Python has taken the last of their Results
+
+    unpack(Arena&, i) returns the parameters of the i-th call, returns the first
+    CallID of the block; a batch cannot depend on other calls, options.after is
+    ignored
+
+    ***/
+
+    template<class... Args, class Unpack>
+    uint64_t Dispatch_many(const Function function, void (Singleton::*method)(Results&, Args...), const size_t count, Unpack&& unpack, const Schedule& schedule, const Call_Options& options) {
+        using Values = std::tuple<std::decay_t<Args>...>;
+
+        ThreadPool& pool = *Routes[function].load(std::memory_order_acquire);
+        Admit(pool, count);
+
+        // small enough that higher priority work never waits long behind a chunk
+        const size_t chunks = pool.size() * 4;
+        const size_t chunk = std::min<size_t>(std::max<size_t>(1, (count + chunks - 1) / chunks), 256);
+
+        std::vector<std::pair<ArenaPtr, std::vector<Values>>> parts;
+        parts.reserve((count + chunk - 1) / chunk);
+        for (size_t begin = 0; begin < count; begin += chunk) {
+            const size_t end = std::min(count, begin + chunk);
+            auto memory = make_arena();
+            std::vector<Values> part;
+            part.reserve(end - begin);
+            for (size_t i = begin; i < end; i++) {
+                part.push_back(unpack(*memory, i));
+            }
+            parts.emplace_back(std::move(memory), std::move(part));
+        }
+
+        Stats.record(Call_Stats::Depth, Outstanding());
+
+        const uint64_t first = NextID.fetch_add(count);
+        for (size_t i = 0; i < count; i++) {
+            Queued_On[(first + i) & (Cancellations::WINDOW - 1)].store(&pool, std::memory_order_relaxed);
+        }
+        const uint64_t enqueued = PyABI_now();
+
+        uint64_t ID = first;
+        pool.post_many(parts.size(), [&](const size_t p) {
+            const size_t size = parts[p].second.size();
+            auto chunk = [this, method, ID, enqueued, deadline = schedule.deadline, expires = options.expires, memory = std::move(parts[p].first), part = std::move(parts[p].second)]() {
+                for (size_t i = 0; i < part.size(); i++) {
+                    Results Result(ID + i, memory);
+                    Result.Enqueued = enqueued;
+                    Result.Expires = expires;
+                    Run(Result, deadline, [&]() {
+                        std::apply([&](auto&... value) { (this->*method)(Result, value...); }, part[i]);
+                    });
+                }
+            };
+            static_assert(ThreadPool::fits_inline<decltype(chunk)>, "a chunk has to fit in a Task without being boxed");
+            ID += size;
+            return std::make_pair(std::move(chunk), size);
+        }, schedule);
+
+        return first;
+    }
 
 private:
 
-    std::mutex Mutex;
+    /***
+
+    runs one call on a worker and hands its Results back, a call that has been
+    cancelled, timed out or missed its deadline is not run at all
+
+    a call that returns has succeeded unless it said otherwise with Result.Fail()
+    or its token went off while it ran, one that throws fails with the exception's
+    message rather than taking the worker down with it
+
+    ***/
+
+    template<class Invoke>
+    void Run(Results& Result, const uint64_t deadline, Invoke&& invoke) {
+        Result.Cancels = &Cancels;
+        Result.Started = PyABI_now();
+        // cancel() took it out of its pool's count while it was queued, see Cancellations
+        const bool counted = Result.Inputs.empty();
+        if (Cancels.started(Result.CallID) && counted) {
+            ThreadPool::current()->withdrawn_started(1);
+        }
+        const Results::Failure stopped = Result.stopped();
+        if (stopped != Results::Failure::None) {
+            Result.Success = false;
+            Result.Reason = stopped;
+        }
+        else if (ThreadPool::shedding()) {
+            Result.Success = false;
+            Result.Reason = Results::Failure::Shed;
+        }
+        else if (deadline && Result.Started > deadline) {
+            Result.Success = false;
+            Result.Reason = Results::Failure::Expired;
+        }
+        else {
+            Result.Success = true;
+            try {
+                invoke();
+            }
+            catch (PyABI_Exception* exception) {
+                delete exception;
+                Result.Fail("the call read a value as the wrong type or out of range");
+            }
+            catch (const std::exception& exception) {
+                Result.Fail(exception.what());
+            }
+            catch (...) {
+                Result.Fail("the call threw");
+            }
+
+            const Results::Failure late = Result.stopped();
+            if (late != Results::Failure::None) {
+                Result.Success = false;
+                Result.Reason = late;
+                Result.Result = Object();
+            }
+        }
+        Result.Finished = PyABI_now();
+        if (Cancels.finished(Result.CallID) && counted) {
+            ThreadPool::current()->withdrawn_started(1);
+        }
+
+        // let go of the inputs first, the last call to do so sends them on to Python
+        Result.Inputs.clear();
+
+        Stats.record(Call_Stats::Queue, Result.Started - Result.Enqueued);
+        Stats.record(Call_Stats::Execute, Result.Finished - Result.Started);
+
+        if (Watched.finish(Result.CallID)) {
+            Resolve(std::move(Result));
+        }
+        else {
+            Return(std::move(Result));
+        }
+    }
+
+    /***
+
+    continuations: a call submitted with after= is a Continuation, it waits for
+    one input per CallID it names and is queued by whichever thread supplies the
+    last of them, so the stages of a pipeline follow each other on the workers
+    without going back through Python
+
+    a finished call that something depends on is Held: its Results are shared by
+    the calls waiting for it and are handed to Python (Release) once the last of
+    them has run
+
+    DependsMutex guards Waiting and Held, it is taken before ConsumerMutex
+
+    ***/
+
+    struct Continuation {
+        virtual ~Continuation() = default;
+        virtual void launch() = 0;
+
+        // one more for the submitting thread, so nothing launches before it is done
+        std::atomic<size_t> waiting{ 1 };
+        std::vector<std::shared_ptr<const Results>> inputs;
+    };
+
+    template<class Call>
+    struct Continuation_Of final : Continuation {
+        Continuation_Of(ThreadPool& pool, const Schedule& schedule, Call&& run)
+            : pool(pool), schedule(schedule), run(std::move(run)) {
+        }
+
+        void launch() override {
+            pool.post([run = std::move(run), inputs = std::move(inputs)]() mutable { run(std::move(inputs)); }, schedule);
+        }
+
+        ThreadPool& pool;
+        Schedule schedule;
+        Call run;
+    };
+
+    // raises unless every CallID in after can still be depended on, called before the call gets its own
+    void Depends_On(const std::vector<uint64_t>& after) {
+        const uint64_t next = NextID.load(std::memory_order_acquire);
+        for (const uint64_t id : after) {
+            if (id == 0 || id >= next || next - id > Watches::WINDOW) {
+                PyErr_Format(PyExc_ValueError, "call %llu cannot be depended on, it is unknown or too old", (unsigned long long)id);
+                throw new PyABI_Exception;
+            }
+            if (Watched.state(id) == Watches::State::Collected) {
+                PyErr_Format(PyExc_ValueError, "call %llu cannot be depended on, its result has been collected", (unsigned long long)id);
+                throw new PyABI_Exception;
+            }
+            if (!Watched.available(id)) {
+                PyErr_Format(PyExc_ValueError, "call %llu cannot be depended on, an older call that is still depended on shares its slot", (unsigned long long)id);
+                throw new PyABI_Exception;
+            }
+        }
+    }
+
+    // called from Python once Depends_On has passed, nothing here can fail
+    template<class Call>
+    void Continue(ThreadPool& pool, const Schedule& schedule, const std::vector<uint64_t>& after, Call&& run) {
+        auto continuation = std::make_shared<Continuation_Of<Call>>(pool, schedule, std::move(run));
+        continuation->inputs.resize(after.size());
+        continuation->waiting += after.size();
+
+        for (size_t i = 0; i < after.size(); i++) {
+            const uint64_t id = after[i];
+            std::shared_ptr<const Results> input;
+            bool watching = false;
+            while (true) {
+                std::unique_lock<std::mutex> lock(DependsMutex);
+                if (Watched.watch(id)) {
+                    Waiting[id].emplace_back(continuation, i);
+                    watching = true;
+                    break;
+                }
+
+                const Watches::State state = Watched.state(id);
+                if (state == Watches::State::Held) {
+                    input = Held[id].lock();
+                }
+                else if (state == Watches::State::Finished) {
+                    input = Hold(id);
+                }
+                if (input || state == Watches::State::Collected) {
+                    break;
+                }
+
+                // finished but not in the ring yet, or on its way back from its last watcher
+                lock.unlock();
+                std::this_thread::yield();
+            }
+            if (!watching) {
+                Supply(*continuation, i, std::move(input));
+            }
+        }
+
+        Supply(*continuation, after.size(), nullptr);
+    }
+
+    // the slot-th input of continuation, slot past the inputs releases the submitter's share
+    void Supply(Continuation& continuation, const size_t slot, std::shared_ptr<const Results> input) {
+        if (slot < continuation.inputs.size()) {
+            continuation.inputs[slot] = std::move(input);
+        }
+        if (continuation.waiting.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            continuation.launch();
+        }
+    }
+
+    // Results that are finished but not collected, out of the ring, with DependsMutex held
+    std::shared_ptr<const Results> Hold(const uint64_t id) {
+        std::lock_guard<std::mutex> lock(ConsumerMutex);
+        Results result;
+        while (Returns.try_pop(result)) {
+            const uint64_t ID = result.CallID;
+            Parked.emplace(ID, std::move(result));
+        }
+        auto found = Parked.find(id);
+        if (found == Parked.end()) {
+            return nullptr;
+        }
+        auto held = Share(std::move(found->second));
+        Parked.erase(found);
+        return held;
+    }
+
+    // with DependsMutex held
+    std::shared_ptr<const Results> Share(Results&& result) {
+        const uint64_t ID = result.CallID;
+        std::shared_ptr<const Results> held(new Results(std::move(result)), [this](const Results* last) { Release(last); });
+        Held[ID] = held;
+        Watched.set(ID, Watches::State::Held);
+        return held;
+    }
+
+    // a watched call has finished on this worker, its watchers get its Results
+    void Resolve(Results&& result) {
+        const uint64_t ID = result.CallID;
+        std::shared_ptr<const Results> held;
+        std::vector<std::pair<std::shared_ptr<Continuation>, size_t>> waiting;
+        {
+            std::lock_guard<std::mutex> lock(DependsMutex);
+            held = Share(std::move(result));
+            auto found = Waiting.find(ID);
+            if (found != Waiting.end()) {
+                waiting = std::move(found->second);
+                Waiting.erase(found);
+            }
+        }
+        // the last one takes this thread's share, so the Results are not kept from Python here
+        for (size_t i = 0; i < waiting.size(); i++) {
+            Supply(*waiting[i].first, waiting[i].second, i + 1 < waiting.size() ? held : std::move(held));
+        }
+    }
+
+    // the last call depending on these Results is done with them
+    void Release(const Results* last) {
+        std::unique_ptr<Results> result(const_cast<Results*>(last));
+        {
+            std::lock_guard<std::mutex> lock(DependsMutex);
+            Held.erase(result->CallID);
+            Watched.set(result->CallID, Watches::State::Finished);
+        }
+        Return(std::move(*result));
+    }
+
+    // a Results is on its way to Python, called with ConsumerMutex held
+    void Collect(const Results& result, const uint64_t now) {
+        Watched.collected(result.CallID);
+        Stats.record(Call_Stats::Return, now - result.Finished);
+        Stats.record(Call_Stats::Total, now - result.Enqueued);
+        Collected.store(Collected.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // Collected first, whatever it counts was issued before NextID is read
+    uint64_t Outstanding() const {
+        const uint64_t collected = Collected.load(std::memory_order_acquire);
+        return NextID.load(std::memory_order_acquire) - 1 - collected;
+    }
 
     std::atomic<uint64_t> NextID;
 
-    std::queue<Results> Returns;
+    // bumped under ConsumerMutex, read from anywhere
+    std::atomic<uint64_t> Collected{ 0 };
+
+    Call_Stats Stats;
+
+    Cancellations Cancels;
+
+    // the pool each of the latest calls was queued on, nullptr while it waits for its after= inputs
+    std::unique_ptr<std::atomic<ThreadPool*>[]> Queued_On{ new std::atomic<ThreadPool*>[Cancellations::WINDOW]() };
+
+    Watches Watched;
+
+    BoundedQueue<Results> Returns{ 1 << 16 };
+
+    Completion Notify;
+
+    std::mutex ConsumerMutex;
+
+    std::unordered_map<uint64_t, Results> Parked;
+
+    std::mutex DependsMutex;
+
+    std::unordered_map<uint64_t, std::weak_ptr<const Results>> Held;
+
+    // what each watched CallID is an input of, and which input
+    std::unordered_map<uint64_t, std::vector<std::pair<std::shared_ptr<Continuation>, size_t>>> Waiting;
+
+    /***
+
+    admission control, called with the GIL held before anything is marshaled
+
+    a full pool either turns the call away with Overloaded, sheds its oldest work,
+    or makes the caller wait with the GIL released (in slices, so Ctrl-C works);
+    shedding falls back to waiting when what is left is not sheddable
 
-    ThreadPool Threads{ PyABI_threads };
+    ***/
+
+    void Admit(ThreadPool& pool, const size_t weight) {
+        if (pool.has_room(weight)) {
+            return;
+        }
+
+        const Overflow overflow = pool.overflow();
+        if (overflow == Overflow::Reject) {
+            pool.rejected(weight);
+            PyErr_Format(Overloaded, "the pool has %zu calls queued, at most %zu are allowed", pool.queued(), pool.max_queued());
+            throw new PyABI_Exception;
+        }
+        if (overflow == Overflow::Shed_Oldest && pool.shed(weight)) {
+            return;
+        }
+
+        while (true) {
+            bool room;
+            Py_BEGIN_ALLOW_THREADS
+            room = pool.wait_for_room(weight, std::chrono::steady_clock::now() + std::chrono::milliseconds(100));
+            Py_END_ALLOW_THREADS
+            if (room) {
+                return;
+            }
+            if (PyErr_CheckSignals() < 0) {
+                throw new PyABI_Exception;
+            }
+        }
+    }
+
+    ThreadPool& Pool(const std::string& name) {
+        std::lock_guard<std::mutex> lock(PoolsMutex);
+        auto found = Pools.find(name);
+        if (found == Pools.end()) {
+            PyErr_Format(PyExc_KeyError, "no pool named '%s'", name.c_str());
+            throw new PyABI_Exception;
+        }
+        return *found->second;
+    }
+
+    std::atomic<ThreadPool*> Routes[FUNCTIONS];
+
+    std::mutex PoolsMutex;
+
+    // last, so the workers are gone before anything they use
+    std::unordered_map<std::string, std::unique_ptr<ThreadPool>> Pools;
 
 };
 
 static Singleton SingletonInstance;
 
-uint64_t hello_world__(PyObject* args, PyObject* kwargs, PyObject* defargs) {
-    return SingletonInstance.hello_world__(args, kwargs, defargs);
+/***
+
+the priority, deadline and timeout keywords every call takes, any may be nullptr
+
+priority  > 0 runs before the normal calls, < 0 after them, 0 by default
+deadline  seconds from now by which the call has to start, a call that starts
+          later is not run and comes back failed with a DeadlineExceeded
+timeout   seconds from now after which the call's cancellation token goes off,
+          it comes back failed with a DeadlineExceeded unless it finished first
+
+single calls also take after, see after_from
+
+***/
+
+// seconds from now (None for never) as a PyABI_now(), false with an error set
+static bool time_from(PyObject* seconds_from_now, uint64_t& when) {
+    when = 0;
+    if (seconds_from_now && seconds_from_now != Py_None) {
+        const double seconds = PyFloat_AsDouble(seconds_from_now);
+        if (seconds == -1.0 && PyErr_Occurred()) {
+            return false;
+        }
+        when = PyABI_now() + (uint64_t)(std::max(seconds, 0.0) * 1e9);
+    }
+    return true;
+}
+
+static bool schedule_from(PyObject* priority, PyObject* deadline, PyObject* timeout, Schedule& schedule, Call_Options& options) {
+    schedule = Schedule();
+
+    if (priority) {
+        const long level = PyLong_AsLong(priority);
+        if (level == -1 && PyErr_Occurred()) {
+            return false;
+        }
+        schedule.priority = (int)std::max(-1L, std::min(1L, level));
+    }
+
+    return time_from(deadline, schedule.deadline) && time_from(timeout, options.expires);
+}
+
+/***
+
+after  a CallID or a sequence of them, the call is queued once they have all
+       finished and gets their Results as its Inputs, see Singleton::Continue
+
+***/
+
+static bool after_from(PyObject* after, Call_Options& options) {
+    options.after.clear();
+    if (!after || after == Py_None) {
+        return true;
+    }
+
+    if (PyLong_Check(after)) {
+        options.after.push_back(PyLong_AsUnsignedLongLong(after));
+        return !PyErr_Occurred();
+    }
+
+    auto_pyptr ids = PySequence_Fast(after, "after must be a call id or a sequence of call ids");
+    if (!ids) {
+        return false;
+    }
+    const Py_ssize_t count = PySequence_Fast_GET_SIZE(ids.get());
+    PyObject** items = PySequence_Fast_ITEMS(ids.get());
+    options.after.reserve(count);
+    for (Py_ssize_t i = 0; i < count; i++) {
+        options.after.push_back(PyLong_AsUnsignedLongLong(items[i]));
+        if (PyErr_Occurred()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/***
+
+Export<Entry> is everything Python needs to call one Singleton method, generated
+from the method's signature and an Entry naming its parameters:
+
+struct hello_export {
+    static constexpr const char* name = "hello";                       the Python name
+    static constexpr const char* doc = "...";
+    static constexpr auto function = Singleton::Function_hello;       what route() moves
+    static constexpr auto method = &Singleton::hello;
+    static constexpr std::array<const char*, 1> keywords = { "name" };
+    static inline const auto defaults = std::make_tuple(Required());
+};
+
+keywords and defaults have one entry per parameter after the Results&, a default
+is converted to the parameter's type and Required() makes the parameter required
+
+call() is the METH_FASTCALL | METH_KEYWORDS entry point: the arguments go straight
+from the vector Python passes into the parameters (see Argument), no args tuple,
+kwargs dict or PyArg_ParseTupleAndKeywords on the way, and it returns the CallID;
+many() does the same for every args tuple of a submit_many() batch
+
+***/
+
+// the default of a parameter that has to be given
+struct Required {
+};
+
+template<class Method>
+struct Method_Parameters;
+
+template<class... Args>
+struct Method_Parameters<void (Singleton::*)(Results&, Args...)> {
+    using Values = std::tuple<std::decay_t<Args>...>;
+};
+
+template<class Entry>
+struct Export final {
+
+    using Values = typename Method_Parameters<std::decay_t<decltype(Entry::method)>>::Values;
+    using Defaults = std::decay_t<decltype(Entry::defaults)>;
+
+    static constexpr size_t PARAMETERS = std::tuple_size<Values>::value;
+
+    static_assert(Entry::keywords.size() == PARAMETERS, "one keyword per parameter of the method");
+    static_assert(std::tuple_size<Defaults>::value == PARAMETERS, "one default (or Required()) per parameter of the method");
+
+    static PyObject* call([[maybe_unused]] PyObject* module, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+        Buffer_Pin::release_pending();
+
+        PyObject* slots[PARAMETERS + 4];
+        if (!keywords().bind(args, nargs, kwnames, slots)) {
+            return nullptr;
+        }
+
+        Schedule schedule;
+        Call_Options options;
+        if (!schedule_from(slots[PARAMETERS], slots[PARAMETERS + 1], slots[PARAMETERS + 2], schedule, options) || !after_from(slots[PARAMETERS + 3], options)) {
+            return nullptr;
+        }
+
+        uint64_t call_id = 0;
+        try {
+            call_id = SingletonInstance.Dispatch(Entry::function, Entry::method, [&](Arena& arena) {
+                return unpack(arena, slots, std::make_index_sequence<PARAMETERS>());
+            }, schedule, options);
+        }
+        catch (...) {
+            // an argument that could not be converted, a full pool, ...
+            PyABI_raise_caught();
+            return nullptr;
+        }
+
+        return PyLong_FromUnsignedLongLong(call_id);
+    }
+
+    // calls[i] is the args tuple of the i-th call, returns the first CallID
+    static uint64_t many(PyObject* const* calls, const size_t count, const Schedule& schedule, const Call_Options& options) {
+        return SingletonInstance.Dispatch_many(Entry::function, Entry::method, count, [&](Arena& arena, const size_t i) {
+            PyObject* slots[PARAMETERS + 4];
+            if (!keywords().bind(&PyTuple_GET_ITEM(calls[i], 0), PyTuple_GET_SIZE(calls[i]), nullptr, slots)) {
+                throw new PyABI_Exception;
+            }
+            return unpack(arena, slots, std::make_index_sequence<PARAMETERS>());
+        }, schedule, options);
+    }
+
+private:
+
+    // the parameters of the method then the scheduling keywords, only the former by position
+    static const Fastcall_Keywords<PARAMETERS + 4>& keywords() {
+        static const Fastcall_Keywords<PARAMETERS + 4> bound(Entry::name, names(std::make_index_sequence<PARAMETERS>()), PARAMETERS);
+        return bound;
+    }
+
+    template<size_t... I>
+    static std::array<const char*, PARAMETERS + 4> names(std::index_sequence<I...>) {
+        return { { Entry::keywords[I]..., "priority", "deadline", "timeout", "after" } };
+    }
+
+    // braces, so the parameters are converted left to right
+    template<size_t... I>
+    static Values unpack(Arena& arena, PyObject* const* slots, std::index_sequence<I...>) {
+        return Values{ parameter<I>(arena, slots[I])... };
+    }
+
+    template<size_t I>
+    static std::tuple_element_t<I, Values> parameter(Arena& arena, PyObject* object) {
+        using Type = std::tuple_element_t<I, Values>;
+        using Default = std::tuple_element_t<I, Defaults>;
+
+        if (object) {
+            return Argument<Type>::from(arena, object, Entry::name, Entry::keywords[I]);
+        }
+        if constexpr (std::is_same<Default, Required>::value) {
+            PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s'", Entry::name, Entry::keywords[I]);
+            throw new PyABI_Exception;
+        }
+        else {
+            return Type(std::get<I>(Entry::defaults));
+        }
+    }
+
+};
+
+// what submit_many() and route() need to know about an exported function
+struct Export_Method {
+    PyCFunction call;
+    Singleton::Function function;
+    uint64_t (*many)(PyObject* const* calls, const size_t count, const Schedule& schedule, const Call_Options& options);
+};
+
+template<class... Entries>
+struct Exports final {
+
+    static constexpr size_t COUNT = sizeof...(Entries);
+
+    // a PyMethodDef for every export followed by methods, terminated
+    template<size_t N>
+    static std::array<PyMethodDef, COUNT + N + 1> method_table(const PyMethodDef (&methods)[N]) {
+        std::array<PyMethodDef, COUNT + N + 1> table = { {
+            { Entries::name, (PyCFunction)(void (*)(void))Export<Entries>::call, METH_FASTCALL | METH_KEYWORDS, Entries::doc }...
+        } };
+        for (size_t i = 0; i < N; i++) {
+            table[COUNT + i] = methods[i];
+        }
+        table[COUNT + N] = PyMethodDef{ nullptr, nullptr, 0, nullptr };
+        return table;
+    }
+
+    // which export function is, TypeError if none of them
+    static const Export_Method* find(PyObject* function, const char* caller) {
+        static const Export_Method methods[] = {
+            { (PyCFunction)(void (*)(void))Export<Entries>::call, Entries::function, Export<Entries>::many }...
+        };
+        if (PyCFunction_Check(function)) {
+            for (auto& method : methods) {
+                if (method.call == PyCFunction_GetFunction(function)) {
+                    return &method;
+                }
+            }
+        }
+        PyErr_Format(PyExc_TypeError, "%s() expects one of this module's call functions", caller);
+        return nullptr;
+    }
+
+};
+
+struct hello_world_export {
+    static constexpr const char* name = "hello_world";
+    static constexpr const char* doc = "Print 'hello world' from a method defined in a C extension.";
+    static constexpr auto function = Singleton::Function_hello_world;
+    static constexpr auto method = &Singleton::hello_world;
+    static constexpr std::array<const char*, 3> keywords = { "encoding", "the_id", "must_log" };
+    static inline const auto defaults = std::make_tuple(std::string_view("utf-8"), std::int64_t(0), true);
+};
+
+struct hello_export {
+    static constexpr const char* name = "hello";
+    static constexpr const char* doc = "Print 'hello xxx' from a method defined in a C extension.";
+    static constexpr auto function = Singleton::Function_hello;
+    static constexpr auto method = &Singleton::hello;
+    static constexpr std::array<const char*, 1> keywords = { "name" };
+    static inline const auto defaults = std::make_tuple(Required());
+};
+
+struct hello_results_export {
+    static constexpr const char* name = "hello_results";
+    static constexpr const char* doc = "Return a rows x cols matrix as a read-only memoryview, nested in a dict of lists and tuples unless nested is False.";
+    static constexpr auto function = Singleton::Function_hello_results;
+    static constexpr auto method = &Singleton::hello_results;
+    static constexpr std::array<const char*, 3> keywords = { "rows", "cols", "nested" };
+    static inline const auto defaults = std::make_tuple(Required(), Required(), true);
+};
+
+struct hello_lookup_export {
+    static constexpr const char* name = "hello_lookup";
+    static constexpr const char* doc = "Look each of keys up in table on a worker, a list of the values with None for the missing ones.";
+    static constexpr auto function = Singleton::Function_hello_lookup;
+    static constexpr auto method = &Singleton::hello_lookup;
+    static constexpr std::array<const char*, 2> keywords = { "table", "keys" };
+    static inline const auto defaults = std::make_tuple(Required(), Required());
+};
+
+struct call_python_export {
+    static constexpr const char* name = "call_python";
+    static constexpr const char* doc = "Run target(*args, **kwargs) in a worker's own interpreter, target is 'module:function' or a module level function.";
+    static constexpr auto function = Singleton::Function_call_python;
+    static constexpr auto method = &Singleton::call_python;
+    static constexpr std::array<const char*, 3> keywords = { "target", "args", "kwargs" };
+    static inline const auto defaults = std::make_tuple(Required(), List(), Dict());
+};
+
+// every exported function, in the order the module lists them
+using Exported = Exports<hello_world_export, hello_export, hello_results_export, hello_lookup_export, call_python_export>;
+
+size_t deque_results__(std::vector<Results>& out, const size_t max_n) {
+    return SingletonInstance.deque_results(out, max_n);
+};
+
+void collected__(std::vector<Results>& batch, const size_t taken) {
+    SingletonInstance.collected(batch, taken);
+};
+
+bool wait__(const uint64_t call_id, Results& out, const std::chrono::steady_clock::time_point deadline) {
+    return SingletonInstance.wait(call_id, out, deadline);
+};
+
+int completion_fd__() {
+    return SingletonInstance.completion_fd();
+};
+
+Histogram::Summary stats__(const Call_Stats::Stage stage) {
+    return SingletonInstance.stats(stage);
+};
+
+void stats_reset__() {
+    SingletonInstance.stats_reset();
+};
+
+Singleton::Depths depths__() {
+    return SingletonInstance.depths();
+};
+
+void create_pool__(const std::string& name, const size_t workers, const size_t capacity, std::vector<int> cpus) {
+    SingletonInstance.create_pool(name, workers, capacity, std::move(cpus));
+};
+
+void resize_pool__(const std::string& name, const size_t workers) {
+    SingletonInstance.resize_pool(name, workers);
+};
+
+void pin_pool__(const std::string& name, std::vector<int> cpus) {
+    SingletonInstance.pin_pool(name, std::move(cpus));
+};
+
+void limit_pool__(const std::string& name, const size_t max_queued, const Overflow overflow) {
+    SingletonInstance.limit_pool(name, max_queued, overflow);
+};
+
+void route__(const Singleton::Function function, const std::string& name) {
+    SingletonInstance.route(function, name);
+};
+
+std::vector<Singleton::Pool_Info> pools__() {
+    return SingletonInstance.pools();
+};
+
+void shutdown__() {
+    SingletonInstance.shutdown();
 };
 
-uint64_t hello__(PyObject* args, PyObject* kwargs, PyObject* defargs) {
-    return SingletonInstance.hello__(args, kwargs, defargs);
+bool cancel__(const uint64_t call_id) {
+    return SingletonInstance.cancel(call_id);
 };
 
 
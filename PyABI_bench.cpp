@@ -0,0 +1,1035 @@
+/***
+
+License: MIT License
+
+Author: Copyright (c) 2020-2020, Scott McCallum (github.com scott91e1)
+
+Benchmarks for the dispatch core, see BENCH.cmd
+
+  PyABI_bench threadpool|marshal|dispatch|dict|load|retro|vmpool [--json] [options]
+
+every benchmark prints a table, or with --json one JSON object per row
+
+***/
+
+#include <string>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+#include <iostream>
+#include <cstdlib>
+#include <new>
+
+#include "src/header.hpp"
+
+#include "src/argparse/argparse.hpp"
+
+// the module's own dispatch path, for the dispatch benchmark
+auto PyABI_threads = 4;
+auto PyABI_max_queued = 1 << 16;
+
+#include "PyABI.hpp"
+
+#include "src/retroforth_jit.hpp"
+#include "src/retroforth_pool.hpp"
+
+/***
+
+every C++ heap allocation in this process is counted, Python's own go through
+its allocator and are not
+
+***/
+
+static std::atomic<std::uint64_t> bench_allocations{ 0 };
+
+// every replaceable operator new comes here, the nothrow ones call the throwing ones
+static void* bench_allocate(std::size_t size, const std::size_t alignment) {
+  bench_allocations.fetch_add(1, std::memory_order_relaxed);
+  size = size ? size : 1;
+  void* pointer = alignment > alignof(std::max_align_t)
+    ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)
+    : std::malloc(size);
+  if (pointer)
+    return pointer;
+  throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size) {
+  return bench_allocate(size, 0);
+}
+
+void* operator new[](std::size_t size) {
+  return bench_allocate(size, 0);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+  return bench_allocate(size, (std::size_t)alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+  return bench_allocate(size, (std::size_t)alignment);
+}
+
+void operator delete(void* pointer) noexcept {
+  std::free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+  std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+  std::free(pointer);
+}
+
+void operator delete[](void* pointer, std::size_t) noexcept {
+  std::free(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t) noexcept {
+  std::free(pointer);
+}
+
+void operator delete[](void* pointer, std::align_val_t) noexcept {
+  std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t, std::align_val_t) noexcept {
+  std::free(pointer);
+}
+
+void operator delete[](void* pointer, std::size_t, std::align_val_t) noexcept {
+  std::free(pointer);
+}
+
+/***
+
+Report prints the rows of a benchmark as an aligned table, or with --json as one
+JSON object per row (the benchmark, its parameters and every column, unrounded)
+so that runs before and after a change can be compared by a script
+
+***/
+
+class Report final {
+
+public:
+
+  static bool json;
+
+  struct Cell {
+    Cell(const char* text) : text(text) {}
+    Cell(std::string text) : text(std::move(text)) {}
+    template<class T, std::enable_if_t<std::is_arithmetic<T>::value, int> = 0>
+    Cell(const T value) : number(true), value((double)value) {}
+
+    std::string text;
+    bool number = false;
+    double value = 0;
+  };
+
+  struct Column {
+    const char* key;
+    const char* header;
+    int width;
+    int precision;
+    const char* suffix;
+  };
+
+  Report(std::string benchmark, const std::string& title, std::vector<std::pair<const char*, Cell>> parameters, std::vector<Column> columns)
+    : m_benchmark(std::move(benchmark)), m_parameters(std::move(parameters)), m_columns(std::move(columns)) {
+    if (json)
+      return;
+    std::cout << title << std::endl;
+    for (auto& column : m_columns)
+      std::cout << std::setw(column.width) << column.header;
+    std::cout << std::endl;
+  }
+
+  void row(const std::vector<Cell>& cells) const {
+    if (json) {
+      std::cout << "{\"benchmark\": " << quoted(m_benchmark);
+      for (auto& parameter : m_parameters)
+        std::cout << ", " << quoted(parameter.first) << ": " << value(parameter.second);
+      for (std::size_t i = 0; i < cells.size() && i < m_columns.size(); i++)
+        std::cout << ", " << quoted(m_columns[i].key) << ": " << value(cells[i]);
+      std::cout << "}" << std::endl;
+      return;
+    }
+    for (std::size_t i = 0; i < cells.size() && i < m_columns.size(); i++) {
+      const Column& column = m_columns[i];
+      std::ostringstream text;
+      if (cells[i].number)
+        text << std::fixed << std::setprecision(column.precision) << cells[i].value;
+      else
+        text << cells[i].text;
+      text << column.suffix;
+      std::cout << std::setw(column.width) << text.str();
+    }
+    std::cout << std::endl;
+  }
+
+private:
+
+  static std::string quoted(const std::string& text) {
+    std::string result = "\"";
+    for (const char c : text) {
+      if (c == '"' || c == '\\')
+        result += '\\';
+      result += c;
+    }
+    return result + "\"";
+  }
+
+  static std::string value(const Cell& cell) {
+    if (!cell.number)
+      return quoted(cell.text);
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.9g", cell.value);
+    return text;
+  }
+
+  std::string m_benchmark;
+  std::vector<std::pair<const char*, Cell>> m_parameters;
+  std::vector<Column> m_columns;
+
+};
+
+bool Report::json = false;
+
+/***
+
+The original single mutex pool, kept as the baseline for the contention benchmark
+
+https://codereview.stackexchange.com/questions/229560/implementation-of-a-thread-pool-in-c
+
+***/
+
+class ThreadPool_Mutex final
+{
+public:
+
+  explicit ThreadPool_Mutex(std::size_t nthreads = std::thread::hardware_concurrency()) :
+    m_enabled(true),
+    m_pool(nthreads)
+  {
+    run();
+  }
+
+  ~ThreadPool_Mutex()
+  {
+    stop();
+  }
+
+  ThreadPool_Mutex(ThreadPool_Mutex const&) = delete;
+  ThreadPool_Mutex& operator=(const ThreadPool_Mutex&) = delete;
+
+  template<class TaskT>
+  auto enqueue(TaskT task) -> std::future<decltype(task())>
+  {
+    using ReturnT = decltype(task());
+    auto promise = std::make_shared<std::promise<ReturnT>>();
+    auto result = promise->get_future();
+
+    auto t = [p = std::move(promise), t = std::move(task)]() mutable { execute(*p, t); };
+
+    {
+      std::lock_guard<std::mutex> lock(m_mu);
+      m_tasks.push(std::move(t));
+    }
+
+    m_cv.notify_one();
+
+    return result;
+  }
+
+private:
+
+  std::mutex m_mu;
+  std::condition_variable m_cv;
+
+  bool m_enabled;
+  std::vector<std::thread> m_pool;
+  std::queue<std::function<void()>> m_tasks;
+
+  template<class ResultT, class TaskT>
+  static void execute(std::promise<ResultT>& p, TaskT& task)
+  {
+    p.set_value(task());
+  }
+
+  template<class TaskT>
+  static void execute(std::promise<void>& p, TaskT& task)
+  {
+    task();
+    p.set_value();
+  }
+
+  void stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mu);
+      m_enabled = false;
+    }
+
+    m_cv.notify_all();
+
+    for (auto& t : m_pool)
+      t.join();
+  }
+
+  void run()
+  {
+    auto f = [this]()
+    {
+      while (true)
+      {
+        std::unique_lock<std::mutex> lock{ m_mu };
+        m_cv.wait(lock, [&]() { return !m_enabled || !m_tasks.empty(); });
+
+        if (!m_enabled)
+          break;
+
+        auto task = std::move(m_tasks.front());
+        m_tasks.pop();
+
+        lock.unlock();
+        task();
+      }
+    };
+
+    for (auto& t : m_pool)
+      t = std::thread(f);
+  }
+};
+
+/***
+
+contention: P producer threads each enqueue tasks/P tiny tasks, the clock stops
+when the last task has run
+
+***/
+
+template<class PoolT>
+static double bench_contention(std::size_t workers, std::size_t producers, std::size_t tasks) {
+  PoolT pool{ workers };
+  std::atomic<std::size_t> done{ 0 };
+  std::atomic<bool> go{ false };
+
+  const std::size_t each = tasks / producers;
+  const std::size_t total = each * producers;
+
+  std::vector<std::thread> threads;
+  for (std::size_t p = 0; p < producers; p++) {
+    threads.emplace_back([&]() {
+      while (!go.load(std::memory_order_acquire))
+        std::this_thread::yield();
+      for (std::size_t i = 0; i < each; i++) {
+        pool.enqueue([&done]() { done.fetch_add(1, std::memory_order_relaxed); });
+      }
+    });
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto& t : threads)
+    t.join();
+  while (done.load(std::memory_order_relaxed) < total)
+    std::this_thread::yield();
+  const auto stop = std::chrono::steady_clock::now();
+
+  return total / std::chrono::duration<double>(stop - start).count();
+}
+
+static void bench_threadpool(std::size_t workers, std::size_t tasks) {
+  const Report report("threadpool", "threadpool contention, " + std::to_string(workers) + " workers, " + std::to_string(tasks) + " tasks",
+    { { "workers", workers }, { "tasks", tasks } },
+    { { "producers", "producers", 10, 0, "" }, { "mutex_tasks_per_s", "mutex tasks/s", 16, 0, "" },
+      { "steal_tasks_per_s", "steal tasks/s", 16, 0, "" }, { "speedup", "speedup", 10, 2, "x" } });
+
+  for (std::size_t producers = 1; producers <= 64; producers *= 2) {
+    const double before = bench_contention<ThreadPool_Mutex>(workers, producers, tasks);
+    const double after = bench_contention<ThreadPool>(workers, producers, tasks);
+    report.row({ producers, before, after, after / before });
+  }
+}
+
+/***
+
+marshal: converts large nested lists and dicts into a fresh Arena, the same way
+Singleton::Dispatch does, and checks that they convert back unchanged
+
+***/
+
+static PyObject* bench_payload(const char* source) {
+  auto_pyptr globals = PyDict_New();
+  PyDict_SetItemString(globals, "__builtins__", PyEval_GetBuiltins());
+  return PyRun_String(source, Py_eval_input, globals, globals);
+}
+
+static void bench_marshal(std::size_t repeat) {
+  const std::pair<const char*, const char*> payloads[] = {
+    { "10k ints", "[i for i in range(10000)]" },
+    { "10k strings", "['item %d' % i for i in range(10000)]" },
+    { "1k dicts", "[{'id': i, 'name': 'n%d' % i, 'score': i / 3, 'tags': [i, i + 1, None, True]} for i in range(1000)]" },
+    { "nested", "{'k%d' % i: [[j, str(j), (j, -j, j / 7)] for j in range(10)] for i in range(1000)}" },
+    { "1k 512 bit", "[(-1) ** i * ((1 << 511) - i * 7919) for i in range(1000)]" },
+    { "1k 1000 bit", "[(-1) ** i * ((1 << 1000) - i * 7919) for i in range(1000)]" },
+  };
+
+  const Report report("marshal", "marshal, " + std::to_string(repeat) + " rounds per payload", { { "repeat", repeat } },
+    { { "payload", "payload", 12, 0, "" }, { "us_per_marshal", "us/marshal", 14, 1, "" },
+      { "arena_bytes", "arena bytes", 14, 0, "" }, { "allocations", "allocations", 14, 1, "" } });
+
+  for (auto& payload : payloads) {
+    auto_pyptr object = bench_payload(payload.second);
+    auto_pyptr tuple = PyTuple_Pack(1, object.get());
+    if (!object || !tuple) {
+      PyErr_Print();
+      return;
+    }
+
+    // round trip once to make sure nothing was lost on the way
+    {
+      Arena arena;
+      List list(arena, tuple);
+      auto_pyptr back = list.toPyList();
+      auto_pyptr expected = PySequence_List(tuple);
+      if (PyObject_RichCompareBool(back, expected, Py_EQ) != 1) {
+        std::cerr << payload.first << " did not survive the round trip" << std::endl;
+        return;
+      }
+    }
+
+    std::size_t bytes = 0;
+    const std::uint64_t allocations = bench_allocations.load();
+    const auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < repeat; i++) {
+      auto memory = make_arena();
+      List list(*memory, tuple);
+      bytes = memory->allocated();
+    }
+    const auto stop = std::chrono::steady_clock::now();
+
+    report.row({ payload.first, std::chrono::duration<double, std::micro>(stop - start).count() / repeat,
+      bytes, (double)(bench_allocations.load() - allocations) / repeat });
+  }
+}
+
+/***
+
+dispatch: hello_world calls through its METH_FASTCALL entry point and back out
+through deque_results, the way PyABI_pyd makes them, counting every C++
+allocation on every thread along the way; the first round warms the free lists
+up, after that a call should cost none
+
+***/
+
+static void bench_dispatch(std::size_t tasks) {
+  // hello_world("utf-8", the_id=1), the vector and kwnames a METH_FASTCALL call gets
+  auto_pyptr encoding = PyUnicode_FromString("utf-8");
+  auto_pyptr the_id = PyLong_FromLong(1);
+  auto_pyptr kwnames = Py_BuildValue("(s)", "the_id");
+  PyObject* vector[] = { encoding.get(), the_id.get() };
+
+  std::vector<Results> batch;
+  batch.reserve(1 << 16);
+
+  auto round = [&]() {
+    std::size_t collected = 0;
+    for (std::size_t i = 0; i < tasks; i++) {
+      Py_XDECREF(Export<hello_world_export>::call(nullptr, vector, 1, kwnames));
+      // keep at most 1024 calls in flight, well inside PyABI_recycled
+      while (i + 1 - collected > 1024) {
+        batch.clear();
+        if (const std::size_t n = deque_results__(batch, SIZE_MAX)) {
+          collected__(batch, n);
+          collected += n;
+        }
+        else {
+          std::this_thread::yield();
+        }
+      }
+    }
+    while (collected < tasks) {
+      batch.clear();
+      if (const std::size_t n = deque_results__(batch, SIZE_MAX)) {
+        collected__(batch, n);
+        collected += n;
+      }
+      else {
+        std::this_thread::yield();
+      }
+    }
+    batch.clear();
+  };
+
+  const Report report("dispatch", "dispatch, " + std::to_string(tasks) + " calls per round", { { "tasks", tasks } },
+    { { "round", "round", 10, 0, "" }, { "us_per_call", "us/call", 14, 3, "" }, { "allocs_per_call", "allocs/call", 16, 4, "" } });
+
+  for (std::size_t r = 0; r < 4; r++) {
+    const std::uint64_t allocations = bench_allocations.load();
+    const auto start = std::chrono::steady_clock::now();
+    round();
+    const auto stop = std::chrono::steady_clock::now();
+
+    report.row({ r ? std::to_string(r) : std::string("warm up"), std::chrono::duration<double, std::micro>(stop - start).count() / tasks,
+      (double)(bench_allocations.load() - allocations) / tasks });
+  }
+}
+
+/***
+
+The byte at a time string hash and the scanning Dict::find they replaced, kept as
+the baselines for the dict benchmark
+
+***/
+
+static size_t StringHash__Dynamic(const char* str) {
+  size_t R = (0x01234567 ^ (*str & 0xFF)) * 0x89ABCDEF;
+  while (*str++) {
+    R = (R ^ (*str & 0xFF)) * 0x89ABCDEF;
+  }
+  return R;
+}
+
+static const Object* Dict_scan(const Dict& dict, std::string_view key) {
+  for (auto& pair : dict.pairs()) {
+    if (pair.key.isString() && pair.key.toString() == key)
+      return &pair.value;
+  }
+  return nullptr;
+}
+
+/***
+
+dict: looks up every key of a kwargs sized Dict (str keys, as a call gets them)
+by scanning and through its index, then hashes strings of a few sizes with the
+old and the new hash
+
+***/
+
+static void bench_dict(std::size_t repeat) {
+  const Report lookups("dict", "dict, every key looked up " + std::to_string(repeat) + " times", { { "repeat", repeat } },
+    { { "keys", "keys", 10, 0, "" }, { "scan_ns", "scan ns", 14, 1, "" }, { "index_ns", "index ns", 14, 1, "" }, { "speedup", "speedup", 12, 2, "x" } });
+
+  std::size_t found = 0;
+  for (const std::size_t keys : { 4, 8, 16, 64, 256 }) {
+    auto_pyptr kwargs = PyDict_New();
+    std::vector<std::string> names;
+    for (std::size_t i = 0; i < keys; i++) {
+      names.push_back("keyword_argument_" + std::to_string(i));
+      auto_pyptr value = PyLong_FromSize_t(i);
+      PyDict_SetItemString(kwargs, names.back().c_str(), value);
+    }
+
+    Arena arena;
+    const Dict dict(arena, kwargs);
+    for (std::size_t i = 0; i < keys; i++) {
+      const Object* value = dict.find(std::string_view(names[i]));
+      if (!value || value != Dict_scan(dict, names[i]) || value->toInt64() != (int64_t)i || dict.find(std::string_view("missing"))) {
+        std::cerr << "the index lost key " << names[i] << std::endl;
+        return;
+      }
+    }
+
+    auto time = [&](auto&& find) {
+      const auto start = std::chrono::steady_clock::now();
+      for (std::size_t r = 0; r < repeat; r++) {
+        for (auto& name : names)
+          found += find(std::string_view(name)) != nullptr;
+      }
+      const auto stop = std::chrono::steady_clock::now();
+      return std::chrono::duration<double, std::nano>(stop - start).count() / (repeat * keys);
+    };
+    const double scan = time([&](std::string_view key) { return Dict_scan(dict, key); });
+    const double index = time([&](std::string_view key) { return dict.find(key); });
+
+    lookups.row({ keys, scan, index, scan / index });
+  }
+
+  const Report hashes("hash", "string hash", {},
+    { { "bytes", "bytes", 10, 0, "" }, { "old_gb_per_s", "old GB/s", 14, 2, "" }, { "new_gb_per_s", "new GB/s", 14, 2, "" } });
+
+  std::uint64_t sink = found;
+  for (const std::size_t size : { 8, 32, 256, 4096 }) {
+    std::string text(size, 'x');
+    const std::size_t rounds = std::max<std::size_t>(1, repeat * 4096 / size);
+
+    // a different string every round, so neither hash can be hoisted out of the loop
+    auto time = [&](auto&& hash) {
+      const auto start = std::chrono::steady_clock::now();
+      for (std::size_t r = 0; r < rounds; r++) {
+        text[r % size] = (char)('a' + r % 26);
+        sink += hash();
+      }
+      const auto stop = std::chrono::steady_clock::now();
+      return (double)(size * rounds) / std::chrono::duration<double, std::nano>(stop - start).count();
+    };
+    const double before = time([&]() { return StringHash__Dynamic(text.c_str()); });
+    const double after = time([&]() { return PyABI_Hash::bytes(text.data(), text.size()); });
+
+    hashes.row({ size, before, after });
+  }
+
+  if (sink == 42)
+    std::cout << std::endl;
+}
+
+/***
+
+load: a load generator for the whole dispatch core, producer threads take the GIL
+the way Python threads would and submit hello_world calls through
+Singleton::Dispatch while the main thread drains deque_results, recording every
+call's latency from submission to collection
+
+  tiny  nothing but the call itself
+  fat   each call also marshals a list of 100 small dicts into its arena (the
+        worker ignores it), the marshaling layer and arena recycling under load
+
+  steady  every producer submits as fast as admission control lets it
+  bursty  every producer submits burst calls at once, then sleeps pause us
+
+the latencies are end to end, so under a steady load they are mostly time spent
+queued behind the other producers' calls
+
+***/
+
+static void bench_load(std::size_t tasks, const std::size_t max_producers, const std::size_t burst, const std::size_t pause) {
+  const Report report("load", "load, " + std::to_string(tasks) + " calls (a tenth of that when fat), bursts of " + std::to_string(burst) + " every " + std::to_string(pause) + " us",
+    { { "burst", burst }, { "pause_us", pause } },
+    { { "payload", "payload", 8, 0, "" }, { "arrival", "arrival", 8, 0, "" }, { "producers", "producers", 10, 0, "" },
+      { "calls_per_s", "calls/s", 12, 0, "" }, { "p50_us", "p50 us", 10, 1, "" }, { "p90_us", "p90 us", 10, 1, "" },
+      { "p99_us", "p99 us", 10, 1, "" }, { "p999_us", "p99.9 us", 10, 1, "" }, { "max_us", "max us", 10, 1, "" },
+      { "queued_p99_us", "queued p99", 12, 1, "" }, { "allocs_per_call", "allocs/call", 13, 2, "" } });
+
+  PyGILState_STATE gil = PyGILState_Ensure();
+  auto_pyptr fat = bench_payload("[{'id': i, 'name': 'n%d' % i, 'score': i / 3} for i in range(100)]");
+  PyGILState_Release(gil);
+
+  for (const bool is_fat : { false, true }) {
+    for (const bool bursty : { false, true }) {
+      for (std::size_t producers = 1; producers <= max_producers; producers *= 4) {
+        const std::size_t calls = (is_fat ? tasks / 10 : tasks) / producers * producers;
+        std::atomic<bool> go{ false };
+
+        std::vector<std::thread> threads;
+        for (std::size_t p = 0; p < producers; p++) {
+          threads.emplace_back([&]() {
+            const std::size_t each = calls / producers;
+            const std::size_t step = bursty ? burst : 64;
+            while (!go.load(std::memory_order_acquire))
+              std::this_thread::yield();
+            for (std::size_t sent = 0; sent < each; sent += step) {
+              PyGILState_STATE gil = PyGILState_Ensure();
+              for (std::size_t i = sent; i < std::min(each, sent + step); i++) {
+                SingletonInstance.Dispatch(Singleton::Function_hello_world, &Singleton::hello_world, [&](Arena& arena) {
+                  if (is_fat)
+                    List payload(arena, fat);
+                  return std::make_tuple(std::string_view("utf-8"), (std::int64_t)i, false);
+                }, Schedule(), Call_Options());
+              }
+              PyGILState_Release(gil);
+              if (bursty)
+                std::this_thread::sleep_for(std::chrono::microseconds(pause));
+            }
+          });
+        }
+
+        Histogram latency;
+        Histogram queued;
+        std::vector<Results> batch;
+        batch.reserve(1 << 16);
+
+        const std::uint64_t allocations = bench_allocations.load();
+        const auto start = std::chrono::steady_clock::now();
+        go.store(true, std::memory_order_release);
+        for (std::size_t collected = 0; collected < calls;) {
+          batch.clear();
+          const std::size_t n = deque_results__(batch, SIZE_MAX);
+          collected__(batch, n);
+          const std::uint64_t now = PyABI_now();
+          for (auto& result : batch) {
+            latency.record(now - result.Enqueued);
+            queued.record(result.Started - result.Enqueued);
+          }
+          collected += n;
+          if (!n)
+            std::this_thread::yield();
+        }
+        const auto stop = std::chrono::steady_clock::now();
+        for (auto& t : threads)
+          t.join();
+        batch.clear();
+
+        Histogram::Summary all, waiting;
+        latency.merge_into(all);
+        queued.merge_into(waiting);
+        auto us = [](const std::uint64_t ns) { return ns / 1000.0; };
+        report.row({ is_fat ? "fat" : "tiny", bursty ? "bursty" : "steady", producers,
+          calls / std::chrono::duration<double>(stop - start).count(),
+          us(all.percentile(0.5)), us(all.percentile(0.9)), us(all.percentile(0.99)), us(all.percentile(0.999)), us(all.max()),
+          us(waiting.percentile(0.99)), (double)(bench_allocations.load() - allocations) / calls });
+      }
+    }
+  }
+
+  gil = PyGILState_Ensure();
+  fat.reset();
+  PyGILState_Release(gil);
+}
+
+/***
+
+retro: runs policy shaped words on the retro_bios image with execute_reference(),
+the threaded execute() and RETRO_JIT, after checking that all three leave the VM
+in the same state, then prints the opcode mix each word runs
+
+***/
+
+using Retro_Bench_VM = RETRO_VM<int32_t, 524288, 128, 1024>;
+
+static const char* const retro_opcode_names[Retro_Bench_VM::NUM_OPS] = {
+  "no", "li", "du", "dr", "sw", "pu", "po", "ju", "ca", "cc", "re", "eq", "ne", "lt", "gt",
+  "fe", "st", "ad", "su", "mu", "di", "an", "or", "xo", "sh", "zr", "ha", "ie", "iq", "ii"
+};
+
+/***
+
+the host words bench_retro binds: s:hash and summing a buffer in C++
+
+***/
+
+static int32_t retro_host_hash(const std::string& text) {
+  uint32_t hash = 5381;
+  for (const char c : text)
+    hash = hash * 33 + (uint8_t)c;
+  return (int32_t)hash;
+}
+
+// (at count - sum)
+static void retro_host_sum(Retro_Bench_VM& vm, void*) {
+  int32_t count = vm.stack_pop(), at = vm.stack_pop(), sum = 0;
+  std::array<int32_t, 256> cells;
+  for (; count > 0; count -= (int32_t)cells.size(), at += (int32_t)cells.size()) {
+    const std::size_t chunk = std::min<std::size_t>(count, cells.size());
+    vm.read_cells(at, cells.data(), chunk);
+    for (std::size_t i = 0; i < chunk; i++)
+      sum += cells[i];
+  }
+  vm.stack_push(sum);
+}
+
+static void bench_retro(std::size_t repeat) {
+  const char* const words =
+    ":w-loop #0 #2000 [ #3 + ] times ; "
+    ":w-branch #0 #2000 [ dup #1000 gt? [ #1 - ] [ #2 + ] choose ] times ; "
+    ":sq dup * ; :w-calls #0 #2000 [ #3 sq + ] times ; "
+    ":w-strings #0 #200 [ 'policy:allow s:hash + ] times ; "
+    ":w-lookup #0 #20 [ 'times d:lookup + ] times ; "
+    ":w-host-strings #0 #200 [ 'policy:allow host:hash + ] times ; "
+    "'Buffer d:create #1024 allot #1024 [ I &Buffer I + store ] indexed-times "
+    ":w-sum #0 &Buffer #1024 [ fetch-next rot + swap ] times drop ; "
+    ":w-host-sum &Buffer #1024 host:sum ;";
+  const std::vector<std::string> workloads{ "w-loop", "w-branch", "w-calls", "w-strings", "w-lookup" };
+  // each word in Retro against the same with a host function
+  const std::vector<std::array<std::string, 2>> hosted{ { "w-strings", "w-host-strings" }, { "w-sum", "w-host-sum" } };
+
+  auto reference = std::make_unique<Retro_Bench_VM>();
+  auto threaded = std::make_unique<Retro_Bench_VM>();
+  auto jitted = std::make_unique<Retro_Bench_VM>();
+  for (Retro_Bench_VM* vm : { reference.get(), threaded.get(), jitted.get() }) {
+    vm->bind("host:hash", &retro_host_hash);
+    vm->bind("host:sum", &retro_host_sum);
+  }
+  RETRO_JIT<Retro_Bench_VM> jit(*jitted);
+  reference->evaluate(words, true);
+  threaded->evaluate(words);
+  jit.evaluate(words);
+
+  std::vector<std::array<uint64_t, Retro_Bench_VM::NUM_OPS>> mix(workloads.size());
+  for (std::size_t w = 0; w < workloads.size(); w++) {
+    mix[w].fill(0);
+    reference->profile = &mix[w];
+    reference->evaluate(workloads[w], true);
+    reference->profile = nullptr;
+    threaded->evaluate(workloads[w]);
+    jit.evaluate(workloads[w]);
+    bool same = reference->depth() == threaded->depth() && reference->depth() == jitted->depth();
+    const int32_t top = reference->stack_pop();
+    same = same && top == threaded->stack_pop() && top == jitted->stack_pop();
+    for (int32_t at = 0; same && at <= 524288; at++)
+      same = reference->fetch(at) == threaded->fetch(at) && reference->fetch(at) == jitted->fetch(at);
+    if (!same) {
+      std::cerr << "execute(), RETRO_JIT and execute_reference() disagree after " << workloads[w] << std::endl;
+      return;
+    }
+  }
+
+  const Report speed("retro", "retro, each word run " + std::to_string(repeat) + " times" + (jit.compiling() ? "" : " (no JIT here)"), { { "repeat", repeat } },
+    { { "word", "word", 12, 0, "" }, { "ops", "ops/run", 10, 0, "" }, { "reference_mops_per_s", "reference Mops/s", 18, 1, "" },
+      { "threaded_mops_per_s", "threaded Mops/s", 18, 1, "" }, { "jit_mops_per_s", "jit Mops/s", 14, 1, "" },
+      { "threaded_speedup", "threaded", 10, 2, "x" }, { "jit_speedup", "jit", 10, 2, "x" } });
+
+  for (std::size_t w = 0; w < workloads.size(); w++) {
+    uint64_t ops = 0;
+    for (const uint64_t count : mix[w])
+      ops += count;
+
+    auto time = [&](Retro_Bench_VM& vm, auto&& evaluate) {
+      const auto start = std::chrono::steady_clock::now();
+      for (std::size_t r = 0; r < repeat; r++) {
+        evaluate(workloads[w]);
+        vm.stack_pop();
+      }
+      const auto stop = std::chrono::steady_clock::now();
+      return ops * repeat / std::chrono::duration<double, std::micro>(stop - start).count();
+    };
+    const double before = time(*reference, [&](const std::string& word) { reference->evaluate(word, true); });
+    const double after = time(*threaded, [&](const std::string& word) { threaded->evaluate(word); });
+    const double native = time(*jitted, [&](const std::string& word) { jit.evaluate(word); });
+
+    speed.row({ workloads[w], ops, before, after, native, after / before, native / before });
+  }
+
+  const Report host("retro_host", "retro, words in Retro against host functions bound with RETRO_VM::bind(), " + std::to_string(repeat) + " runs", { { "repeat", repeat } },
+    { { "word", "word", 16, 0, "" }, { "threaded_us", "threaded us/run", 18, 2, "" }, { "jit_us", "jit us/run", 14, 2, "" } });
+
+  for (auto& pair : hosted) {
+    int32_t results[2][2];
+    for (std::size_t i = 0; i < 2; i++) {
+      // run from the execution token, evaluate() would add the interpreter's parsing to both
+      auto time = [&](Retro_Bench_VM& vm, auto&& execute, int32_t& result) {
+        const int32_t xt = vm.d_xt(pair[i]);
+        const auto start = std::chrono::steady_clock::now();
+        for (std::size_t r = 0; r < repeat; r++) {
+          execute(xt);
+          result = vm.stack_pop();
+        }
+        const auto stop = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::micro>(stop - start).count() / repeat;
+      };
+      const double after = time(*threaded, [&](int32_t xt) { threaded->execute(xt); }, results[i][0]);
+      const double native = time(*jitted, [&](int32_t xt) { jit.execute(xt); }, results[i][1]);
+      host.row({ pair[i], after, native });
+    }
+    if (results[0][0] != results[1][0] || results[0][1] != results[1][1])
+      std::cerr << pair[1] << " does not agree with " << pair[0] << std::endl;
+  }
+
+  std::vector<Report::Column> columns{ { "opcode", "opcode", 8, 0, "" } };
+  for (auto& workload : workloads)
+    columns.push_back({ workload.c_str(), workload.c_str(), 12, 1, "%" });
+  const Report opcodes("retro_mix", "retro, share of the opcodes each word runs", {}, std::move(columns));
+
+  for (int op = 1; op < Retro_Bench_VM::NUM_OPS; op++) {
+    std::vector<Report::Cell> row{ retro_opcode_names[op] };
+    for (auto& counts : mix) {
+      uint64_t ops = 0;
+      for (const uint64_t count : counts)
+        ops += count;
+      row.push_back(100.0 * counts[op] / ops);
+    }
+    opcodes.row(row);
+  }
+}
+
+/***
+
+vmpool: the cost of giving each policy check a pristine VM, by booting a new one
+for it, by restoring one VM to a snapshot after it, and with RETRO_POOL checks
+posted to the workers of a ThreadPool
+
+a check stores into a variable and a 64 cell buffer, so each one dirties pages
+
+***/
+
+static void bench_vmpool(std::size_t workers, std::size_t tasks) {
+  const char* const prelude = "'Seen var 'Scratch d:create #64 allot "
+    ":allow? dup !Seen #64 [ @Seen &Scratch I + store ] indexed-times #1000 lt? ;";
+
+  const Report report("vmpool", "vmpool, a pristine VM per policy check, " + std::to_string(workers) + " workers", { { "workers", workers } },
+    { { "mode", "mode", 12, 0, "" }, { "checks", "checks", 10, 0, "" }, { "us_per_check", "us/check", 12, 2, "" },
+      { "checks_per_s", "checks/s", 14, 0, "" }, { "allocs_per_check", "allocs/check", 14, 3, "" } });
+
+  auto measure = [&](const char* mode, const std::size_t checks, auto&& round) {
+    const std::uint64_t allocations = bench_allocations.load();
+    const auto start = std::chrono::steady_clock::now();
+    const std::size_t allowed = round(checks);
+    const auto stop = std::chrono::steady_clock::now();
+    const double seconds = std::chrono::duration<double>(stop - start).count();
+    if (allowed != std::min<std::size_t>(checks, 1000))
+      std::cerr << mode << ": " << allowed << " checks allowed instead of " << std::min<std::size_t>(checks, 1000) << std::endl;
+    report.row({ mode, checks, seconds * 1e6 / checks, checks / seconds, (double)(bench_allocations.load() - allocations) / checks });
+  };
+
+  measure("boot", std::min<std::size_t>(tasks, 200), [&](const std::size_t checks) {
+    std::size_t allowed = 0;
+    for (std::size_t i = 0; i < checks; i++) {
+      auto vm = std::make_unique<Retro_Bench_VM>();
+      vm->evaluate(prelude);
+      vm->stack_push((int32_t)i);
+      vm->execute(vm->d_xt("allow?"));
+      allowed += vm->stack_pop() != 0;
+    }
+    return allowed;
+  });
+
+  auto booted = std::make_unique<Retro_Bench_VM>();
+  booted->evaluate(prelude);
+  const auto snapshot = booted->snapshot();
+  const int32_t allow = booted->d_xt("allow?");
+  measure("restore", tasks, [&](const std::size_t checks) {
+    std::size_t allowed = 0;
+    for (std::size_t i = 0; i < checks; i++) {
+      booted->stack_push((int32_t)i);
+      booted->execute(allow);
+      allowed += booted->stack_pop() != 0;
+      booted->restore(*snapshot);
+    }
+    return allowed;
+  });
+
+  ThreadPool pool{ workers };
+  RETRO_POOL<Retro_Bench_VM> vms(pool, prelude);
+  const int32_t pooled_allow = vms.xt("allow?");
+  for (const char* mode : { "pool warm up", "pool" }) {
+    measure(mode, tasks, [&](const std::size_t checks) {
+      std::atomic<std::size_t> done{ 0 }, allowed{ 0 };
+      for (std::size_t i = 0; i < checks; i++) {
+        // no more in flight than Recycled<Task> keeps blocks for
+        while (i - done.load(std::memory_order_acquire) >= 1024)
+          std::this_thread::yield();
+        vms.post([&, i](Retro_Bench_VM& vm) {
+          vm.stack_push((int32_t)i);
+          vm.execute(pooled_allow);
+          allowed.fetch_add(vm.stack_pop() != 0, std::memory_order_relaxed);
+          done.fetch_add(1, std::memory_order_release);
+        });
+      }
+      while (done.load(std::memory_order_acquire) < checks)
+        std::this_thread::yield();
+      return allowed.load();
+    });
+  }
+}
+
+int main(int argc, char** argv) {
+
+  argparse::ArgumentParser program("PyABI_bench");
+
+  program.add_argument("benchmark")
+    .help("which benchmark to run: threadpool, marshal, dispatch, dict, load, retro, vmpool")
+    .default_value(std::string("threadpool"));
+
+  program.add_argument("--workers")
+    .help("number of pool workers")
+    .default_value((int)std::thread::hardware_concurrency())
+    .action([](const std::string& value) { return std::stoi(value); });
+
+  program.add_argument("--repeat")
+    .help("number of rounds per payload")
+    .default_value(200)
+    .action([](const std::string& value) { return std::stoi(value); });
+
+  program.add_argument("--tasks")
+    .help("number of tasks per measurement")
+    .default_value(200000)
+    .action([](const std::string& value) { return std::stoi(value); });
+
+  program.add_argument("--producers")
+    .help("most producer threads for the load benchmark, it runs 1, 4, 16... up to this")
+    .default_value(16)
+    .action([](const std::string& value) { return std::stoi(value); });
+
+  program.add_argument("--burst")
+    .help("calls per burst for the load benchmark")
+    .default_value(256)
+    .action([](const std::string& value) { return std::stoi(value); });
+
+  program.add_argument("--pause")
+    .help("microseconds between the bursts of a load benchmark producer")
+    .default_value(2000)
+    .action([](const std::string& value) { return std::stoi(value); });
+
+  program.add_argument("--json")
+    .help("print one JSON object per result row instead of a table")
+    .default_value(false)
+    .implicit_value(true);
+
+  try {
+    program.parse_args(argc, argv);
+  }
+  catch (const std::runtime_error& err) {
+    std::cout << err.what() << std::endl;
+    std::cout << program;
+    exit(0);
+  }
+
+  const auto benchmark = program.get<std::string>("benchmark");
+  const auto workers = (std::size_t)program.get<int>("--workers");
+  const auto tasks = (std::size_t)program.get<int>("--tasks");
+  Report::json = program.get<bool>("--json");
+
+  if (benchmark == "threadpool") {
+    bench_threadpool(workers, tasks);
+  }
+  else if (benchmark == "marshal") {
+    Py_Initialize();
+    bench_marshal((std::size_t)program.get<int>("--repeat"));
+  }
+  else if (benchmark == "dispatch") {
+    Py_Initialize();
+    bench_dispatch(tasks);
+  }
+  else if (benchmark == "dict") {
+    Py_Initialize();
+    bench_dict((std::size_t)program.get<int>("--repeat") * 100);
+  }
+  else if (benchmark == "load") {
+    Py_Initialize();
+    // the producers take the GIL as they need it
+    PyThreadState* main = PyEval_SaveThread();
+    bench_load(tasks, (std::size_t)program.get<int>("--producers"), (std::size_t)program.get<int>("--burst"), (std::size_t)program.get<int>("--pause"));
+    PyEval_RestoreThread(main);
+  }
+  else if (benchmark == "retro") {
+    bench_retro((std::size_t)program.get<int>("--repeat"));
+  }
+  else if (benchmark == "vmpool") {
+    bench_vmpool(workers, tasks);
+  }
+  else {
+    std::cout << "unknown benchmark " << benchmark << std::endl;
+    std::cout << program;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+
+}
+
+/***
+
+//
+//  MIT License
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files(the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions :
+//
+//  The above copyright notice and this permission notice shall be included in all
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//  SOFTWARE.
+//
+
+***/
@@ -0,0 +1,49 @@
+import asyncio
+
+
+class Completions:
+    """Awaitable PyABI_pyd calls.
+
+    Where the module has a completion fd the event loop watches it and drains
+    finished calls in batches, elsewhere every wait() blocks in the default
+    executor with the GIL released.
+    """
+
+    def __init__(self, module, loop=None):
+        self._module = module
+        self._loop = loop or asyncio.get_event_loop()
+        self._futures = {}
+        self._finished = {}
+        self._fd = module.completion_fd()
+        if self._fd >= 0:
+            self._loop.add_reader(self._fd, self._drain)
+
+    def wait(self, call_id):
+        """Future resolving to the (call_id, success, result) of call_id.
+
+        Cancelling the future cancels the call as well.
+        """
+        future = self._loop.create_future()
+        if call_id in self._finished:
+            future.set_result(self._finished.pop(call_id))
+        elif self._fd >= 0:
+            self._futures[call_id] = future
+            self._drain()
+        else:
+            future = self._loop.run_in_executor(None, self._module.wait, call_id)
+        if hasattr(self._module, "cancel"):
+            future.add_done_callback(lambda done: done.cancelled() and self._module.cancel(call_id))
+        return future
+
+    def close(self):
+        if self._fd >= 0:
+            self._loop.remove_reader(self._fd)
+            self._fd = -1
+
+    def _drain(self):
+        for finished in self._module.deque_results():
+            future = self._futures.pop(finished[0], None)
+            if future is None:
+                self._finished[finished[0]] = finished
+            elif not future.cancelled():
+                future.set_result(finished)
@@ -0,0 +1,29 @@
+import threading
+import time
+
+
+class Snapshots:
+    """Periodic PyABI_pyd.stats() snapshots.
+
+    Every interval seconds callback(timestamp, stats) is called from a daemon
+    thread with the figures for that interval only, the histograms are reset
+    after each snapshot.
+    """
+
+    def __init__(self, module, interval, callback):
+        self._module = module
+        self._interval = interval
+        self._callback = callback
+        self._stopped = threading.Event()
+        self._thread = threading.Thread(target=self._run, name="pyabi-stats", daemon=True)
+        self._module.stats(reset=True)
+        self._thread.start()
+
+    def close(self):
+        self._stopped.set()
+        if self._thread is not threading.current_thread():
+            self._thread.join()
+
+    def _run(self):
+        while not self._stopped.wait(self._interval):
+            self._callback(time.time(), self._module.stats(reset=True))
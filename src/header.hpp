@@ -11,20 +11,58 @@ Ethos: http://utf8everywhere.org
 #pragma once
 
 #include <exception>
+#include <stdexcept>
 
 #include <map>
+#include <chrono>
 #include <queue>
+#include <memory>
 #include <array>
 #include <stack>
 #include <vector>
+#include <string>
+#include <tuple>
+#include <string_view>
+#include <unordered_map>
 
+#include <mutex>
+#include <atomic>
 #include <future>
 #include <thread>
+#include <cstdio>
 #include <cstddef>
+#include <cstring>
 #include <cassert>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <type_traits>
 #include <functional>
 #include <condition_variable>
 
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#elif !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 //#include "ttmath/ttmath.h"
 //using Integer_Huge = ttmath::Int<256>;
 
@@ -54,71 +92,104 @@ using Safe_I64 = SafeInt<int64_t>;
 
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <structmember.h>
 
 /***
 
+PyABI_hash is wyhash (final 4, public domain): 64 bit, eight bytes at a time and
+a 64x64->128 multiply to mix them, the hash behind Object::hash and Dict
 
+it only has to agree with itself inside one process, the reads are native endian
 
 ***/
 
-struct StringHash {
+struct PyABI_Hash {
 
-	template <size_t N, size_t I>
-	struct HashHelper
-	{
-		constexpr static size_t Calculate(const char(&str)[N])
-		{
-			return (HashHelper<N, I - 1>::Calculate(str) ^ (str[I - 1] & 0xFF)) * StringHash::PRIME;
-		}
-	};
+	static constexpr std::uint64_t SECRET[4] = { 0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull };
 
-	template <size_t N>
-	struct HashHelper<N, 1>
-	{
-		constexpr static size_t Calculate(const char(&str)[N])
-		{
-			return (StringHash::OFFSET ^ (str[0] & 0xFF)) * StringHash::PRIME;
-		}
-	};
+	// the 128 bit product of a and b, low half in a and high half in b
+	static inline void multiply(std::uint64_t& a, std::uint64_t& b) {
+#if defined(_MSC_VER) && defined(_M_X64)
+		a = _umul128(a, b, &b);
+#else
+		const __uint128_t product = (__uint128_t)a * b;
+		a = (std::uint64_t)product;
+		b = (std::uint64_t)(product >> 64);
+#endif
+	}
 
-	template<size_t N>
-	constexpr static size_t StaticHash(const char(&str)[N])
-	{
-		return HashHelper<N, N>::Calculate(str);
+	static inline std::uint64_t mix(std::uint64_t a, std::uint64_t b) {
+		multiply(a, b);
+		return a ^ b;
 	}
-	static const size_t OFFSET = 0x01234567;
-	static const size_t PRIME = 0x89ABCDEF;
-};
 
-static size_t StringHash__Dynamic(const char* str) {
-	size_t R = (StringHash::OFFSET ^ (*str & 0xFF)) * StringHash::PRIME;
-	while (*str++) {
-		R = (R ^ (*str & 0xFF)) * StringHash::PRIME;
+	static inline std::uint64_t read8(const std::uint8_t* p) {
+		std::uint64_t value;
+		std::memcpy(&value, p, 8);
+		return value;
 	}
-	return R;
-}
 
-static size_t IntegerHash__Dynamic(int64_t value) {
-	value = abs(value);
-	size_t R = (StringHash::OFFSET ^ (value & 0xFF)) * StringHash::PRIME;
-	while (value) {
-		value >>= 8;
-		R = (R ^ (value & 0xFF)) * StringHash::PRIME;
+	static inline std::uint64_t read4(const std::uint8_t* p) {
+		std::uint32_t value;
+		std::memcpy(&value, p, 4);
+		return value;
 	}
-	return R;
-}
 
-/*
-static size_t IntegerHash__Dynamic(Integer_Huge value) {
-	value = value.Abs();
-	size_t R = (StringHash::OFFSET ^ (value.BitAnd(0xff).ToInt())) * StringHash::PRIME;
-	while (value > 0) {
-		value >>= 8;
-		R = (R ^ (value & 0xFF)) * StringHash::PRIME;
+	// 1 to 3 bytes
+	static inline std::uint64_t read3(const std::uint8_t* p, const std::size_t k) {
+		return ((std::uint64_t)p[0] << 16) | ((std::uint64_t)p[k >> 1] << 8) | p[k - 1];
+	}
+
+	static std::uint64_t bytes(const void* data, const std::size_t size, std::uint64_t seed = 0) {
+		const std::uint8_t* p = (const std::uint8_t*)data;
+		seed ^= mix(seed ^ SECRET[0], SECRET[1]);
+		std::uint64_t a, b;
+		if (size <= 16) {
+			if (size >= 4) {
+				a = (read4(p) << 32) | read4(p + ((size >> 3) << 2));
+				b = (read4(p + size - 4) << 32) | read4(p + size - 4 - ((size >> 3) << 2));
+			}
+			else if (size > 0) {
+				a = read3(p, size);
+				b = 0;
+			}
+			else {
+				a = b = 0;
+			}
+		}
+		else {
+			std::size_t i = size;
+			if (i > 48) {
+				std::uint64_t see1 = seed, see2 = seed;
+				do {
+					seed = mix(read8(p) ^ SECRET[1], read8(p + 8) ^ seed);
+					see1 = mix(read8(p + 16) ^ SECRET[2], read8(p + 24) ^ see1);
+					see2 = mix(read8(p + 32) ^ SECRET[3], read8(p + 40) ^ see2);
+					p += 48;
+					i -= 48;
+				} while (i > 48);
+				seed ^= see1 ^ see2;
+			}
+			while (i > 16) {
+				seed = mix(read8(p) ^ SECRET[1], read8(p + 8) ^ seed);
+				i -= 16;
+				p += 16;
+			}
+			a = read8(p + i - 16);
+			b = read8(p + i - 8);
+		}
+		a ^= SECRET[1];
+		b ^= seed;
+		multiply(a, b);
+		return mix(a ^ SECRET[0] ^ size, b ^ SECRET[1]);
+	}
+
+	// one word, e.g. an integer or the hash of an item in a tuple
+	static inline std::uint64_t word(const std::uint64_t value, const std::uint64_t seed = 0) {
+		return mix(value ^ SECRET[0], seed ^ SECRET[1]);
 	}
-	return R;
-}
-*/
+
+};
 
 /***
 
@@ -166,589 +237,3462 @@ struct PyABI_Exception : public std::exception {
 
 /***
 
+Arena is the bump allocator that owns everything marshaled for one call
 
+The arguments are marshaled into it on the calling thread, the worker reads them
+and writes its Results into the same arena, and the whole thing is freed in one
+shot when Python takes the Results. Nothing inside it is freed on its own.
+
+The first block lives inline so a small call costs no allocation beyond the Arena
+itself, after that the blocks double up to BLOCK_MAX. Objects that are not
+trivially destructible register a finalizer that runs when the arena dies.
 
 ***/
 
-class Object {
+class Arena final {
 
 public:
 
-	inline PyObject* toPyObject() const {
-		return m_object->toPyObject();
-	};
+	static constexpr size_t INLINE_SIZE = 512;
 
-	inline bool isNone() const {
-		return m_object->TypeHash == StringHash::StaticHash("None");
-	}
+	static constexpr size_t BLOCK_MAX = 1 << 20;
+
+	Arena()
+		: m_cursor(m_inline), m_end(m_inline + INLINE_SIZE)
+		, m_blocks(nullptr), m_finalizers(nullptr), m_next_block(4096), m_allocated(0) {
 
-	inline bool isBool() const {
-		return m_object->TypeHash == StringHash::StaticHash("Bool");
 	}
 
-	inline bool isString() const {
-		return m_object->TypeHash == StringHash::StaticHash("String");
+	~Arena() {
+		reset();
 	}
 
-	Object()
-		: m_object(new Object_None()) {
-		// create a None object by default
-	};
+	Arena(Arena const&) = delete;
+	Arena& operator=(const Arena&) = delete;
 
-	Object(PyObject* object) {
-		if (object == Py_None) {
-			m_object.reset(new Object_None);
-		}
-		else if (object == Py_True || object == Py_False) {
-			m_object.reset(new Object_Bool(object == Py_True));
-		}
-		else if (PyLong_Check(object)) {
-			int overflow = 0;
-			long long value = PyLong_AsLongLongAndOverflow(object, &overflow);
-			if (overflow == 0) {
-				m_object.reset(new Object_Integer(value));
-			}
-			else {
-				m_object.reset(new Object_Integer_Huge(object));
-			}
+	void* allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+		char* start = align_up(m_cursor, align);
+		if (start + size > m_end) {
+			grow(size + align);
+			start = align_up(m_cursor, align);
 		}
-		else if (PyUnicode_Check(object)) {
+		m_cursor = start + size;
+		m_allocated += size;
+		return start;
+	}
 
-		}
-		else if (PyTuple_Check(object)) {
+	// uninitialized storage for count trivially destructible T
+	template<class T>
+	T* allocate_array(size_t count) {
+		static_assert(std::is_trivially_destructible<T>::value, "the arena never runs destructors for arrays");
+		return count ? static_cast<T*>(allocate(sizeof(T) * count, alignof(T))) : nullptr;
+	}
 
+	template<class T, class... Args>
+	T* make(Args&&... args) {
+		T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if (!std::is_trivially_destructible<T>::value) {
+			Finalizer* finalizer = new (allocate(sizeof(Finalizer), alignof(Finalizer))) Finalizer;
+			finalizer->object = object;
+			finalizer->destroy = [](void* object) { static_cast<T*>(object)->~T(); };
+			finalizer->next = m_finalizers;
+			m_finalizers = finalizer;
 		}
-		else if (PyList_Check(object)) {
+		return object;
+	}
 
-		}
-		else if (PyDict_Check(object)) {
+	// a NUL terminated copy
+	const char* copy(const char* data, size_t size) {
+		char* result = allocate_array<char>(size + 1);
+		std::memcpy(result, data, size);
+		result[size] = 0;
+		return result;
+	}
+
+	// bytes handed out so far, the waste from alignment and block ends excluded
+	size_t allocated() const {
+		return m_allocated;
+	}
 
+	void reset() {
+		while (m_finalizers) {
+			m_finalizers->destroy(m_finalizers->object);
+			m_finalizers = m_finalizers->next;
 		}
-		else {
+		while (m_blocks) {
+			Block* next = m_blocks->next;
+			::operator delete(m_blocks);
+			m_blocks = next;
+		}
+		m_cursor = m_inline;
+		m_end = m_inline + INLINE_SIZE;
+		m_next_block = 4096;
+		m_allocated = 0;
+	}
 
-		};
+private:
 
+	struct Block {
+		Block* next;
 	};
 
-	Object(const Dict& value)
-		: m_object(new Object_None()) {
-
+	struct Finalizer {
+		void (*destroy)(void*);
+		void* object;
+		Finalizer* next;
 	};
 
-	Object(const List& value)
-		: m_object(new Object_None()) {
+	static char* align_up(char* pointer, size_t align) {
+		return (char*)(((uintptr_t)pointer + align - 1) & ~(uintptr_t)(align - 1));
+	}
+
+	void grow(size_t at_least) {
+		size_t size = m_next_block;
+		while (size < at_least + sizeof(Block)) size <<= 1;
+		m_next_block = std::min<size_t>(m_next_block * 2, BLOCK_MAX);
 
-	};
+		Block* block = static_cast<Block*>(::operator new(size));
+		block->next = m_blocks;
+		m_blocks = block;
+		m_cursor = reinterpret_cast<char*>(block + 1);
+		m_end = reinterpret_cast<char*>(block) + size;
+	}
 
-	Object(const Tuple& value)
-		: m_object(new Object_None()) {
+	char* m_cursor;
+	char* m_end;
+	Block* m_blocks;
+	Finalizer* m_finalizers;
+	size_t m_next_block;
+	size_t m_allocated;
 
-	};
+	alignas(std::max_align_t) char m_inline[INLINE_SIZE];
 
-	Object(const std::int64_t& value)
-		: m_object(new Object_Integer(value)) {
+};
 
-	};
+using ArenaPtr = std::shared_ptr<Arena>;
 
-	Object(const std::string& value)
-		: m_object(new Object_String(value)) {
+// a recycled Arena (see Recycled below), what every call is marshaled into
+inline ArenaPtr make_arena();
 
-	};
+/***
 
-	bool operator==(const Object& other) const
-	{
-		return m_object->equals(other);
-	}
+Span is a read-only view over an array that lives in an Arena
 
-	size_t hash() const {
-		return m_object->hash();
-	}
+***/
 
-	struct HashFunction
-	{
-		size_t operator()(const Object& object) const
-		{
-			return object.hash();
-		}
-	};
+template<class T>
+struct Span {
 
-private:
+	const T* data = nullptr;
 
-	class Object_ABC {
+	size_t count = 0;
 
-	public:
+	size_t size() const {
+		return count;
+	}
 
-		const char* Type;
+	bool empty() const {
+		return count == 0;
+	}
 
-		const int32_t TypeHash;
+	const T* begin() const {
+		return data;
+	}
 
-		Object_ABC(const char* type, int32_t typeHash) noexcept
-			: Type(type), TypeHash(typeHash) {
+	const T* end() const {
+		return data + count;
+	}
 
-		}
+	const T& operator[](size_t index) const {
+		if (index >= count) throw new PyABI_Exception;
+		return data[index];
+	}
 
-		virtual ~Object_ABC() {
+};
 
-		}
+/***
 
-		virtual bool equals(const Object& other) const noexcept { return false; }
+Bytes_View is how a worker sees a bytes-like argument: read-only, contiguous,
+with the item format and shape of the exporter (numpy, array.array, memoryview)
 
-		virtual int32_t hash() const = 0;
+***/
 
-		virtual PyObject* toPyObject() = 0;
+struct Bytes_View {
 
-		virtual Safe_I32 toInt32() {
-			return toInt64();
-		};
+	const char* data = nullptr;
 
-		virtual Safe_I64 toInt64() {
-			const Integer_Huge huge = toIntHuge();
-			if (huge > Integer_Huge(std::numeric_limits<long long>::max()) || huge < Integer_Huge(std::numeric_limits<long long>::min())) {
-				throw new PyABI_Exception;
-			}
-			return (int64_t)huge;
-		};
+	size_t size = 0;
 
-		virtual Integer_Huge toIntHuge() {
-			throw new PyABI_Exception;
-		};
+	size_t itemsize = 1;
 
-	};
+	const char* format = "B";
 
-	std::shared_ptr<Object_ABC> m_object;
+	Span<size_t> shape;
 
-	class Object_None : public Object_ABC {
+};
 
-	public:
+/***
 
-		Object_None() noexcept
-			: Object_ABC("None", StringHash::StaticHash("None")) {
+Buffer_Pin holds a PyObject_GetBuffer view for as long as any worker can read it
 
-		}
+The exporter can neither free nor move the memory while the pin exists, so the
+workers read the caller's bytes in place with no copy. PyBuffer_Release needs
+the GIL and the last owner is usually a worker without it, so a dead pin is
+pushed onto a lock-free stack and released by release_pending(), which the
+Python entry points call while they hold the GIL anyway.
 
-		virtual ~Object_None() {
+***/
 
-		}
+class Buffer_Pin final {
 
-		int32_t hash() const override {
-			return 0;
-		}
+public:
 
-		PyObject* toPyObject() override {
-			Py_INCREF(Py_None);
-			return Py_None;
+	struct Retire {
+		void operator()(Buffer_Pin* pin) const {
+			pin->m_next = s_pending.load(std::memory_order_relaxed);
+			while (!s_pending.compare_exchange_weak(pin->m_next, pin, std::memory_order_release, std::memory_order_relaxed)) {
+			}
 		}
-
 	};
 
+	using Ptr = std::unique_ptr<Buffer_Pin, Retire>;
 
-	class Object_Bool : public Object_ABC {
+	/***
 
-	public:
+	while a Copying is alive the thread pins nothing and everything is copied, for
+	marshaling in a sub-interpreter, whose buffers release_pending() can not release
 
-		Object_Bool(bool value = false)
-			: Object_ABC("Bool", StringHash::StaticHash("Bool"))
-			, m_value(value) {
+	***/
 
+	struct Copying {
+		Copying() {
+			tls_copying = true;
+		}
+		~Copying() {
+			tls_copying = false;
 		}
+	};
 
-		int32_t hash() const override {
-			return m_value ? 1 : 0;
+	// GIL held, nullptr (and no Python error) when the object is not C contiguous
+	static Ptr pin(PyObject* object) {
+		if (tls_copying)
+			return nullptr;
+		std::unique_ptr<Buffer_Pin> pin(new Buffer_Pin());
+		if (PyObject_GetBuffer(object, &pin->m_view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+			PyErr_Clear();
+			return nullptr;
 		}
+		return Ptr(pin.release());
+	}
 
-		PyObject* toPyObject() override {
-			if (m_value) {
-				Py_INCREF(Py_True);
-				return Py_True;
-			} else {
-				Py_INCREF(Py_False);
-				return Py_False;
-			}
+	// GIL held
+	static void release_pending() {
+		Buffer_Pin* pin = s_pending.exchange(nullptr, std::memory_order_acquire);
+		while (pin) {
+			Buffer_Pin* next = pin->m_next;
+			PyBuffer_Release(&pin->m_view);
+			delete pin;
+			pin = next;
 		}
+	}
 
-	private:
+	const Py_buffer& view() const {
+		return m_view;
+	}
 
-		bool m_value;
+private:
 
-	};
+	Buffer_Pin() : m_next(nullptr) {
 
+	}
 
-	class Object_String : public Object_ABC {
+	Py_buffer m_view;
 
-	public:
+	Buffer_Pin* m_next;
 
-		Object_String(const std::string& value)
-			: Object_ABC("String", StringHash::StaticHash("String"))
-			, m_value(value) {
+	static inline std::atomic<Buffer_Pin*> s_pending{ nullptr };
 
-		}
+	static inline thread_local bool tls_copying = false;
 
-		int32_t hash() const override {
-			return StringHash__Dynamic(m_value.c_str());
-		}
+};
 
-		PyObject* toPyObject() override {
-			Py_INCREF(Py_None);
-			return Py_None;
-		}
+/***
 
-	private:
+Result_Buffer is memory a worker hands back to Python without copying it: a numeric
+array or a blob of bytes, with its item format and (C contiguous) shape.
 
-		std::string m_value;
+Python gets a read-only memoryview over it, which owns the memory from then on, so
+numpy.frombuffer() and friends use the worker's memory in place. The memory is freed
+with the last of the memoryview and the Results it came in.
 
-	};
+Results::Return(std::vector<T>&&) is the usual way in, the vector is moved so its
+elements never are.
 
+***/
 
-	class Object_Integer : public Object_ABC {
+// the struct module format of T, which has to be a number
+template<class T>
+constexpr const char* PyABI_buffer_format() {
+	static_assert(std::is_arithmetic<T>::value, "a buffer holds numbers");
+	static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8, "no buffer format for that size");
+	if constexpr (std::is_same<T, bool>::value)
+		return "?";
+	else if constexpr (std::is_floating_point<T>::value)
+		return sizeof(T) == 4 ? "f" : "d";
+	else if constexpr (std::is_signed<T>::value)
+		return sizeof(T) == 1 ? "b" : sizeof(T) == 2 ? "h" : sizeof(T) == 4 ? "i" : "q";
+	else
+		return sizeof(T) == 1 ? "B" : sizeof(T) == 2 ? "H" : sizeof(T) == 4 ? "I" : "Q";
+}
 
-	public:
+class Result_Buffer {
 
-		Object_Integer(const long long& value = 0)
-			: Object_ABC("Integer", StringHash::StaticHash("Integer")), m_value(value) {
+public:
 
-			static_assert(sizeof(long long) == sizeof(std::int64_t));
+	virtual ~Result_Buffer() = default;
 
-		}
+	const Bytes_View& view() const {
+		return m_view;
+	}
 
-		int32_t hash() const override {
-			return IntegerHash__Dynamic(m_value);
-		}
+	// GIL held, a new reference
+	static PyObject* memoryview(const std::shared_ptr<Result_Buffer>& buffer) {
+		PyTypeObject* exporter_type = type();
+		if (!exporter_type)
+			return nullptr;
+		Exporter* exporter = (Exporter*)PyType_GenericAlloc(exporter_type, 0);
+		if (!exporter)
+			return nullptr;
+		new (&exporter->buffer) std::shared_ptr<Result_Buffer>(buffer);
+		PyObject* view = PyMemoryView_FromObject((PyObject*)exporter);
+		Py_DECREF(exporter);
+		return view;
+	}
 
-		PyObject* toPyObject() override {
-			return PyLong_FromLongLong(m_value);
+protected:
+
+	// shape empty is one dimension, otherwise it has to multiply out to the item count
+	void describe(const void* data, const size_t count, const size_t itemsize, const char* format, std::vector<size_t> shape) {
+		if (shape.empty())
+			shape.push_back(count);
+		size_t items = 1;
+		for (const size_t extent : shape)
+			items *= extent;
+		if (items != count)
+			throw std::invalid_argument("the shape of a returned buffer does not match its size");
+
+		m_shape = std::move(shape);
+		m_py_shape.assign(m_shape.begin(), m_shape.end());
+		m_py_strides.resize(m_shape.size());
+		Py_ssize_t stride = (Py_ssize_t)itemsize;
+		for (size_t i = m_shape.size(); i-- > 0;) {
+			m_py_strides[i] = stride;
+			stride *= (Py_ssize_t)m_shape[i];
 		}
 
-	private:
+		m_view.data = (const char*)data;
+		m_view.size = count * itemsize;
+		m_view.itemsize = itemsize;
+		m_view.format = format;
+		m_view.shape = Span<size_t>{ m_shape.data(), m_shape.size() };
+	}
 
-		long long m_value;
+private:
 
+	struct Exporter {
+		PyObject_HEAD
+		std::shared_ptr<Result_Buffer> buffer;
+		PyObject* weakrefs;
 	};
 
-	class Object_Integer_Huge : public Object_ABC {
-
-	public:
-
-		Object_Integer_Huge(const Integer_Huge& value = 0)
-			: Object_ABC("Integer", StringHash::StaticHash("Integer"))
-			, m_value(value) {
-
+	static int get_buffer(PyObject* self, Py_buffer* view, int flags) {
+		if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+			PyErr_SetString(PyExc_BufferError, "a returned buffer is read-only");
+			view->obj = nullptr;
+			return -1;
 		}
+		Result_Buffer& buffer = *((Exporter*)self)->buffer;
+		const bool shaped = (flags & PyBUF_ND) == PyBUF_ND;
+		view->obj = self;
+		Py_INCREF(self);
+		view->buf = (void*)buffer.m_view.data;
+		view->len = (Py_ssize_t)buffer.m_view.size;
+		view->readonly = 1;
+		view->itemsize = (Py_ssize_t)buffer.m_view.itemsize;
+		view->format = (flags & PyBUF_FORMAT) ? (char*)buffer.m_view.format : nullptr;
+		view->ndim = shaped ? (int)buffer.m_py_shape.size() : 1;
+		view->shape = shaped ? buffer.m_py_shape.data() : nullptr;
+		view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? buffer.m_py_strides.data() : nullptr;
+		view->suboffsets = nullptr;
+		view->internal = nullptr;
+		return 0;
+	}
 
-		Object_Integer_Huge(PyObject* object)
-			: Object_ABC("Integer", StringHash::StaticHash("Integer")) {
-
-			if (PyLong_Check(object)) {
-				int overflow = 0;
-				long long value = PyLong_AsLongLongAndOverflow(object, &overflow);
-				if (overflow == 0) {
-					m_value = value;
-					return;
-				}
-			}
-
-			auto_pyptr __repr__ = PyObject_Repr(object);
-			const char* repr_utf8 = PyUnicode_AsUTF8(__repr__);
-			if (!repr_utf8) throw new PyABI_Exception;
-			m_value.assign(repr_utf8);
-		}
+	static void dealloc(PyObject* self) {
+		PyTypeObject* type = Py_TYPE(self);
+		if (((Exporter*)self)->weakrefs)
+			PyObject_ClearWeakRefs(self);
+		((Exporter*)self)->buffer.~shared_ptr();
+		type->tp_free(self);
+		Py_DECREF(type);
+	}
 
-		int32_t hash() const override {
-			// TODO: fixme
-			return IntegerHash__Dynamic((int64_t)m_value);
+	// made on first use, with the GIL held
+	static PyTypeObject* type() {
+		static PyTypeObject* exporter_type = nullptr;
+		if (!exporter_type) {
+			// weak references let a test see the memory go with the last memoryview
+			static PyMemberDef members[] = {
+				{ "__weaklistoffset__", T_PYSSIZET, offsetof(Exporter, weakrefs), READONLY, nullptr },
+				{ nullptr, 0, 0, 0, nullptr }
+			};
+			static PyType_Slot slots[] = {
+				{ Py_tp_dealloc, (void*)dealloc },
+				{ Py_tp_members, (void*)members },
+				{ Py_bf_getbuffer, (void*)get_buffer },
+				{ 0, nullptr }
+			};
+			static PyType_Spec spec = {
+				"PyABI_pyd.Result_Buffer", sizeof(Exporter), 0,
+#ifdef Py_TPFLAGS_DISALLOW_INSTANTIATION
+				Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+#else
+				Py_TPFLAGS_DEFAULT,
+#endif
+				slots
+			};
+			exporter_type = (PyTypeObject*)PyType_FromSpec(&spec);
 		}
+		return exporter_type;
+	}
 
-		PyObject* toPyObject() override {
-			if (m_value > std::numeric_limits<long long>::max() || m_value < std::numeric_limits<long long>::min()) {
-				std::string value = convert_to_decimal_string(m_value);
-				return PyLong_FromString(value.c_str(), nullptr, 10);
-			}
-			else {
-				return PyLong_FromLongLong((int64_t)m_value);
-			}
-		}
+	Bytes_View m_view;
 
-	private:
+	std::vector<size_t> m_shape;
 
-		Integer_Huge m_value;
+	std::vector<Py_ssize_t> m_py_shape;
 
-	};
+	std::vector<Py_ssize_t> m_py_strides;
 
-	/***
+};
 
-	this switch statement will fail to compile if any of the strings produce the same hash
+template<class T>
+class Result_Vector final : public Result_Buffer {
 
-	***/
+public:
 
-	void SANITY_CHECK__all_names_hash_uniquely() {
-		switch (int32_t value = 0) {
-		case StringHash::StaticHash("None"):
-		case StringHash::StaticHash("Bool"):
-		case StringHash::StaticHash("List"):
-		case StringHash::StaticHash("Dict"):
-		case StringHash::StaticHash("Tuple"):
-		case StringHash::StaticHash("Bytes"):
-		case StringHash::StaticHash("String"):
-		case StringHash::StaticHash("Integer"):
-		case StringHash::StaticHash("Decimal"):
-		case StringHash::StaticHash("Complex"):
-		case StringHash::StaticHash("Unknown"):
-		case StringHash::StaticHash("Results"):
-			break;
-		}
+	Result_Vector(std::vector<T>&& values, std::vector<size_t> shape)
+		: m_values(std::move(values)) {
+		describe(m_values.data(), m_values.size(), sizeof(T), PyABI_buffer_format<T>(), std::move(shape));
 	}
 
-public:
+private:
 
+	std::vector<T> m_values;
 
 };
 
-
 /***
 
+Object is one Python value marshaled into C++
 
+It is a 16 byte tagged union: None, Bool, Integer and Float live inline, strings,
+huge integers, bytes and containers point into the Arena of the call. Copying an
+Object copies the view, never the value, and it is only valid while its Arena is.
 
-***/
-
-struct List {
+The conversion happens exactly once, on the calling thread with the GIL held, after
+that a worker can read it without ever touching the interpreter. Buffer-protocol
+objects are pinned rather than copied, everything else is deep-converted.
 
-	List() {
+A value that has no C++ counterpart raises TypeError and throws PyABI_Exception.
 
-	};
+***/
 
-	List(PyObject* object) {
+struct Object_Pair;
 
-	};
+class Object {
 
-	PyObject* toPyList() {
+public:
 
+	enum class Tag : uint8_t {
+		None, Bool, Integer, Integer_Huge, Float, String, Bytes, List, Tuple, Dict, Buffer
 	};
 
-private:
-
-	std::vector<Object> m_objects;
-
-};
-
-/***
+	Object() noexcept
+		: m_tag(Tag::None), m_count(0), m_integer(0) {
+		// create a None object by default
+	};
 
+	Object(Arena& arena, PyObject* object) {
+		if (Py_EnterRecursiveCall(" while marshaling an argument")) {
+			throw new PyABI_Exception;
+		}
+		try {
+			marshal(arena, object);
+		}
+		catch (...) {
+			Py_LeaveRecursiveCall();
+			throw;
+		}
+		Py_LeaveRecursiveCall();
+	};
 
+	Object(const Dict& value);
 
-***/
+	Object(const List& value);
 
-struct Tuple {
+	Object(const Tuple& value);
 
-	Tuple() {
+	Object(const bool& value) noexcept
+		: m_tag(Tag::Bool), m_count(0), m_integer(value ? 1 : 0) {
 
 	};
 
-	Tuple(PyObject* object) {
+	Object(const std::int64_t& value) noexcept
+		: m_tag(Tag::Integer), m_count(0), m_integer(value) {
 
 	};
 
-	PyObject* toPyList() {
+	// the other integers that fit in 64 bits, so Object(1) is not ambiguous
+	template<class T, std::enable_if_t<std::is_integral<T>::value && !std::is_same<T, bool>::value && !std::is_same<T, std::int64_t>::value && (std::is_signed<T>::value || sizeof(T) < 8), int> = 0>
+	Object(const T value) noexcept
+		: Object((std::int64_t)value) {
 
 	};
 
-private:
-
-	std::vector<Object> m_objects;
-
-};
-
-/***
-
-
-
-***/
-
-struct Dict {
-
-	Dict() {
+	Object(const double& value) noexcept
+		: m_tag(Tag::Float), m_count(0), m_float(value) {
 
 	};
 
-	Dict(PyObject* object) {
+	Object(Arena& arena, const Integer_Huge& value)
+		: m_tag(Tag::Integer_Huge), m_count(0), m_huge(arena.make<Integer_Huge>(value)) {
 
 	};
 
-	PyObject* toPyDict() {
+	Object(Arena& arena, std::string_view value)
+		: m_tag(Tag::String), m_count(checked_count(value.size())), m_string(arena.copy(value.data(), value.size())) {
 
 	};
 
-private:
+	inline Tag tag() const {
+		return m_tag;
+	}
 
-	// std::map<std::string, Object> stringKeys;
+	const char* type() const {
+		static const char* names[] = { "None", "Bool", "Integer", "Integer", "Float", "String", "Bytes", "List", "Tuple", "Dict", "Bytes" };
+		return names[(int)m_tag];
+	}
 
-	std::unordered_map<Object, Object, Object::HashFunction> m_objects;
+	inline bool isNone() const {
+		return m_tag == Tag::None;
+	}
 
-};
+	inline bool isBool() const {
+		return m_tag == Tag::Bool;
+	}
 
+	inline bool isInteger() const {
+		return m_tag == Tag::Integer || m_tag == Tag::Integer_Huge;
+	}
 
+	inline bool isFloat() const {
+		return m_tag == Tag::Float;
+	}
 
+	inline bool isString() const {
+		return m_tag == Tag::String;
+	}
 
-class Results {
+	// Buffer is bytes a worker returns (see Result_Buffer)
+	inline bool isBytes() const {
+		return m_tag == Tag::Bytes || m_tag == Tag::Buffer;
+	}
 
-public:
+	inline bool isList() const {
+		return m_tag == Tag::List;
+	}
 
-	Results(const size_t call_id)
-		: CallID(call_id),
-		Success(false), ResultTypeSet(false) {
+	inline bool isTuple() const {
+		return m_tag == Tag::Tuple;
+	}
 
-	};
+	inline bool isDict() const {
+		return m_tag == Tag::Dict;
+	}
 
-	const size_t CallID;
+	bool toBool() const {
+		if (m_tag != Tag::Bool) throw new PyABI_Exception;
+		return m_integer != 0;
+	}
 
-	bool Success;
+	Safe_I64 toInt64() const {
+		if (m_tag == Tag::Integer || m_tag == Tag::Bool) {
+			return m_integer;
+		}
+		const Integer_Huge huge = toIntHuge();
+		if (huge > Integer_Huge(std::numeric_limits<long long>::max()) || huge < Integer_Huge(std::numeric_limits<long long>::min())) {
+			throw new PyABI_Exception;
+		}
+		return (int64_t)huge;
+	}
 
-	Object Result;
+	Integer_Huge toIntHuge() const {
+		switch (m_tag) {
+		case Tag::Bool:
+		case Tag::Integer:
+			return (long long)m_integer;
+		case Tag::Integer_Huge:
+			return *m_huge;
+		default:
+			throw new PyABI_Exception;
+		}
+	}
 
-	Dict kwResults;
+	double toFloat() const {
+		switch (m_tag) {
+		case Tag::Float:
+			return m_float;
+		case Tag::Integer:
+			return (double)m_integer;
+		case Tag::Integer_Huge:
+			return (double)*m_huge;
+		default:
+			throw new PyABI_Exception;
+		}
+	}
 
-	void Return(const std::string& value) {
-		ResultTypeSet = true;
-		Result = Object(value);
+	std::string_view toString() const {
+		if (m_tag != Tag::String) throw new PyABI_Exception;
+		return std::string_view(m_string, m_count);
 	}
 
-	void Return(Safe_I64& value) {
-		ResultTypeSet = true;
-		Result = Object(value);
+	Bytes_View toBytes() const {
+		if (m_tag == Tag::Buffer)
+			return (*m_buffer)->view();
+		if (m_tag != Tag::Bytes) throw new PyABI_Exception;
+		return *m_bytes;
 	}
 
-	PyObject* result() {
-		return Result.toPyObject();
-	};
+	// List and Tuple
+	inline size_t size() const {
+		return items().size();
+	}
 
-private:
+	inline const Object& operator[](size_t index) const {
+		return items()[index];
+	}
 
-	bool ResultTypeSet;
+	Span<Object> items() const {
+		if (m_tag != Tag::List && m_tag != Tag::Tuple) throw new PyABI_Exception;
+		return Span<Object>{ m_items, m_count };
+	}
 
-};
+	// Dict, in insertion order
+	Span<Object_Pair> pairs() const;
 
+	PyObject* toPyObject() const;
 
+	bool operator==(const Object& other) const;
 
+	bool operator!=(const Object& other) const {
+		return !(*this == other);
+	}
 
+	size_t hash() const;
 
+	struct HashFunction
+	{
+		size_t operator()(const Object& object) const
+		{
+			return object.hash();
+		}
+	};
+
+	// any sequence (GIL held)
+	static Span<Object> marshal_items(Arena& arena, PyObject* sequence) {
+		if (!sequence) {
+			return Span<Object>();
+		}
+		auto_pyptr fast = PySequence_Fast(sequence, "PyABI expected a sequence");
+		if (!fast) throw new PyABI_Exception;
+		const Py_ssize_t size = PySequence_Fast_GET_SIZE(fast.get());
+		PyObject** objects = PySequence_Fast_ITEMS(fast.get());
+		Object* items = arena.allocate_array<Object>(size);
+		for (Py_ssize_t i = 0; i < size; i++) {
+			new (&items[i]) Object(arena, objects[i]);
+		}
+		return Span<Object>{ items, (size_t)size };
+	}
+
+	// any dict (GIL held)
+	static Span<Object_Pair> marshal_pairs(Arena& arena, PyObject* dict);
+
+	/***
+
+	values built by a worker (no GIL) to return them, copied into the arena, which
+	has to be the arena of the call (Results::arena())
+
+	***/
+
+	static Object list(Arena& arena, const Object* items, size_t count);
+
+	static Object tuple(Arena& arena, const Object* items, size_t count);
+
+	static Object dict(Arena& arena, const Object_Pair* pairs, size_t count);
+
+	static Object buffer(Arena& arena, std::shared_ptr<Result_Buffer> buffer);
+
+private:
+
+	static uint32_t checked_count(size_t count) {
+		if (count > UINT32_MAX) {
+			PyErr_SetString(PyExc_OverflowError, "PyABI can not marshal more than 4G items or characters");
+			throw new PyABI_Exception;
+		}
+		return (uint32_t)count;
+	}
+
+	// checked_count for the workers, which can not raise
+	static uint32_t returned_count(size_t count) {
+		if (count > UINT32_MAX)
+			throw std::length_error("PyABI can not return more than 4G items");
+		return (uint32_t)count;
+	}
+
+	static Object sequence(Arena& arena, Tag tag, const Object* items, size_t count);
+
+	void marshal(Arena& arena, PyObject* object);
+
+	bool isNumber() const {
+		return m_tag == Tag::Bool || m_tag == Tag::Integer || m_tag == Tag::Integer_Huge || m_tag == Tag::Float;
+	}
+
+	enum class Integral { No, Small, Huge };
+
+	// value as the integer it equals, Small in 64 bits, Huge past them; No for a fraction, inf, nan or anything past Integer_Huge
+	static Integral integral(double value, std::int64_t& small, Integer_Huge& huge);
+
+	static size_t hash(const Integer_Huge& huge);
+
+	Tag m_tag;
+
+	uint32_t m_count;
+
+	union {
+		int64_t m_integer;
+		double m_float;
+		const char* m_string;
+		const Integer_Huge* m_huge;
+		const Bytes_View* m_bytes;
+		const Object* m_items;
+		const Object_Pair* m_pairs;
+		const std::shared_ptr<Result_Buffer>* m_buffer;
+	};
+
+};
+
+static_assert(sizeof(Object) == 16, "Object is meant to be a 16 byte tagged union");
+static_assert(std::is_trivially_copyable<Object>::value && std::is_trivially_destructible<Object>::value, "Object is a view into an Arena");
+
+struct Object_Pair {
+
+	Object key;
+
+	Object value;
+
+};
+
+inline Span<Object_Pair> Object::pairs() const {
+	if (m_tag != Tag::Dict) throw new PyABI_Exception;
+	return Span<Object_Pair>{ m_pairs, m_count };
+}
+
+inline Object Object::sequence(Arena& arena, Tag tag, const Object* items, size_t count) {
+	Object result;
+	result.m_tag = tag;
+	result.m_count = returned_count(count);
+	Object* copies = arena.allocate_array<Object>(count);
+	std::copy(items, items + count, copies);
+	result.m_items = copies;
+	return result;
+}
+
+inline Object Object::list(Arena& arena, const Object* items, size_t count) {
+	return sequence(arena, Tag::List, items, count);
+}
+
+inline Object Object::tuple(Arena& arena, const Object* items, size_t count) {
+	return sequence(arena, Tag::Tuple, items, count);
+}
+
+inline Object Object::dict(Arena& arena, const Object_Pair* pairs, size_t count) {
+	Object result;
+	result.m_tag = Tag::Dict;
+	result.m_count = returned_count(count);
+	Object_Pair* copies = arena.allocate_array<Object_Pair>(count);
+	std::copy(pairs, pairs + count, copies);
+	result.m_pairs = copies;
+	return result;
+}
+
+inline Object Object::buffer(Arena& arena, std::shared_ptr<Result_Buffer> buffer) {
+	Object result;
+	result.m_tag = Tag::Buffer;
+	result.m_buffer = arena.make<std::shared_ptr<Result_Buffer>>(std::move(buffer));
+	return result;
+}
+
+inline Span<Object_Pair> Object::marshal_pairs(Arena& arena, PyObject* dict) {
+	if (!dict) {
+		return Span<Object_Pair>();
+	}
+	if (!PyDict_Check(dict)) {
+		PyErr_SetString(PyExc_TypeError, "PyABI expected a dict");
+		throw new PyABI_Exception;
+	}
+	const size_t size = (size_t)PyDict_GET_SIZE(dict);
+	Object_Pair* pairs = arena.allocate_array<Object_Pair>(size);
+	PyObject* key;
+	PyObject* value;
+	Py_ssize_t position = 0;
+	size_t count = 0;
+	while (count < size && PyDict_Next(dict, &position, &key, &value)) {
+		new (&pairs[count].key) Object(arena, key);
+		new (&pairs[count].value) Object(arena, value);
+		count++;
+	}
+	return Span<Object_Pair>{ pairs, count };
+}
+
+/***
+
+bytes, bytearray, memoryview, numpy arrays and anything else with the buffer protocol
+
+C contiguous exporters are pinned and read in place, the rest are copied once
+
+***/
+
+struct Object_Bytes final {
+
+	Bytes_View view;
+
+	Buffer_Pin::Ptr pin;
+
+	Object_Bytes(Arena& arena, PyObject* object)
+		: pin(Buffer_Pin::pin(object)) {
+
+		if (pin) {
+			describe(arena, pin->view(), (const char*)pin->view().buf, false);
+			return;
+		}
+
+		Py_buffer copy;
+		if (PyObject_GetBuffer(object, &copy, PyBUF_FULL_RO) != 0) {
+			throw new PyABI_Exception;
+		}
+		char* data = arena.allocate_array<char>((size_t)copy.len);
+		const int copied = PyBuffer_ToContiguous(data, &copy, copy.len, 'C');
+		describe(arena, copy, data, true);
+		PyBuffer_Release(&copy);
+		if (copied != 0) {
+			throw new PyABI_Exception;
+		}
+	}
+
+private:
+
+	// owned is set when the Py_buffer goes away before the arena does
+	void describe(Arena& arena, const Py_buffer& from, const char* data, bool owned) {
+		view.data = data;
+		view.size = (size_t)from.len;
+		view.itemsize = (size_t)std::max<Py_ssize_t>(from.itemsize, 1);
+		if (from.format) {
+			view.format = owned ? arena.copy(from.format, std::strlen(from.format)) : from.format;
+		}
+		const size_t ndim = from.shape ? (size_t)from.ndim : 1;
+		size_t* shape = arena.allocate_array<size_t>(ndim);
+		for (size_t i = 0; i < ndim; i++) {
+			shape[i] = from.shape ? (size_t)from.shape[i] : view.size / view.itemsize;
+		}
+		view.shape = Span<size_t>{ shape, ndim };
+	}
+
+};
+
+/***
+
+int <-> Integer_Huge through their little endian two's complement bytes, linear in
+the size of the number where the decimal text both ways was quadratic
+
+3.13 has PyLong_AsNativeBytes and PyLong_FromNativeBytes for this, before that
+the (private, but long stable) _PyLong_AsByteArray and _PyLong_FromByteArray
+
+an int wider than Integer_Huge raises OverflowError
+
+***/
+
+inline void PyABI_long_to_huge(PyObject* object, Integer_Huge& huge) {
+	std::uint8_t bytes[Integer_Huge::nrBytes];
+#if PY_VERSION_HEX >= 0x030D0000
+	const Py_ssize_t needed = PyLong_AsNativeBytes(object, bytes, sizeof(bytes), Py_ASNATIVEBYTES_LITTLE_ENDIAN);
+	if (needed < 0) throw new PyABI_Exception;
+	if ((size_t)needed > sizeof(bytes)) {
+		PyErr_Format(PyExc_OverflowError, "PyABI integers are at most %u bits", (unsigned)Integer_Huge::nbits);
+		throw new PyABI_Exception;
+	}
+#else
+	if (_PyLong_AsByteArray((PyLongObject*)object, bytes, sizeof(bytes), 1, 1) < 0) throw new PyABI_Exception;
+#endif
+	for (unsigned i = 0; i < Integer_Huge::nrBytes; i++)
+		huge.setbyte(i, bytes[i]);
+}
+
+inline PyObject* PyABI_huge_to_long(const Integer_Huge& huge) {
+	std::uint8_t bytes[Integer_Huge::nrBytes];
+	for (unsigned i = 0; i < Integer_Huge::nrBytes; i++)
+		bytes[i] = huge.byte(i);
+#if PY_VERSION_HEX >= 0x030D0000
+	return PyLong_FromNativeBytes(bytes, sizeof(bytes), Py_ASNATIVEBYTES_LITTLE_ENDIAN);
+#else
+	return _PyLong_FromByteArray(bytes, sizeof(bytes), 1, 1);
+#endif
+}
+
+inline void Object::marshal(Arena& arena, PyObject* object) {
+	m_count = 0;
+	if (object == Py_None) {
+		m_tag = Tag::None;
+		m_integer = 0;
+	}
+	else if (object == Py_True || object == Py_False) {
+		m_tag = Tag::Bool;
+		m_integer = object == Py_True ? 1 : 0;
+	}
+	else if (PyLong_Check(object)) {
+		int overflow = 0;
+		long long value = PyLong_AsLongLongAndOverflow(object, &overflow);
+		if (overflow == 0) {
+			m_tag = Tag::Integer;
+			m_integer = value;
+		}
+		else {
+			Integer_Huge* huge = arena.make<Integer_Huge>();
+			PyABI_long_to_huge(object, *huge);
+			m_tag = Tag::Integer_Huge;
+			m_huge = huge;
+		}
+	}
+	else if (PyFloat_Check(object)) {
+		m_tag = Tag::Float;
+		m_float = PyFloat_AS_DOUBLE(object);
+	}
+	else if (PyUnicode_Check(object)) {
+		Py_ssize_t size = 0;
+		const char* utf8 = PyUnicode_AsUTF8AndSize(object, &size);
+		if (!utf8) throw new PyABI_Exception;
+		m_count = checked_count((size_t)size);
+		m_tag = Tag::String;
+		m_string = arena.copy(utf8, (size_t)size);
+	}
+	else if (PyObject_CheckBuffer(object)) {
+		m_tag = Tag::Bytes;
+		m_bytes = &arena.make<Object_Bytes>(arena, object)->view;
+	}
+	else if (PyTuple_Check(object) || PyList_Check(object)) {
+		const Span<Object> items = marshal_items(arena, object);
+		m_tag = PyTuple_Check(object) ? Tag::Tuple : Tag::List;
+		m_count = checked_count(items.count);
+		m_items = items.data;
+	}
+	else if (PyDict_Check(object)) {
+		const Span<Object_Pair> pairs = marshal_pairs(arena, object);
+		m_tag = Tag::Dict;
+		m_count = checked_count(pairs.count);
+		m_pairs = pairs.data;
+	}
+	else {
+		PyErr_Format(PyExc_TypeError, "PyABI can not marshal an argument of type '%.200s'", Py_TYPE(object)->tp_name);
+		throw new PyABI_Exception;
+	}
+}
+
+inline PyObject* Object::toPyObject() const {
+	switch (m_tag) {
+	case Tag::None:
+		Py_RETURN_NONE;
+	case Tag::Bool:
+		if (m_integer) Py_RETURN_TRUE;
+		Py_RETURN_FALSE;
+	case Tag::Integer:
+		return PyLong_FromLongLong(m_integer);
+	case Tag::Integer_Huge:
+		return PyABI_huge_to_long(*m_huge);
+	case Tag::Float:
+		return PyFloat_FromDouble(m_float);
+	case Tag::String:
+		return PyUnicode_FromStringAndSize(m_string, m_count);
+	case Tag::Bytes:
+		return PyBytes_FromStringAndSize(m_bytes->data, m_bytes->size);
+	case Tag::Buffer:
+		return Result_Buffer::memoryview(*m_buffer);
+	case Tag::List:
+	case Tag::Tuple: {
+		const bool tuple = m_tag == Tag::Tuple;
+		PyObject* result = tuple ? PyTuple_New(m_count) : PyList_New(m_count);
+		if (!result) return nullptr;
+		for (uint32_t i = 0; i < m_count; i++) {
+			PyObject* item = m_items[i].toPyObject();
+			if (!item) {
+				Py_DECREF(result);
+				return nullptr;
+			}
+			if (tuple) PyTuple_SET_ITEM(result, i, item);
+			else PyList_SET_ITEM(result, i, item);
+		}
+		return result;
+	}
+	case Tag::Dict: {
+		PyObject* result = PyDict_New();
+		if (!result) return nullptr;
+		for (uint32_t i = 0; i < m_count; i++) {
+			auto_pyptr key = m_pairs[i].key.toPyObject();
+			auto_pyptr value = m_pairs[i].value.toPyObject();
+			if (!key || !value || PyDict_SetItem(result, key, value) != 0) {
+				Py_DECREF(result);
+				return nullptr;
+			}
+		}
+		return result;
+	}
+	}
+	Py_RETURN_NONE;
+}
+
+inline Object::Integral Object::integral(const double value, std::int64_t& small, Integer_Huge& huge) {
+	if (!std::isfinite(value) || std::trunc(value) != value)
+		return Integral::No;
+	if (value >= -0x1p63 && value < 0x1p63) {
+		small = (std::int64_t)value;
+		return Integral::Small;
+	}
+	const double limit = std::ldexp(1.0, (int)Integer_Huge::nbits - 1);
+	if (value >= limit || value < -limit)
+		return Integral::No;
+	int exponent = 0;
+	const double mantissa = std::frexp(std::fabs(value), &exponent);
+	huge = (long long)std::ldexp(mantissa, 53);
+	huge <<= exponent - 53;
+	if (value < 0)
+		huge = -huge;
+	return Integral::Huge;
+}
+
+// Bool, Integer, Integer_Huge and Float are equal by value, like 1 == 1.0 == True in Python
+inline bool Object::operator==(const Object& other) const {
+	if (isNumber() && other.isNumber()) {
+		if (m_tag == Tag::Float && other.m_tag == Tag::Float)
+			return m_float == other.m_float;
+		if (m_tag == Tag::Float || other.m_tag == Tag::Float) {
+			const Object& real = m_tag == Tag::Float ? *this : other;
+			const Object& whole = m_tag == Tag::Float ? other : *this;
+			std::int64_t small = 0;
+			Integer_Huge huge;
+			switch (integral(real.m_float, small, huge)) {
+			case Integral::Small:
+				return whole.m_tag == Tag::Integer_Huge ? *whole.m_huge == Integer_Huge((long long)small) : whole.m_integer == small;
+			case Integral::Huge:
+				return whole.m_tag == Tag::Integer_Huge && *whole.m_huge == huge;
+			default:
+				return false;
+			}
+		}
+		if (m_tag != Tag::Integer_Huge && other.m_tag != Tag::Integer_Huge)
+			return m_integer == other.m_integer;
+		return toIntHuge() == other.toIntHuge();
+	}
+	if (m_tag != other.m_tag || m_count != other.m_count)
+		return false;
+	switch (m_tag) {
+	case Tag::None:
+		return true;
+	case Tag::String:
+		return std::memcmp(m_string, other.m_string, m_count) == 0;
+	case Tag::Bytes:
+	case Tag::Buffer: {
+		const Bytes_View left = toBytes();
+		const Bytes_View right = other.toBytes();
+		return left.size == right.size && std::memcmp(left.data, right.data, left.size) == 0;
+	}
+	case Tag::List:
+	case Tag::Tuple:
+		for (uint32_t i = 0; i < m_count; i++) {
+			if (m_items[i] != other.m_items[i])
+				return false;
+		}
+		return true;
+	default:
+		// dicts are not hashable in Python either
+		return false;
+	}
+}
+
+/***
+
+equal Objects hash equally, numbers by value as in Python: a Bool, an Integer_Huge
+that fits in 64 bits or a Float that is a whole number hashes like the Integer it
+equals, a bigger one hashes its two's complement bytes without the sign extension
+
+***/
+
+inline size_t Object::hash(const Integer_Huge& huge) {
+	if (huge <= Integer_Huge(std::numeric_limits<long long>::max()) && huge >= Integer_Huge(std::numeric_limits<long long>::min()))
+		return (size_t)PyABI_Hash::word((std::uint64_t)(std::int64_t)huge);
+	std::uint8_t bytes[Integer_Huge::nrBytes];
+	for (unsigned i = 0; i < Integer_Huge::nrBytes; i++)
+		bytes[i] = huge.byte(i);
+	const std::uint8_t extension = huge.sign() ? 0xFF : 0x00;
+	size_t size = Integer_Huge::nrBytes;
+	while (size > 8 && bytes[size - 1] == extension)
+		size--;
+	return (size_t)PyABI_Hash::bytes(bytes, size, extension);
+}
+
+inline size_t Object::hash() const {
+	switch (m_tag) {
+	case Tag::None:
+		return (size_t)PyABI_Hash::SECRET[2];
+	case Tag::Bool:
+	case Tag::Integer:
+		return (size_t)PyABI_Hash::word((std::uint64_t)m_integer);
+	case Tag::Integer_Huge:
+		return hash(*m_huge);
+	case Tag::Float: {
+		std::int64_t small = 0;
+		Integer_Huge huge;
+		switch (integral(m_float, small, huge)) {
+		case Integral::Small:
+			return (size_t)PyABI_Hash::word((std::uint64_t)small);
+		case Integral::Huge:
+			return hash(huge);
+		default:
+			break;
+		}
+		std::uint64_t bits;
+		std::memcpy(&bits, &m_float, sizeof(bits));
+		return (size_t)PyABI_Hash::word(bits, PyABI_Hash::SECRET[3]);
+	}
+	case Tag::String:
+		return (size_t)PyABI_Hash::bytes(m_string, m_count);
+	case Tag::Bytes:
+	case Tag::Buffer: {
+		const Bytes_View view = toBytes();
+		return (size_t)PyABI_Hash::bytes(view.data, view.size);
+	}
+	case Tag::List:
+	case Tag::Tuple: {
+		std::uint64_t result = PyABI_Hash::word(m_count, PyABI_Hash::SECRET[2]);
+		for (uint32_t i = 0; i < m_count; i++)
+			result = PyABI_Hash::word(m_items[i].hash(), result);
+		return (size_t)result;
+	}
+	default:
+		return m_count;
+	}
+}
+
+
+/***
+
+the positional arguments of a call, from any Python sequence
+
+List, Tuple and Dict are views into the Arena of the call, just like Object
+
+***/
+
+struct List {
+
+	List() {
+
+	};
+
+	List(Arena& arena, PyObject* object)
+		: m_objects(Object::marshal_items(arena, object)) {
+
+	};
+
+	size_t size() const {
+		return m_objects.size();
+	}
+
+	const Object& operator[](size_t index) const {
+		return m_objects[index];
+	}
+
+	Span<Object> objects() const {
+		return m_objects;
+	}
+
+	PyObject* toPyList() const {
+		return Object(*this).toPyObject();
+	};
+
+private:
+
+	Span<Object> m_objects;
+
+};
+
+/***
+
+the resolved defaults of a call, from any Python sequence
+
+***/
+
+struct Tuple {
+
+	Tuple() {
+
+	};
+
+	Tuple(Arena& arena, PyObject* object)
+		: m_objects(Object::marshal_items(arena, object)) {
+
+	};
+
+	size_t size() const {
+		return m_objects.size();
+	}
+
+	const Object& operator[](size_t index) const {
+		return m_objects[index];
+	}
+
+	Span<Object> objects() const {
+		return m_objects;
+	}
+
+	PyObject* toPyList() const {
+		return Object(*this).toPyObject();
+	};
+
+private:
+
+	Span<Object> m_objects;
+
+};
+
+/***
+
+the keyword arguments of a call, kwargs may be nullptr
+
+a Dict of more than INDEXED pairs gets a flat open addressing index in the arena,
+built once by the constructor: a power of two of 64 bit slots, each the high half
+of a key's hash and the key's position + 1 (0 for an empty slot), probed linearly
+at no more than half full; smaller Dicts are scanned, which is faster at that size
+
+the slot mask sits just ahead of the slots, a Dict stays small enough for a call
+to carry one inline (see Singleton::Dispatch)
+
+***/
+
+struct Dict {
+
+	static constexpr size_t INDEXED = 8;
+
+	Dict() {
+
+	};
+
+	Dict(Arena& arena, PyObject* object)
+		: m_pairs(Object::marshal_pairs(arena, object)) {
+		index(arena);
+	};
+
+	size_t size() const {
+		return m_pairs.size();
+	}
+
+	Span<Object_Pair> pairs() const {
+		return m_pairs;
+	}
+
+	// nullptr when the key is missing
+	const Object* find(const Object& key) const {
+		return find([&]() { return key.hash(); }, [&](const Object& candidate) { return candidate == key; });
+	}
+
+	// a str key, without making an Object of it
+	const Object* find(std::string_view key) const {
+		return find([&]() { return (size_t)PyABI_Hash::bytes(key.data(), key.size()); }, [&](const Object& candidate) {
+			return candidate.isString() && candidate.toString() == key;
+		});
+	}
+
+	PyObject* toPyDict() const {
+		return Object(*this).toPyObject();
+	};
+
+private:
+
+	// hash() is only worked out for an indexed Dict
+	template<class Hash, class Equals>
+	const Object* find(Hash&& hash_of, Equals&& equals) const {
+		if (!m_slots) {
+			for (auto& pair : m_pairs) {
+				if (equals(pair.key))
+					return &pair.value;
+			}
+			return nullptr;
+		}
+
+		const std::uint64_t hash = hash_of();
+		const std::uint64_t mask = m_slots[-1];
+		const std::uint32_t tag = (std::uint32_t)((std::uint64_t)hash >> 32);
+		for (std::uint64_t slot = hash & mask;; slot = (slot + 1) & mask) {
+			const std::uint64_t entry = m_slots[slot];
+			if (entry == 0)
+				return nullptr;
+			if ((std::uint32_t)(entry >> 32) == tag) {
+				const Object_Pair& pair = m_pairs[(std::uint32_t)entry - 1];
+				if (equals(pair.key))
+					return &pair.value;
+			}
+		}
+	}
+
+	void index(Arena& arena) {
+		if (m_pairs.size() <= INDEXED)
+			return;
+
+		size_t capacity = 16;
+		while (capacity < m_pairs.size() * 2)
+			capacity <<= 1;
+		std::uint64_t* slots = arena.allocate_array<std::uint64_t>(capacity + 1) + 1;
+		std::memset(slots, 0, capacity * sizeof(std::uint64_t));
+		const std::uint64_t mask = capacity - 1;
+		slots[-1] = mask;
+
+		for (size_t i = 0; i < m_pairs.size(); i++) {
+			const std::uint64_t hash = m_pairs[i].key.hash();
+			std::uint64_t slot = hash & mask;
+			while (slots[slot] != 0)
+				slot = (slot + 1) & mask;
+			slots[slot] = (hash >> 32 << 32) | (std::uint64_t)(i + 1);
+		}
+		m_slots = slots;
+	}
+
+	Span<Object_Pair> m_pairs;
+
+	const std::uint64_t* m_slots = nullptr;
+
+};
+
+inline Object::Object(const Dict& value)
+	: m_tag(Tag::Dict), m_count(checked_count(value.pairs().size())), m_pairs(value.pairs().data) {
+
+};
+
+inline Object::Object(const List& value)
+	: m_tag(Tag::List), m_count(checked_count(value.objects().size())), m_items(value.objects().data) {
+
+};
+
+inline Object::Object(const Tuple& value)
+	: m_tag(Tag::Tuple), m_count(checked_count(value.objects().size())), m_items(value.objects().data) {
+
+};
+
+
+inline std::uint64_t PyABI_now();
+
+/***
+
+Cancellations records which of the latest WINDOW CallIDs have been cancelled, the
+cancellation token of every call in flight without registering any of them
+
+A slot is empty or holds a CallID with what has happened to it: STARTED once its
+worker reached it, CANCELLED, FINISHED. A call only marks the slot when it is
+empty or an older call is done with it (finished, or not cancelled so nobody
+reads its token any more), so a cancelled call keeps its mark until it finishes
+and a cancel of a newer call in its slot is refused. Only calls within WINDOW of
+the newest one can be cancelled, by the time a call is further behind than that
+the default limits have long made the caller wait.
+
+A call cancelled before its worker reached it is CANCELLED without STARTED,
+cancel() says so (the Singleton withdraws it from its pool's queued() count) and
+whichever of started() and finished() finds the mark like that says so too (the
+withdrawal is over), exactly once each.
+
+***/
+
+class Cancellations final {
+
+public:
+
+	static constexpr std::size_t WINDOW = 1 << 16;
+
+	static constexpr std::uint64_t FINISHED = 1ull << 63;
+	static constexpr std::uint64_t CANCELLED = 1ull << 62;
+	static constexpr std::uint64_t STARTED = 1ull << 61;
+
+	Cancellations()
+		: m_slots(new std::atomic<std::uint64_t>[WINDOW]) {
+		for (std::size_t i = 0; i < WINDOW; i++)
+			m_slots[i].store(0, std::memory_order_relaxed);
+	}
+
+	// false when call_id is not one of the latest WINDOW issued before next, has finished, or another cancelled call holds its slot;
+	// queued when it had not started
+	bool cancel(const std::uint64_t call_id, const std::uint64_t next, bool& queued) {
+		queued = false;
+		if (call_id == 0 || call_id >= next || next - call_id > WINDOW)
+			return false;
+		std::atomic<std::uint64_t>& slot = m_slots[call_id & (WINDOW - 1)];
+		std::uint64_t mark = slot.load(std::memory_order_acquire);
+		while (true) {
+			if (id(mark) == call_id) {
+				if (mark & (FINISHED | CANCELLED))
+					return !(mark & FINISHED);
+				if (slot.compare_exchange_weak(mark, mark | CANCELLED, std::memory_order_acq_rel))
+					return true;
+			}
+			else if (!vacant(mark, call_id))
+				return false;
+			else if (slot.compare_exchange_weak(mark, call_id | CANCELLED, std::memory_order_acq_rel)) {
+				queued = true;
+				return true;
+			}
+		}
+	}
+
+	bool cancelled(const std::uint64_t call_id) const {
+		const std::uint64_t mark = m_slots[call_id & (WINDOW - 1)].load(std::memory_order_acquire);
+		return (mark & ~STARTED) == (call_id | CANCELLED);
+	}
+
+	// the call's worker has reached it, true when it was cancelled while queued
+	bool started(const std::uint64_t call_id) {
+		std::atomic<std::uint64_t>& slot = m_slots[call_id & (WINDOW - 1)];
+		std::uint64_t mark = slot.load(std::memory_order_acquire);
+		while (id(mark) == call_id || vacant(mark, call_id)) {
+			const std::uint64_t marked = id(mark) == call_id ? mark | STARTED : call_id | STARTED;
+			if (slot.compare_exchange_weak(mark, marked, std::memory_order_acq_rel))
+				return mark == (call_id | CANCELLED);
+		}
+		return false;
+	}
+
+	// the call has finished, a later cancel of it is refused; true when it was cancelled as queued after it started unmarked
+	bool finished(const std::uint64_t call_id) {
+		std::atomic<std::uint64_t>& slot = m_slots[call_id & (WINDOW - 1)];
+		std::uint64_t mark = slot.load(std::memory_order_acquire);
+		while (id(mark) == call_id || vacant(mark, call_id)) {
+			if (slot.compare_exchange_weak(mark, call_id | FINISHED, std::memory_order_acq_rel))
+				return mark == (call_id | CANCELLED);
+		}
+		return false;
+	}
+
+private:
+
+	static std::uint64_t id(const std::uint64_t mark) {
+		return mark & (STARTED - 1);
+	}
+
+	// empty, or an older call that is finished or whose token nobody reads any more
+	static bool vacant(const std::uint64_t mark, const std::uint64_t call_id) {
+		return mark == 0 || (id(mark) < call_id && ((mark & FINISHED) || !(mark & CANCELLED)));
+	}
+
+	std::unique_ptr<std::atomic<std::uint64_t>[]> m_slots;
+
+};
+
+/***
+
+Watches tracks, over the same window of CallIDs as Cancellations, whether a call
+that something depends on (see Singleton::Continue) has finished and where its
+Results went
+
+A slot holds a CallID and its state, a call that is queued or running leaves no
+mark of its own. The finishing worker and whoever starts watching the call both
+CAS their mark into the slot, so exactly one of them sees the other's: either the
+worker hands its Results to the watchers, or the watcher finds them finished.
+
+A call only takes the slot when it is empty or an older call is done with it, a
+Watched or Held mark stays until its own call lets go of it. A call finishing
+while another one holds its slot records nothing and cannot be depended on, see
+available().
+
+***/
+
+class Watches final {
+
+public:
+
+	// Unknown: nothing recorded about the call, it is still queued or running
+	enum class State : std::uint64_t { Watched, Finished, Held, Collected, Unknown };
+
+	static constexpr std::size_t WINDOW = Cancellations::WINDOW;
+
+	Watches()
+		: m_slots(new std::atomic<std::uint64_t>[WINDOW]) {
+		for (std::size_t i = 0; i < WINDOW; i++)
+			m_slots[i].store(0, std::memory_order_relaxed);
+	}
+
+	State state(const std::uint64_t call_id) const {
+		const std::uint64_t mark = slot(call_id).load(std::memory_order_acquire);
+		return (mark >> 2) == call_id ? (State)(mark & 3) : State::Unknown;
+	}
+
+	// false when another call still needs the slot, call_id can be neither watched nor found
+	bool available(const std::uint64_t call_id) const {
+		const std::uint64_t mark = slot(call_id).load(std::memory_order_acquire);
+		return (mark >> 2) == call_id || vacant(mark, call_id);
+	}
+
+	// false when call_id has finished already, see state() for where its Results are, only once available()
+	bool watch(const std::uint64_t call_id) {
+		std::uint64_t mark = slot(call_id).load(std::memory_order_acquire);
+		while (true) {
+			if ((mark >> 2) == call_id)
+				return (State)(mark & 3) == State::Watched;
+			if (!vacant(mark, call_id))
+				return false;
+			if (slot(call_id).compare_exchange_weak(mark, encode(call_id, State::Watched), std::memory_order_acq_rel))
+				return true;
+		}
+	}
+
+	// the call is finishing, true when something watches it
+	bool finish(const std::uint64_t call_id) {
+		std::uint64_t mark = slot(call_id).load(std::memory_order_acquire);
+		while ((mark >> 2) == call_id || vacant(mark, call_id)) {
+			if (slot(call_id).compare_exchange_weak(mark, encode(call_id, State::Finished), std::memory_order_acq_rel))
+				return mark == encode(call_id, State::Watched);
+		}
+		return false;
+	}
+
+	// Held while its watchers have its Results, Finished once they are done with them
+	void set(const std::uint64_t call_id, const State state) {
+		slot(call_id).store(encode(call_id, state), std::memory_order_release);
+	}
+
+	// Python has taken the Results, whatever watches the call from now on is too late
+	void collected(const std::uint64_t call_id) {
+		std::uint64_t finished = encode(call_id, State::Finished);
+		slot(call_id).compare_exchange_strong(finished, encode(call_id, State::Collected), std::memory_order_acq_rel);
+	}
+
+private:
+
+	static std::uint64_t encode(const std::uint64_t call_id, const State state) {
+		return call_id << 2 | (std::uint64_t)state;
+	}
+
+	// empty, or an older call whose Results nothing here waits for any more
+	static bool vacant(const std::uint64_t mark, const std::uint64_t call_id) {
+		const State state = (State)(mark & 3);
+		return mark == 0 || ((mark >> 2) < call_id && (state == State::Finished || state == State::Collected));
+	}
+
+	std::atomic<std::uint64_t>& slot(const std::uint64_t call_id) const {
+		return m_slots[call_id & (WINDOW - 1)];
+	}
+
+	std::unique_ptr<std::atomic<std::uint64_t>[]> m_slots;
+
+};
+
+class Results {
+
+public:
+
+	Results(const size_t call_id = 0, ArenaPtr memory = nullptr)
+		: CallID(call_id),
+		Success(false), Memory(std::move(memory)), ResultTypeSet(false) {
+
+	};
+
+	/***
+
+	Results travel from the workers to Python through the result ring, they are
+	moved at every step and never copied
+
+	***/
+
+	Results(Results&&) = default;
+	Results& operator=(Results&&) = default;
+
+	Results(const Results&) = delete;
+	Results& operator=(const Results&) = delete;
+
+	size_t CallID;
+
+	bool Success;
+
+	Object Result;
+
+	Dict kwResults;
+
+	// why Success is false: the scheduler never ran the call, it was cancelled or timed out, or it ran and failed (Result is the message)
+	enum class Failure : std::uint8_t { None, Expired, Shed, Raised, Cancelled, Timed_Out };
+	Failure Reason = Failure::None;
+
+	// PyABI_now() when the call was submitted, picked up by a worker and finished
+	std::uint64_t Enqueued = 0;
+	std::uint64_t Started = 0;
+	std::uint64_t Finished = 0;
+
+	// the PyABI_now() the call times out at, 0 for never, and where cancel() leaves its mark
+	std::uint64_t Expires = 0;
+	const Cancellations* Cancels = nullptr;
+
+	/***
+
+	the Results of the calls named in after=, in that order: the call only runs once
+	they have all finished, and each of them reaches Python after every call that
+	depends on it has run; an input is nullptr when Python had collected it already
+
+	***/
+
+	std::vector<std::shared_ptr<const Results>> Inputs;
+
+	/***
+
+	the cancellation token: a call that runs for long should poll cancelled() and
+	return early once it is true, the call then fails as cancelled (or timed out)
+	whatever it returned
+
+	***/
+
+	bool cancelled() const {
+		return stopped() != Failure::None;
+	}
+
+	// Cancelled, Timed_Out or None
+	Failure stopped() const {
+		if (Cancels && Cancels->cancelled(CallID))
+			return Failure::Cancelled;
+		if (Expires && PyABI_now() > Expires)
+			return Failure::Timed_Out;
+		return Failure::None;
+	}
+
+	/***
+
+	what a call hands back to Python, from the worker and without the GIL
+
+	numbers, strings and anything built with the helpers below (lists, tuples and
+	dicts nest), a std::vector of numbers becomes a memoryview over the vector's
+	own memory (see Result_Buffer), shape defaults to one dimension
+
+	every value lives in the arena of the call, Return(std::vector) takes the vector
+
+	***/
+
+	void Return(const Object& value) {
+		ResultTypeSet = true;
+		Result = value;
+	}
+
+	template<class T, std::enable_if_t<std::is_arithmetic<T>::value, int> = 0>
+	void Return(const T value) {
+		Return(number(value));
+	}
+
+	void Return(std::string_view value) {
+		Return(string(value));
+	}
+
+	void Return(const char* value) {
+		Return(string(value));
+	}
+
+	void Return(const std::string& value) {
+		Return(string(value));
+	}
+
+	void Return(Safe_I64& value) {
+		Return(Object((int64_t)value));
+	}
+
+	template<class T>
+	void Return(std::vector<T>&& values, std::vector<size_t> shape = {}) {
+		Return(buffer(std::move(values), std::move(shape)));
+	}
+
+	// the call failed, Python gets a RuntimeError(message) as its result
+	void Fail(std::string_view message) {
+		Success = false;
+		Reason = Failure::Raised;
+		Result = string(message);
+		ResultTypeSet = true;
+	}
+
+	template<class T>
+	Object number(const T value) {
+		if constexpr (std::is_same<T, bool>::value)
+			return Object(value);
+		else if constexpr (std::is_floating_point<T>::value)
+			return Object((double)value);
+		else if constexpr (std::is_unsigned<T>::value && sizeof(T) == 8) {
+			if (value <= (std::uint64_t)std::numeric_limits<std::int64_t>::max())
+				return Object((std::int64_t)value);
+			Integer_Huge huge;
+			huge.set_raw_bits(value);
+			return Object(arena(), huge);
+		}
+		else
+			return Object((std::int64_t)value);
+	}
+
+	Object string(std::string_view value) {
+		return Object(arena(), value);
+	}
+
+	Object list(std::initializer_list<Object> items) {
+		return Object::list(arena(), items.begin(), items.size());
+	}
+
+	Object list(const std::vector<Object>& items) {
+		return Object::list(arena(), items.data(), items.size());
+	}
+
+	Object tuple(std::initializer_list<Object> items) {
+		return Object::tuple(arena(), items.begin(), items.size());
+	}
+
+	Object tuple(const std::vector<Object>& items) {
+		return Object::tuple(arena(), items.data(), items.size());
+	}
+
+	Object dict(std::initializer_list<Object_Pair> pairs) {
+		return Object::dict(arena(), pairs.begin(), pairs.size());
+	}
+
+	Object dict(const std::vector<Object_Pair>& pairs) {
+		return Object::dict(arena(), pairs.data(), pairs.size());
+	}
+
+	template<class T>
+	Object buffer(std::vector<T>&& values, std::vector<size_t> shape = {}) {
+		return Object::buffer(arena(), std::make_shared<Result_Vector<T>>(std::move(values), std::move(shape)));
+	}
+
+	PyObject* result() {
+		return Result.toPyObject();
+	};
+
+	// the arena of the call, the arguments and everything returned live in it
+	Arena& arena() {
+		if (!Memory)
+			Memory = make_arena();
+		return *Memory;
+	}
+
+private:
+
+	ArenaPtr Memory;
+
+	bool ResultTypeSet;
+
+};
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+/***
+
+Lock-free building blocks for the scheduler
+
+Producers and consumers on different cores must not share a cache line, so every
+hot cursor is padded out to PyABI_cache_line.
+
+***/
+
+constexpr std::size_t PyABI_cache_line = 64;
+
+/***
+
+BoundedQueue is Dmitry Vyukov's bounded MPMC ring
+
+http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+
+Every slot carries a sequence number, so a producer only ever contends with other
+producers on the tail and a consumer only with other consumers on the head. The
+values are moved in and moved out, never copied.
+
+***/
+
+template <class T>
+class BoundedQueue final {
+
+public:
+
+	explicit BoundedQueue(std::size_t capacity = 1 << 16)
+		: m_mask(round_up(capacity) - 1)
+		, m_slots(new Slot[m_mask + 1])
+		, m_head(0), m_tail(0) {
+
+		for (std::size_t i = 0; i <= m_mask; i++) {
+			m_slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	~BoundedQueue() {
+		T* value;
+		while ((value = front()) != nullptr) {
+			value->~T();
+			advance();
+		}
+	}
+
+	BoundedQueue(BoundedQueue const&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	bool try_push(T&& value) {
+		Slot* slot;
+		std::size_t tail = m_tail.load(std::memory_order_relaxed);
+		while (true) {
+			slot = &m_slots[tail & m_mask];
+			const std::size_t sequence = slot->sequence.load(std::memory_order_acquire);
+			const std::intptr_t diff = (std::intptr_t)sequence - (std::intptr_t)tail;
+			if (diff == 0) {
+				if (m_tail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0) {
+				return false; // full
+			}
+			else {
+				tail = m_tail.load(std::memory_order_relaxed);
+			}
+		}
+		new (slot->storage) T(std::move(value));
+		slot->sequence.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool try_pop(T& value) {
+		Slot* slot;
+		std::size_t head = m_head.load(std::memory_order_relaxed);
+		while (true) {
+			slot = &m_slots[head & m_mask];
+			const std::size_t sequence = slot->sequence.load(std::memory_order_acquire);
+			const std::intptr_t diff = (std::intptr_t)sequence - (std::intptr_t)(head + 1);
+			if (diff == 0) {
+				if (m_head.compare_exchange_weak(head, head + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0) {
+				return false; // empty
+			}
+			else {
+				head = m_head.load(std::memory_order_relaxed);
+			}
+		}
+		T* stored = reinterpret_cast<T*>(slot->storage);
+		value = std::move(*stored);
+		stored->~T();
+		slot->sequence.store(head + m_mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	std::size_t size_approx() const {
+		const std::size_t tail = m_tail.load(std::memory_order_acquire);
+		const std::size_t head = m_head.load(std::memory_order_acquire);
+		return tail > head ? tail - head : 0;
+	}
+
+	std::size_t capacity() const {
+		return m_mask + 1;
+	}
+
+private:
+
+	struct alignas(PyABI_cache_line) Slot {
+		std::atomic<std::size_t> sequence;
+		alignas(T) unsigned char storage[sizeof(T)];
+	};
+
+	static std::size_t round_up(std::size_t capacity) {
+		std::size_t result = 2;
+		while (result < capacity) result <<= 1;
+		return result;
+	}
+
+	// only used by the destructor, when nobody else can touch the queue
+	T* front() {
+		Slot& slot = m_slots[m_head.load(std::memory_order_relaxed) & m_mask];
+		if (slot.sequence.load(std::memory_order_acquire) != m_head.load(std::memory_order_relaxed) + 1)
+			return nullptr;
+		return reinterpret_cast<T*>(slot.storage);
+	}
+
+	void advance() {
+		m_head.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	const std::size_t m_mask;
+
+	std::unique_ptr<Slot[]> m_slots;
+
+	alignas(PyABI_cache_line) std::atomic<std::size_t> m_head;
+
+	alignas(PyABI_cache_line) std::atomic<std::size_t> m_tail;
+
+};
+
+/***
+
+Recycled keeps freed blocks of sizeof(T) on a lock-free free list shared by every
+thread, so objects made on one thread and freed on another (a call's Arena, a
+pool's tasks) stop costing a heap allocation once the list has warmed up. The
+list holds at most PyABI_recycled blocks, beyond that they go back to the heap.
+
+The list is never destroyed, blocks freed during static destruction still have
+somewhere to go.
+
+Recycling_Allocator is the same thing as an allocator, for std::allocate_shared.
+
+***/
+
+constexpr std::size_t PyABI_recycled = 1 << 12;
+
+template<class T>
+class Recycled final {
+
+public:
+
+	static void* allocate() {
+		void* block;
+		if (blocks().try_pop(block))
+			return block;
+		return ::operator new(sizeof(T));
+	}
+
+	static void deallocate(void* block) {
+		if (!blocks().try_push(std::move(block)))
+			::operator delete(block);
+	}
+
+private:
+
+	static BoundedQueue<void*>& blocks() {
+		static BoundedQueue<void*>* free = new BoundedQueue<void*>(PyABI_recycled);
+		return *free;
+	}
+
+};
+
+template<class T>
+struct Recycling_Allocator {
+
+	using value_type = T;
+
+	Recycling_Allocator() = default;
+
+	template<class U>
+	Recycling_Allocator(const Recycling_Allocator<U>&) {
+	}
+
+	T* allocate(const std::size_t count) {
+		if (count == 1)
+			return static_cast<T*>(Recycled<T>::allocate());
+		return static_cast<T*>(::operator new(count * sizeof(T)));
+	}
+
+	void deallocate(T* block, const std::size_t count) {
+		if (count == 1)
+			Recycled<T>::deallocate(block);
+		else
+			::operator delete(block);
+	}
+
+	template<class U>
+	bool operator==(const Recycling_Allocator<U>&) const {
+		return true;
+	}
+
+	template<class U>
+	bool operator!=(const Recycling_Allocator<U>&) const {
+		return false;
+	}
+
+};
+
+// the control block and the Arena come out of one recycled block
+inline ArenaPtr make_arena() {
+	return std::allocate_shared<Arena>(Recycling_Allocator<Arena>());
+}
+
+/***
+
+WorkStealingDeque is the Chase-Lev deque, with the memory orderings from
+
+"Correct and Efficient Work-Stealing for Weak Memory Models", Le et al. 2013
+
+The owning worker pushes and pops at the bottom (LIFO, so the freshest and
+cache-warm task runs next) while thieves steal from the top (FIFO). The ring
+doubles when full; retired rings are kept until the deque dies because a thief
+may still be reading from one.
+
+***/
+
+template <class T>
+class WorkStealingDeque final {
+
+	static_assert(std::is_pointer<T>::value, "WorkStealingDeque holds pointers, nullptr means empty");
+
+public:
+
+	explicit WorkStealingDeque(std::int64_t capacity = 256)
+		: m_top(0), m_bottom(0) {
+		std::int64_t size = 2;
+		while (size < capacity) size <<= 1;
+		m_rings.emplace_back(new Ring(size));
+		m_ring.store(m_rings.back().get(), std::memory_order_relaxed);
+	}
+
+	WorkStealingDeque(WorkStealingDeque const&) = delete;
+	WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+	// owner only
+	void push(T item) {
+		const std::int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+		const std::int64_t top = m_top.load(std::memory_order_acquire);
+		Ring* ring = m_ring.load(std::memory_order_relaxed);
+		if (bottom - top > ring->mask) {
+			ring = grow(ring, top, bottom);
+		}
+		ring->put(bottom, item);
+		std::atomic_thread_fence(std::memory_order_release);
+		m_bottom.store(bottom + 1, std::memory_order_relaxed);
+	}
+
+	// owner only
+	T pop() {
+		const std::int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+		Ring* ring = m_ring.load(std::memory_order_relaxed);
+		m_bottom.store(bottom, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::int64_t top = m_top.load(std::memory_order_relaxed);
+
+		if (top > bottom) {
+			m_bottom.store(bottom + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		T item = ring->get(bottom);
+		if (top == bottom) {
+			// last item, race the thieves for it
+			if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				item = nullptr;
+			m_bottom.store(bottom + 1, std::memory_order_relaxed);
+		}
+		return item;
+	}
+
+	// any thread
+	T steal() {
+		std::int64_t top = m_top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		const std::int64_t bottom = m_bottom.load(std::memory_order_acquire);
+
+		if (top >= bottom)
+			return nullptr;
+
+		Ring* ring = m_ring.load(std::memory_order_acquire);
+		T item = ring->get(top);
+		if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			return nullptr; // lost the race, the caller moves on to another victim
+		return item;
+	}
+
+	bool empty() const {
+		return m_bottom.load(std::memory_order_relaxed) <= m_top.load(std::memory_order_relaxed);
+	}
+
+	// approximate when other threads are pushing or stealing
+	std::size_t size() const {
+		const std::int64_t size = m_bottom.load(std::memory_order_relaxed) - m_top.load(std::memory_order_relaxed);
+		return size > 0 ? (std::size_t)size : 0;
+	}
+
+private:
+
+	struct Ring {
+		const std::int64_t mask;
+		std::unique_ptr<std::atomic<T>[]> items;
+
+		explicit Ring(std::int64_t size)
+			: mask(size - 1), items(new std::atomic<T>[size]) {
+		}
+
+		T get(std::int64_t index) const {
+			return items[index & mask].load(std::memory_order_relaxed);
+		}
+
+		void put(std::int64_t index, T item) {
+			items[index & mask].store(item, std::memory_order_relaxed);
+		}
+	};
+
+	Ring* grow(Ring* ring, std::int64_t top, std::int64_t bottom) {
+		Ring* bigger = new Ring((ring->mask + 1) * 2);
+		for (std::int64_t i = top; i < bottom; i++) {
+			bigger->put(i, ring->get(i));
+		}
+		m_rings.emplace_back(bigger);
+		m_ring.store(bigger, std::memory_order_release);
+		return bigger;
+	}
+
+	alignas(PyABI_cache_line) std::atomic<std::int64_t> m_top;
+
+	alignas(PyABI_cache_line) std::atomic<std::int64_t> m_bottom;
+
+	std::atomic<Ring*> m_ring;
+
+	std::vector<std::unique_ptr<Ring>> m_rings;
+
+};
+
+/***
+
+CPU affinity for the pool workers
+
+PyABI_pin_thread restricts the calling thread to cpus (an empty set undoes it),
+PyABI_numa_cpus lists the CPUs of one NUMA node, empty if there is no such node.
+Other POSIX systems (macOS) have no hard affinity, there both are no-ops.
+
+***/
+
+inline bool PyABI_pin_thread(const std::vector<int>& cpus) {
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (cpus.empty()) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, &set);
+	}
+	for (int cpu : cpus) {
+		if (cpu >= 0 && cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &set);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+	DWORD_PTR mask = 0;
+	if (cpus.empty()) {
+		DWORD_PTR system = 0;
+		if (!GetProcessAffinityMask(GetCurrentProcess(), &mask, &system))
+			return false;
+	}
+	// only processor group 0, the first 64 CPUs
+	for (int cpu : cpus) {
+		if (cpu >= 0 && cpu < (int)(sizeof(DWORD_PTR) * 8))
+			mask |= (DWORD_PTR)1 << cpu;
+	}
+	return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+	return cpus.empty();
+#endif
+}
+
+inline std::vector<int> PyABI_numa_cpus(const int node) {
+	std::vector<int> cpus;
+	if (node < 0)
+		return cpus;
+#if defined(__linux__)
+	// "0-15,32-47"
+	const std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+	FILE* file = fopen(path.c_str(), "r");
+	if (!file)
+		return cpus;
+	int first, last;
+	while (fscanf(file, "%d", &first) == 1) {
+		last = first;
+		int separator = fgetc(file);
+		if (separator == '-') {
+			if (fscanf(file, "%d", &last) != 1)
+				break;
+			separator = fgetc(file);
+		}
+		for (int cpu = first; cpu <= last; cpu++)
+			cpus.push_back(cpu);
+		if (separator != ',')
+			break;
+	}
+	fclose(file);
+#elif defined(_WIN32)
+	ULONGLONG mask = 0;
+	if (node <= 0xff && GetNumaNodeProcessorMask((UCHAR)node, &mask)) {
+		for (int cpu = 0; cpu < 64; cpu++) {
+			if (mask & (1ull << cpu))
+				cpus.push_back(cpu);
+		}
+	}
+#endif
+	return cpus;
+}
+
+/***
+
+ThreadPool is a work-stealing scheduler
+
+Submissions from outside the pool (the Python threads) go through one lock-free
+injection queue, submissions from inside a worker go onto that worker's own deque.
+An idle worker drains its own deque, then the injection queue, then steals from
+the others; only when all of that comes up empty does it park on the condition
+variable. m_sleeping tells producers whether anybody is parked at all, so the
+mutex is never touched while the pool is busy.
+
+Every task belongs to one of three priority classes, each with its own injection
+queue, and a worker looks for high work before normal work before low work. The
+worker deques (and so stealing) belong to the normal class. A task with a deadline
+goes into a small EDF heap instead, ahead of the undated tasks of its class. The
+heap has a lock but nobody takes it while it is empty.
+
+queued() counts the calls waiting to start (a task may stand for several, see
+enqueue_many), less those withdraw()n because they will not run after all, and
+max_queued, when set, bounds it: has_room() is the producer's cheap check, and
+once the pool is full the producer either waits for room with wait_for_room(), is
+turned away, or shed()s the oldest queued work. Shed tasks are moved to the high
+queue and run with shedding() set, so the call they wrap can hand back a failure
+straight away instead of doing the work.
+
+The pool is sized for up to capacity() workers but only size() of them run,
+resize() starts or retires workers live. A retired worker's deque stays where it
+is and the running workers steal whatever it left behind. pin() restricts the
+workers to a set of CPUs, each worker applies it to itself between tasks.
+
+The interface is the one from the original pool:
+
+https://codereview.stackexchange.com/questions/229560/implementation-of-a-thread-pool-in-c
+
+***/
+
+/***
+
+how a task is scheduled, the default is a normal task with no deadline
+
+***/
+
+// what a producer does once a pool has max_queued calls waiting
+enum class Overflow : int { Block, Reject, Shed_Oldest };
+
+struct Schedule {
+	// > 0 runs before the normal tasks, < 0 after them
+	int priority = 0;
+	// the PyABI_now() the task should start by, 0 for none; earlier deadlines run first
+	std::uint64_t deadline = 0;
+};
+
+class ThreadPool final
+{
+public:
+
+	explicit ThreadPool(std::size_t nthreads = std::thread::hardware_concurrency(), std::size_t injection_capacity = 1 << 16, std::size_t capacity = 0) :
+		m_enabled(true),
+		m_target(0),
+		m_sleeping(0),
+		m_wakeups(0),
+		m_affinity(0),
+		m_timed_class(-1),
+		m_timed_sequence(0),
+		m_queued(0),
+		m_withdrawn(0),
+		m_max_queued(0),
+		m_overflow((int)Overflow::Block),
+		m_room_waiters(0),
+		m_rejected(0),
+		m_shed(0),
+		m_blocked(0),
+		m_injected{ {
+			BoundedQueue<Task*>(injection_capacity),
+			BoundedQueue<Task*>(injection_capacity),
+			BoundedQueue<Task*>(injection_capacity) } },
+		m_workers(std::max<std::size_t>({ nthreads, capacity, 1 }))
+	{
+		for (std::size_t i = 0; i < m_workers.size(); i++)
+			m_workers[i].seed = 0x9E3779B97F4A7C15ull * (i + 1);
+
+		resize(nthreads);
+	}
+
+	~ThreadPool()
+	{
+		stop();
+	}
+
+	ThreadPool(ThreadPool const&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	template<class TaskT>
+	auto enqueue(TaskT task, const Schedule& schedule = Schedule()) -> std::future<decltype(task())>
+	{
+		using ReturnT = decltype(task());
+		auto promise = std::make_shared<std::promise<ReturnT>>();
+		auto result = promise->get_future();
+
+		push(Task::make([p = std::move(promise), t = std::move(task)]() mutable { execute(*p, t); }, 1), schedule);
+		wake(1);
+
+		return result;
+	}
+
+	/***
+
+	fire and forget, nothing is allocated for the task once the pool is warm as long
+	as it fits_inline, use this whenever the result travels some other way
+
+	***/
+
+	template<class TaskT>
+	void post(TaskT&& task, const Schedule& schedule = Schedule(), const std::size_t weight = 1)
+	{
+		push(Task::make(std::forward<TaskT>(task), weight), schedule);
+		wake(1);
+	}
+
+	/***
+
+	fire and forget, every task is queued before any worker is woken so a batch
+	costs one wakeup round rather than one per task
+
+	weights[i] is how many calls tasks[i] stands for in queued(), 1 when missing
+
+	***/
+
+	template<class TaskT>
+	void enqueue_many(std::vector<TaskT>& tasks, const Schedule& schedule = Schedule(), const std::vector<std::size_t>& weights = {})
+	{
+		for (std::size_t i = 0; i < tasks.size(); i++)
+			push(Task::make(std::move(tasks[i]), i < weights.size() ? weights[i] : 1), schedule);
+
+		wake(tasks.size());
+	}
+
+	/***
+
+	enqueue_many without the vector: make(i) returns the i-th of count tasks and
+	how many calls it stands for, as a pair, and it goes straight into a Task like
+	post() does
+
+	***/
+
+	template<class MakeT>
+	void post_many(const std::size_t count, MakeT&& make, const Schedule& schedule = Schedule())
+	{
+		for (std::size_t i = 0; i < count; i++) {
+			auto made = make(i);
+			push(Task::make(std::move(made.first), made.second), schedule);
+		}
+
+		wake(count);
+	}
+
+	/***
+
+	admission, see the top of the class
+
+	***/
+
+	void limit(const std::size_t max_queued, const Overflow overflow)
+	{
+		m_max_queued.store(max_queued, std::memory_order_relaxed);
+		m_overflow.store((int)overflow, std::memory_order_relaxed);
+		notify_room();
+	}
+
+	std::size_t max_queued() const {
+		return m_max_queued.load(std::memory_order_relaxed);
+	}
+
+	Overflow overflow() const {
+		return (Overflow)m_overflow.load(std::memory_order_relaxed);
+	}
+
+	// less the calls withdrawn while they wait
+	std::size_t queued() const {
+		const std::size_t queued = m_queued.load(std::memory_order_relaxed);
+		const std::int64_t withdrawn = m_withdrawn.load(std::memory_order_relaxed);
+		return withdrawn > 0 ? queued - std::min(queued, (std::size_t)withdrawn) : queued;
+	}
+
+	// an empty pool always has room, even for a batch bigger than max_queued
+	bool has_room(const std::size_t weight) const
+	{
+		const std::size_t max = m_max_queued.load(std::memory_order_relaxed);
+		const std::size_t waiting = queued();
+		return max == 0 || waiting == 0 || waiting + weight <= max;
+	}
+
+	// weight queued calls will not run after all (cancelled), they stop counting in queued() now rather than once a worker reaches them
+	void withdraw(const std::size_t weight)
+	{
+		m_withdrawn.fetch_add((std::int64_t)weight, std::memory_order_relaxed);
+		notify_room();
+	}
+
+	// a worker has reached withdrawn calls, from the worker itself
+	void withdrawn_started(const std::size_t weight)
+	{
+		m_withdrawn.fetch_sub((std::int64_t)weight, std::memory_order_relaxed);
+	}
+
+	// false once deadline passes without room for weight more calls
+	bool wait_for_room(const std::size_t weight, const std::chrono::steady_clock::time_point deadline)
+	{
+		m_blocked.fetch_add(1, std::memory_order_relaxed);
+		m_room_waiters.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		bool room;
+		{
+			std::unique_lock<std::mutex> lock{ m_room_mu };
+			room = m_room_cv.wait_until(lock, deadline, [&]() { return has_room(weight); });
+		}
+
+		m_room_waiters.fetch_sub(1, std::memory_order_relaxed);
+		return room;
+	}
+
+	/***
+
+	moves the oldest queued tasks to the high queue marked as shed, until there is room for weight more calls, false if the undated
+	queues run dry first (the rest is on worker deques or the deadline heap)
+
+	the low class goes first and the normal class only once it is empty, the high
+	class is never shed: it holds the high priority work and what was shed before
+
+	***/
+
+	bool shed(const std::size_t weight)
+	{
+		std::vector<Task*> shed;
+		for (int klass = Low; klass > High && !has_room(weight); klass--) {
+			Task* task;
+			while (!has_room(weight) && m_injected[klass].try_pop(task)) {
+				m_queued.fetch_sub(task->weight, std::memory_order_relaxed);
+				m_shed.fetch_add(task->weight, std::memory_order_relaxed);
+				task->weight = 0;
+				task->shed = true;
+				shed.push_back(task);
+			}
+		}
+
+		Schedule high;
+		high.priority = 1;
+		for (Task* task : shed)
+			push(task, high);
+		wake(shed.size());
+
+		return has_room(weight);
+	}
+
+	void rejected(const std::size_t weight) {
+		m_rejected.fetch_add(weight, std::memory_order_relaxed);
+	}
+
+	// calls turned away, calls shed and how often a producer had to wait for room
+	std::size_t rejected() const {
+		return m_rejected.load(std::memory_order_relaxed);
+	}
+
+	std::size_t shed() const {
+		return m_shed.load(std::memory_order_relaxed);
+	}
+
+	std::size_t blocked() const {
+		return m_blocked.load(std::memory_order_relaxed);
+	}
+
+	// true while a worker runs a task that was shed
+	static bool shedding() {
+		return tls_shedding;
+	}
+
+	// the pool the calling thread is a worker of (nullptr on any other thread)
+	static ThreadPool* current() {
+		return tls_pool;
+	}
+
+	// which of current()'s workers the calling thread is, below its capacity()
+	static std::size_t current_worker() {
+		return tls_index;
+	}
+
+	// the number of running workers
+	std::size_t size() const {
+		return m_target.load(std::memory_order_relaxed);
+	}
+
+	// the most workers resize() can run
+	std::size_t capacity() const {
+		return m_workers.size();
+	}
+
+	/***
+
+	starts or retires workers until nthreads (at least 1, at most capacity()) run,
+	returns once the retired ones have finished their current task and exited
+
+	***/
+
+	void resize(std::size_t nthreads)
+	{
+		std::lock_guard<std::mutex> resizing(m_resize_mu);
+		nthreads = std::min(std::max<std::size_t>(nthreads, 1), m_workers.size());
+
+		const std::size_t running = m_target.load(std::memory_order_relaxed);
+		if (nthreads > running) {
+			m_target.store(nthreads, std::memory_order_relaxed);
+			for (std::size_t i = running; i < nthreads; i++)
+				m_workers[i].thread = std::thread(&ThreadPool::work, this, i);
+		}
+		else if (nthreads < running) {
+			{
+				std::lock_guard<std::mutex> lock(m_mu);
+				m_target.store(nthreads, std::memory_order_relaxed);
+			}
+			m_cv.notify_all();
+			for (std::size_t i = nthreads; i < running; i++)
+				m_workers[i].thread.join();
+
+			// whatever the retired workers left on their deques is up for stealing
+			wake(nthreads);
+		}
+	}
+
+	/***
+
+	joins every worker for good and drops whatever is still queued, as the destructor
+	does, for when the workers have to be gone before the pool is (interpreter exit)
+
+	***/
+
+	void shutdown()
+	{
+		stop();
+	}
+
+	/***
+
+	restricts every worker to cpus, an empty set lets them run anywhere again
+
+	***/
+
+	void pin(std::vector<int> cpus)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_affinity_mu);
+			m_cpus = std::move(cpus);
+		}
+		m_affinity.fetch_add(1, std::memory_order_release);
+
+		// the parked workers pick it up as soon as they have something to do
+		wake(size());
+	}
+
+	std::vector<int> cpus()
+	{
+		std::lock_guard<std::mutex> lock(m_affinity_mu);
+		return m_cpus;
+	}
+
+	// tasks queued but not started, approximate while the pool is busy
+	std::size_t pending() const {
+		std::size_t count = 0;
+		for (auto& injected : m_injected)
+			count += injected.size_approx();
+		for (auto& worker : m_workers)
+			count += worker.tasks.size();
+		{
+			std::lock_guard<std::mutex> lock(m_timed_mu);
+			count += m_timed.size();
+		}
+		return count;
+	}
+
+private:
+
+	/***
+
+	Task is a fixed size, move-only, type-erased callable: anything up to INLINE
+	bytes lives inside it, anything bigger is boxed on the heap. Tasks come from
+	Recycled<Task> through make() and go back through release(), so a task costs
+	no allocation at all once the free list is warm.
+
+	***/
+
+	class Task final {
+
+	public:
+
+		static constexpr std::size_t INLINE = 128;
+
+		template<class F>
+		static Task* make(F&& f, const std::size_t weight) {
+			return new (Recycled<Task>::allocate()) Task(std::forward<F>(f), weight);
+		}
+
+		static void release(Task* task) {
+			task->~Task();
+			Recycled<Task>::deallocate(task);
+		}
+
+		template<class F>
+		Task(F&& f, const std::size_t weight)
+			: weight(weight), shed(false) {
+			using Stored = typename Stored_For<std::decay_t<F>>::type;
+			new (m_storage) Stored(std::forward<F>(f));
+			m_ops = &Ops_For<Stored>::ops;
+		}
+
+		Task(Task&& other) noexcept
+			: weight(other.weight), shed(other.shed), m_ops(other.m_ops) {
+			if (m_ops)
+				m_ops->relocate(other.m_storage, m_storage);
+			other.m_ops = nullptr;
+		}
+
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+		Task& operator=(Task&&) = delete;
+
+		~Task() {
+			if (m_ops)
+				m_ops->destroy(m_storage);
+		}
+
+		void run() {
+			m_ops->invoke(m_storage);
+		}
+
+		// the calls it stands for in m_queued
+		std::size_t weight;
+		bool shed;
+
+	private:
+
+		struct Ops {
+			void (*invoke)(void*);
+			void (*relocate)(void*, void*);
+			void (*destroy)(void*);
+		};
+
+		template<class S>
+		struct Ops_For {
+			static void invoke(void* stored) {
+				(*static_cast<S*>(stored))();
+			}
+			static void relocate(void* from, void* to) {
+				S* source = static_cast<S*>(from);
+				new (to) S(std::move(*source));
+				source->~S();
+			}
+			static void destroy(void* stored) {
+				static_cast<S*>(stored)->~S();
+			}
+			static constexpr Ops ops = { &invoke, &relocate, &destroy };
+		};
+
+	public:
+
+		template<class F>
+		struct Boxed {
+			std::unique_ptr<F> f;
+			explicit Boxed(F&& value) : f(new F(std::move(value))) {}
+			explicit Boxed(const F& value) : f(new F(value)) {}
+			void operator()() { (*f)(); }
+		};
+
+		template<class F>
+		struct Stored_For {
+			static constexpr bool fits = sizeof(F) <= INLINE
+				&& alignof(F) <= alignof(std::max_align_t)
+				&& std::is_nothrow_move_constructible<F>::value;
+			using type = typename std::conditional<fits, F, Boxed<F>>::type;
+		};
+
+	private:
+
+		const Ops* m_ops;
+
+		alignas(std::max_align_t) unsigned char m_storage[INLINE];
+
+	};
+
+public:
+
+	// whether post() can carry an F without boxing it on the heap
+	template<class F>
+	static constexpr bool fits_inline = Task::Stored_For<F>::fits;
+
+private:
+
+	enum Class : int { High, Normal, Low, CLASSES };
+
+	static Class classify(const int priority) {
+		return priority > 0 ? High : priority < 0 ? Low : Normal;
+	}
+
+	struct Timed {
+		std::uint64_t deadline;
+		std::uint64_t sequence;
+		int klass;
+		Task* task;
+
+		// std::push_heap keeps the largest on top, so "larger" is "runs later"
+		bool operator<(const Timed& other) const {
+			if (klass != other.klass)
+				return klass > other.klass;
+			if (deadline != other.deadline)
+				return deadline > other.deadline;
+			return sequence > other.sequence;
+		}
+	};
+
+	struct alignas(PyABI_cache_line) Worker {
+		WorkStealingDeque<Task*> tasks;
+		std::thread thread;
+		std::uint64_t seed = 0;
+	};
+
+	std::atomic<bool> m_enabled;
+	std::atomic<std::size_t> m_target;
+	alignas(PyABI_cache_line) std::atomic<std::size_t> m_sleeping;
+
+	std::mutex m_mu;
+	std::condition_variable m_cv;
+	std::size_t m_wakeups;
+
+	std::mutex m_resize_mu;
+
+	std::mutex m_affinity_mu;
+	std::vector<int> m_cpus;
+	std::atomic<std::uint64_t> m_affinity;
+
+	// the class of the most urgent timed task, -1 while there is none
+	mutable std::mutex m_timed_mu;
+	std::vector<Timed> m_timed;
+	std::atomic<int> m_timed_class;
+	std::uint64_t m_timed_sequence;
+
+	alignas(PyABI_cache_line) std::atomic<std::size_t> m_queued;
+	// may dip below 0 for a moment, a worker can reach a call before withdraw() has counted it
+	std::atomic<std::int64_t> m_withdrawn;
+	std::atomic<std::size_t> m_max_queued;
+	std::atomic<int> m_overflow;
+
+	std::mutex m_room_mu;
+	std::condition_variable m_room_cv;
+	std::atomic<std::size_t> m_room_waiters;
+
+	std::atomic<std::size_t> m_rejected;
+	std::atomic<std::size_t> m_shed;
+	std::atomic<std::size_t> m_blocked;
+
+	std::array<BoundedQueue<Task*>, CLASSES> m_injected;
+	std::vector<Worker> m_workers;
+
+	// which pool (if any) the current thread is a worker of, and which one
+	static inline thread_local ThreadPool* tls_pool = nullptr;
+	static inline thread_local std::size_t tls_index = 0;
+	static inline thread_local bool tls_shedding = false;
+
+	template<class ResultT, class TaskT>
+	static void execute(std::promise<ResultT>& p, TaskT& task)
+	{
+		try {
+			p.set_value(task());
+		}
+		catch (...) {
+			p.set_exception(std::current_exception());
+		}
+	}
+
+	template<class TaskT>
+	static void execute(std::promise<void>& p, TaskT& task)
+	{
+		try {
+			task();
+			p.set_value();
+		}
+		catch (...) {
+			p.set_exception(std::current_exception());
+		}
+	}
+
+	void push(Task* task, const Schedule& schedule)
+	{
+		m_queued.fetch_add(task->weight, std::memory_order_relaxed);
+
+		const Class klass = classify(schedule.priority);
+
+		if (schedule.deadline) {
+			std::lock_guard<std::mutex> lock(m_timed_mu);
+			m_timed.push_back(Timed{ schedule.deadline, m_timed_sequence++, klass, task });
+			std::push_heap(m_timed.begin(), m_timed.end());
+			m_timed_class.store(m_timed.front().klass, std::memory_order_release);
+		}
+		else if (klass == Normal && tls_pool == this) {
+			m_workers[tls_index].tasks.push(task);
+		}
+		else {
+			while (!m_injected[klass].try_push(std::move(task))) {
+				// the ring is full, let the workers catch up
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	// the most urgent timed task, if it belongs to klass
+	Task* pop_timed(const int klass)
+	{
+		std::lock_guard<std::mutex> lock(m_timed_mu);
+		if (m_timed.empty() || m_timed.front().klass != klass)
+			return nullptr;
+
+		std::pop_heap(m_timed.begin(), m_timed.end());
+		Task* task = m_timed.back().task;
+		m_timed.pop_back();
+		m_timed_class.store(m_timed.empty() ? -1 : m_timed.front().klass, std::memory_order_release);
+		return task;
+	}
+
+	// wakes up to count sleeping workers
+	void wake(std::size_t count)
+	{
+		// pairs with the fence in park(), one of the two sides sees the other
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		const std::size_t sleeping = m_sleeping.load(std::memory_order_relaxed);
+		if (sleeping == 0 || count == 0)
+			return;
+
+		count = std::min(count, sleeping);
+		{
+			std::lock_guard<std::mutex> lock(m_mu);
+			m_wakeups += count;
+		}
+		if (count == 1)
+			m_cv.notify_one();
+		else
+			m_cv.notify_all();
+	}
+
+	Task* find_task(std::size_t index)
+	{
+		Task* task;
+		for (int klass = High; klass < CLASSES; klass++) {
+			if (m_timed_class.load(std::memory_order_acquire) == klass && (task = pop_timed(klass)) != nullptr)
+				return task;
+
+			if (klass == Normal && (task = m_workers[index].tasks.pop()) != nullptr)
+				return task;
+
+			if (m_injected[klass].try_pop(task))
+				return task;
+
+			if (klass == Normal && (task = steal(index)) != nullptr)
+				return task;
+		}
+		return nullptr;
+	}
+
+	Task* steal(std::size_t index)
+	{
+		Worker& self = m_workers[index];
+		Task* task;
+
+		const std::size_t count = m_workers.size();
+		if (count > 1) {
+			// xorshift64, only used to spread the thieves out
+			self.seed ^= self.seed << 13;
+			self.seed ^= self.seed >> 7;
+			self.seed ^= self.seed << 17;
+			const std::size_t start = (std::size_t)(self.seed % count);
+			for (std::size_t i = 0; i < count; i++) {
+				const std::size_t victim = (start + i) % count;
+				if (victim == index)
+					continue;
+				task = m_workers[victim].tasks.steal();
+				if (task)
+					return task;
+			}
+		}
+
+		return nullptr;
+	}
+
+	bool has_work() const
+	{
+		if (m_timed_class.load(std::memory_order_relaxed) >= 0)
+			return true;
+		for (auto& injected : m_injected) {
+			if (injected.size_approx() > 0)
+				return true;
+		}
+		for (auto& worker : m_workers) {
+			if (!worker.tasks.empty())
+				return true;
+		}
+		return false;
+	}
+
+	// pairs with the fence in wait_for_room()
+	void notify_room()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_room_waiters.load(std::memory_order_relaxed) > 0) {
+			{
+				std::lock_guard<std::mutex> lock(m_room_mu);
+			}
+			m_room_cv.notify_all();
+		}
+	}
+
+	bool retired(std::size_t index) const
+	{
+		return !m_enabled.load(std::memory_order_relaxed) || index >= m_target.load(std::memory_order_relaxed);
+	}
+
+	void park(std::size_t index)
+	{
+		m_sleeping.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		{
+			std::unique_lock<std::mutex> lock{ m_mu };
+			m_cv.wait(lock, [&]() { return retired(index) || m_wakeups > 0 || has_work(); });
+			if (m_wakeups > 0)
+				m_wakeups--;
+		}
+
+		m_sleeping.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mu);
+			m_enabled = false;
+		}
+
+		m_cv.notify_all();
+
+		std::lock_guard<std::mutex> resizing(m_resize_mu);
+		for (std::size_t i = 0; i < m_target.load(std::memory_order_relaxed); i++) {
+			if (m_workers[i].thread.joinable())
+				m_workers[i].thread.join();
+		}
+
+		// anything still queued is dropped, exactly like the original pool did
+		Task* task;
+		for (auto& injected : m_injected) {
+			while (injected.try_pop(task))
+				Task::release(task);
+		}
+		for (auto& timed : m_timed)
+			Task::release(timed.task);
+		m_timed.clear();
+		for (auto& worker : m_workers) {
+			while ((task = worker.tasks.pop()) != nullptr)
+				Task::release(task);
+		}
+	}
+
+	void work(std::size_t index)
+	{
+		tls_pool = this;
+		tls_index = index;
+
+		std::uint64_t affinity = 0;
+		std::size_t idle = 0;
+		while (!retired(index))
+		{
+			const std::uint64_t wanted = m_affinity.load(std::memory_order_acquire);
+			if (affinity != wanted) {
+				affinity = wanted;
+				PyABI_pin_thread(cpus());
+			}
+
+			Task* task = find_task(index);
+			if (task) {
+				idle = 0;
+				if (task->weight) {
+					m_queued.fetch_sub(task->weight, std::memory_order_relaxed);
+					notify_room();
+				}
+				tls_shedding = task->shed;
+				task->run();
+				tls_shedding = false;
+				Task::release(task);
+				continue;
+			}
+
+			// spin a little before paying for a sleep and a wakeup
+			if (++idle < 64) {
+				std::this_thread::yield();
+				continue;
+			}
+
+			idle = 0;
+			park(index);
+		}
+
+		tls_pool = nullptr;
+	}
+};
+
+/***
+
+Completion tells consumers that new Results are waiting in the result ring
+
+There are two kinds of consumer:
+
+fd() is an eventfd (a non-blocking pipe on other POSIX systems) that becomes readable
+once something has been returned, so asyncio can add_reader() on it. The producers
+only write to it when it is not already signalled, the consumer clear()s it before
+draining, so a burst of results costs one syscall rather than one per result.
+Windows has no such descriptor and fd() returns -1.
+
+Waiter blocks a thread until the next signal or a deadline. The producers only
+touch the mutex when somebody is actually waiting.
+
+***/
+
+class Completion final {
+
+public:
+
+	Completion()
+		: m_fd(-1), m_write_fd(-1), m_signalled(false), m_waiters(0), m_generation(0) {
+
+#if defined(__linux__)
+		m_fd = m_write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#elif !defined(_WIN32)
+		int fds[2];
+		if (pipe(fds) == 0) {
+			for (int fd : fds) {
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+			}
+			m_fd = fds[0];
+			m_write_fd = fds[1];
+		}
+#endif
+	}
+
+	~Completion() {
+#if !defined(_WIN32)
+		if (m_write_fd >= 0 && m_write_fd != m_fd)
+			close(m_write_fd);
+		if (m_fd >= 0)
+			close(m_fd);
+#endif
+	}
+
+	Completion(Completion const&) = delete;
+	Completion& operator=(const Completion&) = delete;
+
+	int fd() const {
+		return m_fd;
+	}
+
+	// producers, after the Results are in the ring
+	void signal() {
+		if (!m_signalled.exchange(true, std::memory_order_acq_rel)) {
+			write_fd();
+		}
+
+		// pairs with the fence in Waiter, one of the two sides sees the other
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_waiters.load(std::memory_order_relaxed) > 0) {
+			{
+				std::lock_guard<std::mutex> lock(m_mu);
+				m_generation.fetch_add(1, std::memory_order_release);
+			}
+			m_cv.notify_all();
+		}
+	}
+
+	// the consumer, before it drains the ring
+	void clear() {
+		if (m_signalled.exchange(false, std::memory_order_acq_rel)) {
+			read_fd();
+		}
+	}
+
+	class Waiter final {
+
+	public:
+
+		explicit Waiter(Completion& completion)
+			: m_completion(completion) {
+			m_completion.m_waiters.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+		}
+
+		~Waiter() {
+			m_completion.m_waiters.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		Waiter(Waiter const&) = delete;
+		Waiter& operator=(const Waiter&) = delete;
+
+		// read before looking in the ring, then handed to wait()
+		std::uint64_t generation() const {
+			return m_completion.m_generation.load(std::memory_order_acquire);
+		}
+
+		// false once the deadline has passed without a signal
+		bool wait(std::uint64_t seen, std::chrono::steady_clock::time_point deadline) {
+			std::unique_lock<std::mutex> lock{ m_completion.m_mu };
+			return m_completion.m_cv.wait_until(lock, deadline, [&]() {
+				return m_completion.m_generation.load(std::memory_order_acquire) != seen;
+			});
+		}
+
+	private:
+
+		Completion& m_completion;
 
+	};
 
+private:
 
+	void write_fd() {
+#if defined(__linux__)
+		if (m_write_fd >= 0) {
+			const std::uint64_t one = 1;
+			ssize_t ignored = write(m_write_fd, &one, sizeof(one));
+			(void)ignored;
+		}
+#elif !defined(_WIN32)
+		if (m_write_fd >= 0) {
+			const char one = 1;
+			ssize_t ignored = write(m_write_fd, &one, sizeof(one));
+			(void)ignored;
+		}
+#endif
+	}
 
+	void read_fd() {
+#if !defined(_WIN32)
+		if (m_fd >= 0) {
+			char buffer[64];
+			while (read(m_fd, buffer, sizeof(buffer)) > 0) {
+			}
+		}
+#endif
+	}
 
+	int m_fd;
+	int m_write_fd;
 
+	alignas(PyABI_cache_line) std::atomic<bool> m_signalled;
+	alignas(PyABI_cache_line) std::atomic<std::size_t> m_waiters;
 
+	std::mutex m_mu;
+	std::condition_variable m_cv;
+	std::atomic<std::uint64_t> m_generation;
 
+};
 
 
+/***
 
+PyABI_now is the clock every pipeline timestamp is taken with, in nanoseconds
 
+steady_clock is a vDSO read on Linux and QueryPerformanceCounter on Windows, both
+in the 20ns range, which is cheap enough for four reads per call and unlike a
+raw rdtsc needs no calibration
 
+***/
 
-/*
+inline std::uint64_t PyABI_now() {
+	return (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-https://codereview.stackexchange.com/questions/229560/implementation-of-a-thread-pool-in-c
+/***
 
-*/
+Histogram is a log-linear (HDR style) histogram of 64 bit values, 16 linear
+buckets per power of two so a bucket is never wider than 6.25% of its values
+
+It has exactly one writer, record() is three relaxed load/store pairs that never
+wait, and any thread may read it at the same time through merge_into()
+
+***/
+
+class Histogram final {
 
-class ThreadPool final
-{
 public:
 
-	explicit ThreadPool(std::size_t nthreads = std::thread::hardware_concurrency()) :
-		m_enabled(true),
-		m_pool(nthreads)
-	{
-		run();
+	static constexpr unsigned SUB_BITS = 4;
+	static constexpr std::uint64_t SUB = 1ull << SUB_BITS;
+	static constexpr std::size_t BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+	Histogram() : m_count(0), m_sum(0) {
+		for (auto& count : m_counts)
+			count.store(0, std::memory_order_relaxed);
 	}
 
-	~ThreadPool()
-	{
-		stop();
+	Histogram(Histogram const&) = delete;
+	Histogram& operator=(const Histogram&) = delete;
+
+	// writer only
+	void record(const std::uint64_t value) {
+		bump(m_counts[bucket(value)], 1);
+		bump(m_count, 1);
+		bump(m_sum, value);
 	}
 
-	ThreadPool(ThreadPool const&) = delete;
-	ThreadPool& operator=(const ThreadPool&) = delete;
+	/***
 
-	template<class TaskT>
-	auto enqueue(TaskT task) -> std::future<decltype(task())>
-	{
-		using ReturnT = decltype(task());
-		auto promise = std::make_shared<std::promise<ReturnT>>();
-		auto result = promise->get_future();
+	the merged (and resettable) view of one or more histograms
 
-		auto t = [p = std::move(promise), t = std::move(task)]() mutable { execute(*p, t); };
+	***/
 
-		{
-			std::lock_guard<std::mutex> lock(m_mu);
-			m_tasks.push(std::move(t));
+	struct Summary {
+		std::array<std::uint64_t, BUCKETS> counts{};
+		std::uint64_t count = 0;
+		std::uint64_t sum = 0;
+
+		void subtract(const Summary& baseline) {
+			for (std::size_t i = 0; i < BUCKETS; i++)
+				counts[i] -= baseline.counts[i];
+			count -= baseline.count;
+			sum -= baseline.sum;
 		}
 
-		m_cv.notify_one();
+		double mean() const {
+			return count ? (double)sum / count : 0.0;
+		}
 
-		return result;
+		// the middle of the bucket holding the q-th value, 0 when empty
+		std::uint64_t percentile(const double q) const {
+			if (count == 0)
+				return 0;
+			const std::uint64_t rank = std::max<std::uint64_t>(1, (std::uint64_t)std::ceil(q * count));
+			std::uint64_t seen = 0;
+			for (std::size_t i = 0; i < BUCKETS; i++) {
+				seen += counts[i];
+				if (seen >= rank)
+					return middle(i);
+			}
+			return middle(BUCKETS - 1);
+		}
+
+		std::uint64_t min() const {
+			for (std::size_t i = 0; i < BUCKETS; i++) {
+				if (counts[i])
+					return lowest(i);
+			}
+			return 0;
+		}
+
+		std::uint64_t max() const {
+			for (std::size_t i = BUCKETS; i-- > 0;) {
+				if (counts[i])
+					return lowest(i) + (width(i) - 1);
+			}
+			return 0;
+		}
+	};
+
+	// any thread
+	void merge_into(Summary& summary) const {
+		for (std::size_t i = 0; i < BUCKETS; i++)
+			summary.counts[i] += m_counts[i].load(std::memory_order_relaxed);
+		summary.count += m_count.load(std::memory_order_relaxed);
+		summary.sum += m_sum.load(std::memory_order_relaxed);
 	}
 
-private:
+	static std::size_t bucket(const std::uint64_t value) {
+		if (value < SUB)
+			return (std::size_t)value;
+		const unsigned exponent = highest_bit(value);
+		return (exponent - SUB_BITS + 1) * SUB + ((value >> (exponent - SUB_BITS)) & (SUB - 1));
+	}
 
-	std::mutex m_mu;
-	std::condition_variable m_cv;
+	static std::uint64_t lowest(const std::size_t bucket) {
+		if (bucket < SUB)
+			return bucket;
+		const unsigned shift = (unsigned)(bucket / SUB) - 1;
+		return (SUB + bucket % SUB) << shift;
+	}
 
-	bool m_enabled;
-	std::vector<std::thread> m_pool;
-	std::queue<std::function<void()>> m_tasks;
+	static std::uint64_t width(const std::size_t bucket) {
+		return bucket < SUB ? 1 : 1ull << ((bucket / SUB) - 1);
+	}
 
-	template<class ResultT, class TaskT>
-	static void execute(std::promise<ResultT>& p, TaskT& task)
-	{
-		p.set_value(task()); // syntax doesn't work with void ResultT :(
+	static std::uint64_t middle(const std::size_t bucket) {
+		return lowest(bucket) + width(bucket) / 2;
 	}
 
-	template<class TaskT>
-	static void execute(std::promise<void>& p, TaskT& task)
-	{
-		task();
-		p.set_value();
+private:
+
+	static unsigned highest_bit(const std::uint64_t value) {
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanReverse64(&index, value);
+		return (unsigned)index;
+#else
+		return 63 - (unsigned)__builtin_clzll(value);
+#endif
 	}
 
-	void stop()
-	{
-		{
-			std::lock_guard<std::mutex> lock(m_mu);
-			m_enabled = false;
-		}
+	// the single writer needs no read-modify-write, only a tear free store
+	static void bump(std::atomic<std::uint64_t>& counter, const std::uint64_t by) {
+		counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+	}
 
-		m_cv.notify_all();
+	std::array<std::atomic<std::uint64_t>, BUCKETS> m_counts;
+	std::atomic<std::uint64_t> m_count;
+	std::atomic<std::uint64_t> m_sum;
+
+};
+
+/***
+
+Call_Stats is where the dispatch pipeline reports how long each call spends in
+each stage, plus how many calls were outstanding whenever one was submitted
+
+queue    submitted -> a worker starts it
+execute  started -> finished
+return   finished -> Python collects the Results
+total    submitted -> Python collects the Results
+depth    calls submitted but not yet collected, sampled at every submit
+
+Every thread records into its own block of histograms, so recording never shares
+a cache line with another thread. summary() merges all of them and reset() only
+moves the baseline, the writers are never stopped or touched.
+
+A thread that exits hands its block back and the next thread to record takes it
+over counts and all, so there are only ever as many blocks as threads recording
+at once and nothing a finished thread counted goes missing.
+
+***/
+
+class Call_Stats final {
 
-		for (auto& t : m_pool)
-			t.join();
+public:
+
+	enum Stage : std::size_t { Queue, Execute, Return, Total, Depth, STAGES };
+
+	static const char* name(const Stage stage) {
+		static const char* names[STAGES] = { "queue", "execute", "return", "total", "depth" };
+		return names[stage];
 	}
 
-	void run()
-	{
-		auto f = [this]()
-		{
-			while (true)
-			{
-				std::unique_lock<std::mutex> lock{ m_mu };
-				m_cv.wait(lock, [&]() { return !m_enabled || !m_tasks.empty(); });
+	Call_Stats() = default;
 
-				if (!m_enabled)
-					break;
+	Call_Stats(Call_Stats const&) = delete;
+	Call_Stats& operator=(const Call_Stats&) = delete;
+
+	void record(const Stage stage, const std::uint64_t value) {
+		local().stages[stage].record(value);
+	}
+
+	// everything recorded for stage since the last reset()
+	Histogram::Summary summary(const Stage stage) {
+		std::lock_guard<std::mutex> lock(m_state->mu);
+		Histogram::Summary summary;
+		for (auto& block : m_state->blocks)
+			block->stages[stage].merge_into(summary);
+		summary.subtract(m_state->baseline[stage]);
+		return summary;
+	}
+
+	void reset() {
+		std::lock_guard<std::mutex> lock(m_state->mu);
+		for (std::size_t stage = 0; stage < STAGES; stage++) {
+			Histogram::Summary now;
+			for (auto& block : m_state->blocks)
+				block->stages[stage].merge_into(now);
+			m_state->baseline[stage] = now;
+		}
+	}
+
+private:
 
-				assert(!m_tasks.empty());
+	struct alignas(PyABI_cache_line) Block {
+		Histogram stages[STAGES];
+	};
+
+	// shared with the threads holding one of its blocks, which may exit after the Call_Stats is gone
+	struct State {
+		std::mutex mu;
+		std::vector<std::unique_ptr<Block>> blocks;
+		// blocks whose thread has exited, waiting for the next one
+		std::vector<Block*> spare;
+		Histogram::Summary baseline[STAGES];
+	};
 
-				auto task = std::move(m_tasks.front());
-				m_tasks.pop();
+	// the calling thread's block of every Call_Stats it records into, handed back when it exits
+	struct Thread_Blocks {
+		std::vector<std::pair<std::shared_ptr<State>, Block*>> held;
 
-				lock.unlock();
-				task();
+		~Thread_Blocks() {
+			for (auto& entry : held) {
+				std::lock_guard<std::mutex> lock(entry.first->mu);
+				entry.first->spare.push_back(entry.second);
 			}
-		};
+		}
+	};
+
+	Block& local() {
+		static thread_local Thread_Blocks tls_blocks;
+		for (auto& entry : tls_blocks.held) {
+			if (entry.first == m_state)
+				return *entry.second;
+		}
 
-		for (auto& t : m_pool)
-			t = std::thread(f);
+		Block* block;
+		{
+			std::lock_guard<std::mutex> lock(m_state->mu);
+			if (!m_state->spare.empty()) {
+				block = m_state->spare.back();
+				m_state->spare.pop_back();
+			}
+			else {
+				m_state->blocks.emplace_back(new Block());
+				block = m_state->blocks.back().get();
+			}
+		}
+		tls_blocks.held.emplace_back(m_state, block);
+		return *block;
 	}
+
+	const std::shared_ptr<State> m_state = std::make_shared<State>();
+
 };
 
 
+
 #define PY_DEFAULT_ARGUMENT_INIT(name, value, ret) \
     PyObject *name = NULL; \
     static PyObject *default_##name = NULL; \
@@ -764,6 +3708,423 @@ private:
     Py_INCREF(name)
 
 
+/***
+
+Argument<T> turns one Python argument into a parameter of type T of an exported
+function, on the calling thread with the GIL held. bool, std::int64_t, double and
+std::string_view are converted directly (the string is copied into the Arena of the
+call), Object, List, Tuple and Dict are marshaled like any other value.
+
+A value of the wrong type raises TypeError naming the function and the parameter
+and throws PyABI_Exception. bool takes any object by its truth value.
+
+***/
+
+[[noreturn]] inline void PyABI_argument_error(const char* function, const char* keyword, const char* expected, PyObject* object) {
+	PyErr_Format(PyExc_TypeError, "%s() argument '%s' must be %s, not %.200s", function, keyword, expected, Py_TYPE(object)->tp_name);
+	throw new PyABI_Exception;
+}
+
+// anything with an (Arena&, PyObject*) constructor: Object, List, Tuple, Dict
+template<class T>
+struct Argument {
+	static T from(Arena& arena, PyObject* object, const char*, const char*) {
+		return T(arena, object);
+	}
+};
+
+// any object, by its truth value like PyArg_Parse's "p"
+template<>
+struct Argument<bool> {
+	static bool from(Arena&, PyObject* object, const char*, const char*) {
+		const int truth = PyObject_IsTrue(object);
+		if (truth < 0)
+			throw new PyABI_Exception;
+		return truth != 0;
+	}
+};
+
+template<>
+struct Argument<std::int64_t> {
+	static std::int64_t from(Arena&, PyObject* object, const char* function, const char* keyword) {
+		if (!PyLong_Check(object))
+			PyABI_argument_error(function, keyword, "int", object);
+		int overflow = 0;
+		const long long value = PyLong_AsLongLongAndOverflow(object, &overflow);
+		if (overflow) {
+			PyErr_Format(PyExc_OverflowError, "%s() argument '%s' does not fit in 64 bits", function, keyword);
+			throw new PyABI_Exception;
+		}
+		if (value == -1 && PyErr_Occurred())
+			throw new PyABI_Exception;
+		return value;
+	}
+};
+
+template<>
+struct Argument<double> {
+	static double from(Arena&, PyObject* object, const char* function, const char* keyword) {
+		if (!PyFloat_Check(object) && !PyLong_Check(object))
+			PyABI_argument_error(function, keyword, "float", object);
+		const double value = PyFloat_AsDouble(object);
+		if (value == -1.0 && PyErr_Occurred())
+			throw new PyABI_Exception;
+		return value;
+	}
+};
+
+template<>
+struct Argument<std::string_view> {
+	static std::string_view from(Arena& arena, PyObject* object, const char* function, const char* keyword) {
+		if (!PyUnicode_Check(object))
+			PyABI_argument_error(function, keyword, "str", object);
+		Py_ssize_t size = 0;
+		const char* data = PyUnicode_AsUTF8AndSize(object, &size);
+		if (!data)
+			throw new PyABI_Exception;
+		return std::string_view(arena.copy(data, (size_t)size), (size_t)size);
+	}
+};
+
+/***
+
+Fastcall_Keywords binds the arguments of a METH_FASTCALL | METH_KEYWORDS call to N
+named parameters, the first `positional` of which may also be passed by position.
+It never builds an args tuple or a kwargs dict. The names are interned once, so a
+keyword from Python source code is matched by pointer.
+
+bind() fills slots with borrowed references, nullptr for a parameter that was not
+given, and returns false with TypeError set for a call that does not fit.
+
+***/
+
+template<std::size_t N>
+class Fastcall_Keywords final {
+
+public:
+
+	Fastcall_Keywords(const char* function, const std::array<const char*, N>& names, const std::size_t positional)
+		: m_function(function), m_names(names), m_positional(positional) {
+		for (std::size_t i = 0; i < N; i++)
+			m_interned[i] = PyUnicode_InternFromString(names[i]);
+	}
+
+	bool bind(PyObject* const* args, const Py_ssize_t nargs, PyObject* kwnames, PyObject* (&slots)[N]) const {
+		if ((std::size_t)nargs > m_positional) {
+			PyErr_Format(PyExc_TypeError, "%s() takes at most %zu positional arguments (%zd given)", m_function, m_positional, nargs);
+			return false;
+		}
+		for (std::size_t i = 0; i < N; i++)
+			slots[i] = i < (std::size_t)nargs ? args[i] : nullptr;
+
+		const Py_ssize_t nkwargs = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+		for (Py_ssize_t k = 0; k < nkwargs; k++) {
+			PyObject* keyword = PyTuple_GET_ITEM(kwnames, k);
+			const std::size_t i = find(keyword);
+			if (i == N) {
+				PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword argument '%U'", m_function, keyword);
+				return false;
+			}
+			if (slots[i]) {
+				PyErr_Format(PyExc_TypeError, "%s() got multiple values for argument '%s'", m_function, m_names[i]);
+				return false;
+			}
+			slots[i] = args[nargs + k];
+		}
+		return true;
+	}
+
+private:
+
+	std::size_t find(PyObject* keyword) const {
+		for (std::size_t i = 0; i < N; i++) {
+			if (keyword == m_interned[i])
+				return i;
+		}
+		for (std::size_t i = 0; i < N; i++) {
+			if (PyUnicode_CompareWithASCIIString(keyword, m_names[i]) == 0)
+				return i;
+		}
+		return N;
+	}
+
+	const char* m_function;
+	std::array<const char*, N> m_names;
+	std::array<PyObject*, N> m_interned;
+	std::size_t m_positional;
+
+};
+
+
+/***
+
+Worker_Interpreter is the Python a pool worker runs Python callables in, made the
+first time the worker needs one and torn down when the worker exits:
+
+Subinterpreter  (3.12 and later) every worker owns a sub-interpreter with its own
+                GIL (PEP 684), so Python code runs on every core at once
+Free_Threaded   (a Py_GIL_DISABLED build) workers attach to the main interpreter;
+                the module does not declare itself free-thread safe, so CPython
+                turns the GIL back on for as long as it is loaded
+Shared_GIL      anywhere else, workers take turns with the main GIL, same API but
+                no parallelism
+
+A target is "module:qualname" and is imported by each interpreter on its first
+call, so in a sub-interpreter it has to be importable (not __main__). Arguments
+come in as Objects and the result goes back as one, nothing is shared between the
+interpreters but plain memory. An exception fails the call with its message.
+
+Every worker has to be gone before Python finalizes, see Singleton::shutdown.
+
+***/
+
+#if !defined(Py_GIL_DISABLED) && PY_VERSION_HEX >= 0x030C0000
+#define PyABI_SUBINTERPRETERS 1
+#endif
+
+class Worker_Interpreter final {
+
+public:
+
+	enum class Mode { Shared_GIL, Subinterpreter, Free_Threaded };
+
+	static constexpr Mode mode() {
+#if defined(Py_GIL_DISABLED)
+		return Mode::Free_Threaded;
+#elif defined(PyABI_SUBINTERPRETERS)
+		return Mode::Subinterpreter;
+#else
+		return Mode::Shared_GIL;
+#endif
+	}
+
+	static const char* mode_name() {
+		static const char* names[] = { "shared-gil", "subinterpreter", "free-threaded" };
+		return names[(int)mode()];
+	}
+
+	// on a worker, without any thread state
+	static void call(Results& Result, std::string_view target, const List& args, const Dict& kwargs) {
+		Worker_Interpreter& worker = local();
+		if (!worker.m_thread) {
+			Result.Fail(worker.m_error);
+			return;
+		}
+
+		PyEval_RestoreThread(worker.m_thread);
+		worker.invoke(Result, target, args, kwargs);
+		PyEval_SaveThread();
+	}
+
+	Worker_Interpreter(Worker_Interpreter const&) = delete;
+	Worker_Interpreter& operator=(const Worker_Interpreter&) = delete;
+
+	~Worker_Interpreter() {
+		// Python has gone already, leak rather than touch it
+		if (!m_main || !Py_IsInitialized())
+			return;
+
+		if (m_thread && m_thread != m_main) {
+#if defined(PyABI_SUBINTERPRETERS)
+			PyEval_RestoreThread(m_thread);
+			forget();
+			Py_EndInterpreter(m_thread);
+#endif
+			PyEval_RestoreThread(m_main);
+		}
+		else {
+			PyEval_RestoreThread(m_main);
+			forget();
+		}
+		PyThreadState_Clear(m_main);
+		PyThreadState_DeleteCurrent();
+	}
+
+private:
+
+	Worker_Interpreter() {
+		if (!Py_IsInitialized()) {
+			m_error = "Python is not running";
+			return;
+		}
+
+		m_main = PyThreadState_New(PyInterpreterState_Main());
+		if (!m_main) {
+			m_error = "no thread state for the worker";
+			return;
+		}
+
+#if defined(PyABI_SUBINTERPRETERS)
+		PyEval_RestoreThread(m_main);
+		PyInterpreterConfig config = {};
+		config.use_main_obmalloc = 0;
+		config.allow_fork = 0;
+		config.allow_exec = 0;
+		config.allow_threads = 1;
+		config.allow_daemon_threads = 0;
+		config.check_multi_interp_extensions = 1;
+		config.gil = PyInterpreterConfig_OWN_GIL;
+		PyThreadState* thread = nullptr;
+		const PyStatus status = Py_NewInterpreterFromConfig(&thread, &config);
+		if (PyStatus_Exception(status) || !thread) {
+			m_error = std::string("no sub-interpreter for the worker: ") + (status.err_msg ? status.err_msg : "unknown error");
+			PyEval_SaveThread();
+			return;
+		}
+		// the new interpreter's GIL is held, the main one was let go
+		m_thread = thread;
+		PyEval_SaveThread();
+#else
+		m_thread = m_main;
+#endif
+	}
+
+	static Worker_Interpreter& local() {
+		static thread_local Worker_Interpreter worker;
+		return worker;
+	}
+
+	// with m_thread current
+	void invoke(Results& Result, std::string_view target, const List& args, const Dict& kwargs) {
+		PyObject* function = find(target);
+		if (function) {
+			auto_pyptr positional = args.toPyList();
+			auto_pyptr arguments = positional ? PySequence_Tuple(positional) : nullptr;
+			auto_pyptr keywords = kwargs.size() ? kwargs.toPyDict() : nullptr;
+			if (arguments && (keywords || !kwargs.size())) {
+				auto_pyptr result = PyObject_Call(function, arguments, keywords);
+				if (result) {
+					try {
+						Buffer_Pin::Copying copying;
+						Result.Return(Object(Result.arena(), result));
+					}
+					catch (PyABI_Exception* exception) {
+						delete exception;
+					}
+				}
+			}
+		}
+
+		if (PyErr_Occurred())
+			Result.Fail(describe_error());
+	}
+
+	// a borrowed reference to target in this interpreter, nullptr with an error set
+	PyObject* find(std::string_view target) {
+		std::string name(target);
+		auto found = m_functions.find(name);
+		if (found != m_functions.end())
+			return found->second;
+
+		const size_t colon = name.find(':');
+		if (colon == std::string::npos || colon == 0 || colon + 1 == name.size()) {
+			PyErr_Format(PyExc_ValueError, "'%s' is not a 'module:function' target", name.c_str());
+			return nullptr;
+		}
+
+		PyObject* object = PyImport_ImportModule(name.substr(0, colon).c_str());
+		size_t begin = colon + 1;
+		while (object && begin <= name.size()) {
+			const size_t end = std::min(name.find('.', begin), name.size());
+			PyObject* attribute = PyObject_GetAttrString(object, name.substr(begin, end - begin).c_str());
+			Py_DECREF(object);
+			object = attribute;
+			begin = end + 1;
+		}
+		if (!object)
+			return nullptr;
+
+		m_functions.emplace(std::move(name), object);
+		return object;
+	}
+
+	// "ValueError: message" for the exception being raised, which is cleared
+	static std::string describe_error() {
+		PyObject* type;
+		PyObject* value;
+		PyObject* traceback;
+		PyErr_Fetch(&type, &value, &traceback);
+		PyErr_NormalizeException(&type, &value, &traceback);
+
+		std::string message = type ? ((PyTypeObject*)type)->tp_name : "error";
+		auto_pyptr text = value ? PyObject_Str(value) : nullptr;
+		const char* utf8 = text ? PyUnicode_AsUTF8(text) : nullptr;
+		if (utf8 && *utf8)
+			message += std::string(": ") + utf8;
+
+		Py_XDECREF(type);
+		Py_XDECREF(value);
+		Py_XDECREF(traceback);
+		PyErr_Clear();
+		return message;
+	}
+
+	void forget() {
+		for (auto& function : m_functions)
+			Py_DECREF(function.second);
+		m_functions.clear();
+	}
+
+	// this thread in the main interpreter, and the thread state calls run in (m_main unless it is a sub-interpreter)
+	PyThreadState* m_main = nullptr;
+	PyThreadState* m_thread = nullptr;
+
+	std::string m_error;
+
+	std::unordered_map<std::string, PyObject*> m_functions;
+
+};
+
+/***
+
+Python_Target is the callable a worker interpreter runs: a "module:qualname" string
+or a module level function, which stands for its own module and qualname
+
+***/
+
+struct Python_Target {
+	std::string_view name;
+};
+
+// a sub-interpreter cannot import __main__, so a target there is turned away here rather than failing on the worker
+template<>
+struct Argument<Python_Target> {
+	static Python_Target from(Arena& arena, PyObject* object, const char* function, const char* keyword) {
+		const Python_Target target = resolve(arena, object, function, keyword);
+		if (Worker_Interpreter::mode() == Worker_Interpreter::Mode::Subinterpreter && target.name.substr(0, target.name.find(':')) == "__main__") {
+			PyErr_Format(PyExc_ValueError, "%s() argument '%s' cannot be in __main__, the workers' sub-interpreters cannot import it: move %.200s to a module",
+				function, keyword, std::string(target.name).c_str());
+			throw new PyABI_Exception;
+		}
+		return target;
+	}
+
+private:
+
+	static Python_Target resolve(Arena& arena, PyObject* object, const char* function, const char* keyword) {
+		if (PyUnicode_Check(object))
+			return Python_Target{ Argument<std::string_view>::from(arena, object, function, keyword) };
+
+		auto_pyptr module = PyObject_GetAttrString(object, "__module__");
+		auto_pyptr qualname = module ? PyObject_GetAttrString(object, "__qualname__") : nullptr;
+		if (!qualname || !PyUnicode_Check(module) || !PyUnicode_Check(qualname)) {
+			PyErr_Clear();
+			PyABI_argument_error(function, keyword, "a 'module:function' str or a module level function", object);
+		}
+		const char* module_utf8 = PyUnicode_AsUTF8(module);
+		const char* qualname_utf8 = PyUnicode_AsUTF8(qualname);
+		if (!module_utf8 || !qualname_utf8)
+			throw new PyABI_Exception;
+		if (std::strchr(qualname_utf8, '<')) {
+			PyErr_Format(PyExc_ValueError, "%s() argument '%s' has to be importable, %s.%s is not", function, keyword, module_utf8, qualname_utf8);
+			throw new PyABI_Exception;
+		}
+		const std::string name = std::string(module_utf8) + ":" + qualname_utf8;
+		return Python_Target{ std::string_view(arena.copy(name.data(), name.size()), name.size()) };
+	}
+};
+
+
 /***
 
 //
@@ -13,14 +13,34 @@ Author: Copyright (c) 2011,      Kenneth Keating
 
 #pragma once
 
-#include "PyABI_retroforth_bios.hpp"
+#include "retroforth_bios.hpp"
 
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <algorithm>
 #include <iterator>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <memory>
 #include <array>
-#include <map>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 /***
 
@@ -39,13 +59,325 @@ TOS, NOS and TORS are defined as macros
 
 /***
 
+every opcode but VM_NOP with the instruction that implements it, in opcode order,
+execute() builds its dispatch from this list
 
 ***/
 
-typedef void (*Handler)(void);
+#define RETRO_OPCODES(OP) \
+  OP(VM_LIT, inst_lit) OP(VM_DUP, inst_dup) OP(VM_DROP, inst_drop) OP(VM_SWAP, inst_swap) \
+  OP(VM_PUSH, inst_push) OP(VM_POP, inst_pop) OP(VM_JUMP, inst_jump) OP(VM_CALL, inst_call) \
+  OP(VM_CCALL, inst_ccall) OP(VM_RETURN, inst_return) OP(VM_EQ, inst_eq) OP(VM_NEQ, inst_neq) \
+  OP(VM_LT, inst_lt) OP(VM_GT, inst_gt) OP(VM_FETCH, inst_fetch) OP(VM_STORE, inst_store) \
+  OP(VM_ADD, inst_add) OP(VM_SUB, inst_sub) OP(VM_MUL, inst_mul) OP(VM_DIVMOD, inst_divmod) \
+  OP(VM_AND, inst_and) OP(VM_OR, inst_or) OP(VM_XOR, inst_xor) OP(VM_SHIFT, inst_shift) \
+  OP(VM_ZRET, inst_zret) OP(VM_HALT, inst_halt) OP(VM_IE, inst_ie) OP(VM_IQ, inst_iq) \
+  OP(VM_II, inst_ii)
+
+// computed goto where the compiler has it, a switch elsewhere
+#if defined(__GNUC__) || defined(__clang__)
+#define RETRO_THREADED 1
+#endif
+
+template <class VM>
+class RETRO_JIT;
 
 /***
 
+Nga_Pages: the page aligned block a VM keeps its memory (and the decoded cells)
+in. New pages are anonymous and zero filled, the system only commits the ones
+that get touched.
+
+attach() maps a File of frozen pages over them copy on write instead, so a VM
+starts from a snapshot without copying it and attaching again drops whatever it
+has dirtied since, either way the cost is in the pages touched.
+
+Without mmap (Windows) the pages are ordinary memory and attach() copies.
+
+***/
+
+class Nga_Pages final {
+
+public:
+
+  // a frozen copy of some pages, in a memory backed file where there is one
+  class File final {
+
+  public:
+
+    File(const void* pages, const size_t bytes) : m_bytes(bytes) {
+#ifdef _WIN32
+      m_copy.assign((const char*)pages, (const char*)pages + bytes);
+#else
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+      m_fd = memfd_create("nga-snapshot", MFD_CLOEXEC);
+#else
+      if (FILE* file = tmpfile()) {
+        m_fd = dup(fileno(file));
+        fclose(file);
+      }
+#endif
+      if (m_fd < 0 || ftruncate(m_fd, (off_t)bytes) != 0)
+        throw std::runtime_error("no file for an Nga snapshot");
+      // pages of zeros stay holes
+      const size_t page = page_size();
+      for (size_t at = 0; at < bytes; at += page) {
+        const char* from = (const char*)pages + at;
+        const size_t length = std::min(page, bytes - at);
+        if (std::any_of(from, from + length, [](const char c) { return c != 0; }) && pwrite(m_fd, from, length, (off_t)at) != (ssize_t)length)
+          throw std::runtime_error("could not write an Nga snapshot");
+      }
+#endif
+    }
+
+    ~File() {
+#ifndef _WIN32
+      if (m_fd >= 0)
+        close(m_fd);
+#endif
+    }
+
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+
+    File(File&& other) noexcept : m_fd(other.m_fd), m_bytes(other.m_bytes), m_copy(std::move(other.m_copy)) {
+      other.m_fd = -1;
+    }
+
+    size_t size() const {
+      return m_bytes;
+    }
+
+  private:
+
+    friend class Nga_Pages;
+
+    int m_fd = -1;
+    size_t m_bytes = 0;
+    std::vector<char> m_copy;
+
+  };
+
+  explicit Nga_Pages(const size_t bytes) : m_bytes(round(bytes)) {
+#ifdef _WIN32
+    m_base = VirtualAlloc(nullptr, m_bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    m_base = mmap(nullptr, m_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m_base == MAP_FAILED)
+      m_base = nullptr;
+#endif
+    if (!m_base)
+      throw std::bad_alloc();
+  }
+
+  ~Nga_Pages() {
+#ifdef _WIN32
+    VirtualFree(m_base, 0, MEM_RELEASE);
+#else
+    munmap(m_base, m_bytes);
+#endif
+  }
+
+  Nga_Pages(const Nga_Pages&) = delete;
+  Nga_Pages& operator=(const Nga_Pages&) = delete;
+
+  void attach(const File& file) {
+    if (file.size() != m_bytes)
+      throw std::invalid_argument("an Nga snapshot of a different size");
+#ifdef _WIN32
+    std::memcpy(m_base, file.m_copy.data(), m_bytes);
+#else
+    if (mmap(m_base, m_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, file.m_fd, 0) == MAP_FAILED)
+      throw std::bad_alloc();
+#endif
+  }
+
+  // back to fresh zero pages, without touching any of them
+  void reset() {
+#ifdef _WIN32
+    VirtualFree(m_base, m_bytes, MEM_DECOMMIT);
+    if (!VirtualAlloc(m_base, m_bytes, MEM_COMMIT, PAGE_READWRITE))
+      throw std::bad_alloc();
+#else
+    if (mmap(m_base, m_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+      throw std::bad_alloc();
+#endif
+  }
+
+  // the first bytes of the file fd copy on write over the first pages, false when it cannot be mapped
+  bool map(const int fd, const size_t bytes) {
+#ifdef _WIN32
+    return false;
+#else
+    if (fd < 0 || bytes > m_bytes)
+      return false;
+    return bytes == 0 || mmap(m_base, round(bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED;
+#endif
+  }
+
+  File freeze() const {
+    return File(m_base, m_bytes);
+  }
+
+  char* base() const {
+    return (char*)m_base;
+  }
+
+  size_t size() const {
+    return m_bytes;
+  }
+
+  static size_t page_size() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+  }
+
+  static size_t round(const size_t bytes) {
+    const size_t page = page_size();
+    return (bytes + page - 1) / page * page;
+  }
+
+private:
+
+  void* m_base;
+  size_t m_bytes;
+
+};
+
+/***
+
+Nga_Image: an image file as the tools write it, little endian cells with no
+header of their own, so the kernel's first cells stand in for one: cell 0 jumps
+(li ju) to the entry point in cell 1, cell 2 is Dictionary and cell 3 is Heap.
+Heap never lies past the last cell the tools wrote, which is also what tells
+the 32 bit cells retro-muri.py and retro-extend.py pack from 64 bit ones.
+
+A file that is there but fails those checks throws std::invalid_argument.
+
+A VM maps the file copy on write where it can, all of them share its pages until
+they store into one, so replace an image by renaming over it rather than
+rewriting it in place.
+
+***/
+
+class Nga_Image final {
+
+public:
+
+  explicit Nga_Image(const char* path) {
+    if (!path || !(m_file = fopen(path, "rb")))
+      return;
+    fseek(m_file, 0, SEEK_END);
+    const long bytes = ftell(m_file);
+    m_bytes = bytes > 0 ? (size_t)bytes : 0;
+    unsigned char head[4 * 8] = {};
+    rewind(m_file);
+    const size_t got = fread(head, 1, sizeof(head), m_file);
+    rewind(m_file);
+    for (const size_t width : { 4, 8 }) {
+      if (got >= 4 * width && valid(head, width)) {
+        m_width = width;
+        break;
+      }
+    }
+    if (!m_width) {
+      fclose(m_file);
+      m_file = nullptr;
+      throw std::invalid_argument(std::string(path) + " is not an Nga image");
+    }
+  }
+
+  ~Nga_Image() {
+    if (m_file)
+      fclose(m_file);
+  }
+
+  Nga_Image(const Nga_Image&) = delete;
+  Nga_Image& operator=(const Nga_Image&) = delete;
+
+  // false when there is no file
+  explicit operator bool() const {
+    return m_file != nullptr;
+  }
+
+  // the bytes in a cell, 4 or 8
+  size_t width() const {
+    return m_width;
+  }
+
+  size_t cells() const {
+    return m_width ? m_bytes / m_width : 0;
+  }
+
+  int fd() const {
+#ifdef _WIN32
+    return -1;
+#else
+    return m_file ? fileno(m_file) : -1;
+#endif
+  }
+
+  // the first count cells into memory, widened or narrowed to T
+  template <class T>
+  void read(T* memory, const size_t count) {
+    rewind(m_file);
+    if (m_width == sizeof(T)) {
+      if (fread(memory, sizeof(T), count, m_file) != count)
+        throw std::runtime_error("could not read an Nga image");
+      return;
+    }
+    unsigned char cell[8];
+    for (size_t i = 0; i < count; i++) {
+      if (fread(cell, 1, m_width, m_file) != m_width)
+        throw std::runtime_error("could not read an Nga image");
+      const int64_t value = at(cell, 0, m_width);
+      if (value < (int64_t)std::numeric_limits<T>::min() || value > (int64_t)std::numeric_limits<T>::max())
+        throw std::invalid_argument("an Nga image with cells too wide for the VM");
+      memory[i] = (T)value;
+    }
+  }
+
+private:
+
+  // as RETRO_VM::NUM_OPS
+  static constexpr int64_t NUM_OPS = 30;
+
+  static int64_t at(const unsigned char* bytes, const size_t cell, const size_t width) {
+    uint64_t value = 0;
+    for (size_t i = width; i-- > 0;)
+      value = value << 8 | bytes[cell * width + i];
+    if (width < 8 && (value >> (width * 8 - 1)) & 1)
+      value |= ~uint64_t(0) << (width * 8);
+    return (int64_t)value;
+  }
+
+  bool valid(const unsigned char* head, const size_t width) const {
+    if (m_bytes % width != 0)
+      return false;
+    const int64_t jump = at(head, 0, width), dictionary = at(head, 2, width), heap = at(head, 3, width);
+    if (jump < 0 || jump > 0xFFFFFFFF)
+      return false;
+    for (int slot = 0; slot < 4; slot++) {
+      if ((jump >> (slot * 8) & 0xFF) >= NUM_OPS)
+        return false;
+    }
+    return 0 <= dictionary && dictionary < heap && (uint64_t)heap <= m_bytes / width;
+  }
+
+  FILE* m_file = nullptr;
+  size_t m_bytes = 0;
+  size_t m_width = 0;
+
+};
+
+/***
+
+A RETRO_VM holds its stacks inline and its memory in Nga_Pages
 
 ***/
 
@@ -54,54 +386,194 @@ class RETRO_VM {
 
 public:
 
-  RETRO_VM(int *bios = &retro_bios, CELL CELL_MIN = 0, CELL CELL_MAX = 0)
-    : ip(0), sp(0), rp(0)
+  template <class VM>
+  friend class RETRO_JIT;
+
+  typedef CELL Cell;
+
+  typedef void (RETRO_VM::*Handler)();
+
+  static constexpr int NUM_OPS = 30;
+
+  static constexpr int64_t Image_Size = IMAGE_SIZE;
+
+  /***
+
+  A device is what ii invokes and iq describes: io:invoke pops the device number
+  and calls invoke(vm, context), which takes its arguments off the data stack
+  and leaves its results there, io:query pushes version and type.
+
+  Devices live in a flat array, 0 writes a character to std::cout, 1 reads one
+  from std::cin and 2 calls the host functions bound with bind().
+
+  ***/
+
+  typedef void (*Host)(RETRO_VM& vm, void* context);
+
+  struct Device {
+    Host invoke;
+    void* context;
+    CELL version;
+    CELL type;
+  };
+
+  static constexpr int MAX_DEVICES = 16;
+
+  // a function bind() defined a word for, call knows how to run it
+  struct Binding {
+    void (*call)(RETRO_VM& vm, const Binding& binding);
+    Host host;
+    void* context;
+    void (*function)();
+  };
+
+  static constexpr int MAX_BINDINGS = 256;
+
+  // the device of bind()'s functions, and the type io:query reports for it
+  static constexpr CELL HOST_DEVICE = 2;
+  static constexpr CELL HOST_TYPE = 1000;
+
+  RETRO_VM(const int* bios = retro_bios, int64_t bios_cells = sizeof(retro_bios) / sizeof(retro_bios[0]), CELL CELL_MIN = 0, CELL CELL_MAX = 0)
+    : sp(0), rp(0), ip(0)
     , image_size(IMAGE_SIZE + 1), cell_min(CELL_MIN), cell_max(CELL_MAX)
+    , data{}, address{}
+    , pages(decoded_offset() + (IMAGE_SIZE + 1) * sizeof(Decoded))
+    , memory((CELL*)pages.base()), decoded((Decoded*)(pages.base() + decoded_offset()))
   {
 
-    IO_deviceHandlers[0] = &generic_output;
-    IO_deviceHandlers[1] = &generic_input;
+    attach({ &RETRO_VM::generic_output, nullptr, 0, 0 });
+    attach({ &RETRO_VM::generic_input, nullptr, 0, 1 });
+    attach({ &RETRO_VM::host_call, nullptr, 0, HOST_TYPE });
 
-    IO_queryHandlers[0] = &generic_output_query;
-    IO_queryHandlers[1] = &generic_input_query;
+    if (bios)
+      ngaLoadImage(nullptr, bios, bios_cells);
 
   }
 
   /***
 
+  Clears memory and loads the Nga_Image imageFile, or when there is none the
+  ngaImageCells of ngaImage
 
+  An image whose cells are as wide as CELL is mapped rather than read, and no
+  cell is decoded here (see decode_at()), so loading one is a single mmap
+  whatever its size; running it then reads in the pages of code and data it
+  touches and decodes the cells it reaches.
 
   ***/
 
-  CELL ngaLoadImage(const char* imageFile, int64_t ngaImage[], int64_t ngaImageCells) {
-    FILE* fp;
+  CELL ngaLoadImage(const char* imageFile, const int ngaImage[], int64_t ngaImageCells) {
+    Nga_Image image(imageFile);
     CELL imageSize;
-    long fileLen;
     CELL i;
-    if (imageFile && (fp = fopen(imageFile, "rb")) != NULL) {
-      /* Determine length (in cells) */
-      fseek(fp, 0, SEEK_END);
-      fileLen = ftell(fp) / sizeof(CELL);
-      rewind(fp);
-      /* Read the file into memory */
-      imageSize = fread(&memory, sizeof(CELL), fileLen, fp);
-      fclose(fp);
+    pages.reset();
+    if (image) {
+      imageSize = (CELL)std::min<size_t>(image.cells(), IMAGE_SIZE + 1);
+      if (image.width() != sizeof(CELL) || !pages.map(image.fd(), imageSize * sizeof(CELL)))
+        image.read(memory, imageSize);
     }
     else {
-      for (i = 0; i < ngaImageCells; i++)
+      for (i = 0; i < ngaImageCells && i <= IMAGE_SIZE; i++)
         memory[i] = ngaImage[i];
       imageSize = i;
     }
+    code_changed = true;
     return imageSize;
   }
 
   /***
 
+  Runs the word at cell until it returns.
 
+  Every cell was decoded once, when it was loaded or stored, so the loop does not
+  revalidate the packed opcodes and runs only the ones that are not VM_NOP. The
+  instructions are threaded with computed goto, each one jumps straight to the
+  next instead of returning to a dispatch loop.
+
+  The semantics are those of execute_reference(): the four slots of a cell run
+  in order (a jump takes effect after the cell), a cell is read once before it
+  runs and execution stops when the address stack empties. A data stack underflow
+  stops the word at once rather than after the rest of its cell, as in RETRO_JIT,
+  so no instruction reaches below the stack.
 
   ***/
 
   void execute(CELL cell) {
+    rp = 1;
+    ip = cell;
+#ifdef RETRO_THREADED
+    static const void* const threads[NUM_OPS] = {
+      nullptr,
+#define RETRO_THREAD(op, inst) &&op_##inst,
+      RETRO_OPCODES(RETRO_THREAD)
+#undef RETRO_THREAD
+    };
+    Decoded code;
+    int slot;
+  next_cell:
+    if (ip >= IMAGE_SIZE)
+      return;
+    code = decode_at(ip);
+    if (code.count == Decoded::INVALID)
+      invalid_instruction();
+    slot = 0;
+    if (code.count == 0)
+      goto end_cell;
+    goto *threads[code.ops[0]];
+#define RETRO_THREAD(op, inst) \
+  op_##inst: \
+    inst(); \
+    if (sp < 0) \
+      goto underflow; \
+    if (++slot < code.count) \
+      goto *threads[code.ops[slot]]; \
+    goto end_cell;
+    RETRO_OPCODES(RETRO_THREAD)
+#undef RETRO_THREAD
+  underflow:
+    ip = IMAGE_SIZE;
+    return;
+  end_cell:
+    ip++;
+    if (rp == 0) {
+      ip = IMAGE_SIZE;
+      return;
+    }
+    goto next_cell;
+#else
+    while (ip < IMAGE_SIZE) {
+      const Decoded code = decode_at(ip);
+      if (code.count == Decoded::INVALID)
+        invalid_instruction();
+      for (int slot = 0; slot < code.count; slot++) {
+        switch (code.ops[slot]) {
+#define RETRO_CASE(op, inst) case op: inst(); break;
+          RETRO_OPCODES(RETRO_CASE)
+#undef RETRO_CASE
+        }
+        if (sp < 0) {
+          ip = IMAGE_SIZE;
+          return;
+        }
+      }
+      ip++;
+      if (rp == 0)
+        ip = IMAGE_SIZE;
+    }
+#endif
+  }
+
+  /***
+
+  The original loop: validates each cell as it reaches it and calls through
+  instructions[] for all four slots. It is the baseline for the retro benchmark
+  and what execute() is checked against.
+
+  With profile set every opcode run is counted in it.
+
+  ***/
+
+  void execute_reference(CELL cell) {
     CELL opcode;
     rp = 1;
     ip = cell;
@@ -111,8 +583,7 @@ public:
         ngaProcessPackedOpcodes(opcode);
       }
       else {
-        printf("Invalid instruction!\n");
-        exit(1);
+        invalid_instruction();
       }
       ip++;
       if (rp == 0)
@@ -120,32 +591,190 @@ public:
     }
   }
 
+  std::array<uint64_t, NUM_OPS>* profile = nullptr;
 
   /***
 
+  The dictionary: d_lookup() gives the header of a word (0 if there is none),
+  its execution token is the cell after the link
+
+  ***/
+
+  CELL d_lookup(const std::string& name) const {
+    CELL header = memory[2];
+    while (header != 0 && extract_string(header + 3) != name)
+      header = memory[header];
+    return header;
+  }
 
+  CELL d_xt(const std::string& name) const {
+    const CELL header = d_lookup(name);
+    return header ? memory[header + 1] : 0;
+  }
+
+  /***
+
+  Runs Forth source the way retro-extend.py does, the listener takes one
+  whitespace separated token at a time from the text input buffer. With
+  reference set the tokens run on execute_reference(), evaluate_with() runs
+  them on whatever run(xt) does.
 
   ***/
 
+  static constexpr CELL TIB = 1024;
+
+  template <class Run>
+  void evaluate_with(const std::string& source, Run&& run) {
+    const CELL interpret = d_xt("interpret");
+    std::istringstream tokens(source);
+    std::string token;
+    while (tokens >> token) {
+      inject_string(token, TIB);
+      stack_push(TIB);
+      run(interpret);
+    }
+  }
 
+  void evaluate(const std::string& source, bool reference = false) {
+    evaluate_with(source, [this, reference](CELL xt) {
+      if (reference)
+        execute_reference(xt);
+      else
+        execute(xt);
+    });
+  }
 
+  // empty for an address outside the image, Retro code passes whatever is on its stack
+  std::string extract_string(CELL at) const {
+    std::string text;
+    if (at < 0)
+      return text;
+    while (at <= IMAGE_SIZE && memory[at] != 0)
+      text += (char)memory[at++];
+    return text;
+  }
 
-  /***
+  void inject_string(const std::string& text, CELL to) {
+    for (const char c : text)
+      store(to++, c);
+    store(to, 0);
+  }
 
+  /***
 
+  Bulk transfers between memory and the host, for buffers a host function is
+  handed the address of. Cells outside memory are left out.
 
   ***/
 
+  void read_cells(CELL at, CELL* to, size_t count) const {
+    if (at < 0 || at > IMAGE_SIZE)
+      return;
+    std::memcpy(to, memory + at, std::min<size_t>(count, IMAGE_SIZE + 1 - at) * sizeof(CELL));
+  }
 
-protected:
+  void write_cells(CELL at, const CELL* from, size_t count) {
+    if (at < 0 || at > IMAGE_SIZE)
+      return;
+    count = std::min<size_t>(count, IMAGE_SIZE + 1 - at);
+    std::memcpy(memory + at, from, count * sizeof(CELL));
+    for (size_t i = 0; i < count; i++)
+      stored(at + (CELL)i, from[i]);
+  }
 
+  // adds a device, returns its number
+  CELL attach(const Device& device) {
+    if (device_count == MAX_DEVICES)
+      throw std::length_error("no room for another Nga device");
+    devices[device_count] = device;
+    return device_count++;
+  }
 
   /***
 
+  Binds a C++ function to a new word called name, which calls it through the
+  host device. Its arguments come off the data stack (the last one from the
+  top) and its result, when it has one, is pushed.
 
+  Integer arguments take a cell and std::string ones the address of a string in
+  memory. A bool result is pushed as Retro's flags (-1 or 0), an integer one as
+  it is. A captureless lambda binds as its function pointer, anything with
+  state binds as a Host with a context, which has the stack to itself.
+
+  The word is defined by evaluating it, so bind once the image is loaded.
 
   ***/
 
+  void bind(const std::string& name, Host host, void* context = nullptr) {
+    add_binding(name, Binding{ &RETRO_VM::call_host, host, context, nullptr });
+  }
+
+  template <class R, class... A>
+  void bind(const std::string& name, R (*function)(A...)) {
+    add_binding(name, Binding{ &RETRO_VM::call_typed<R, A...>, nullptr, nullptr, reinterpret_cast<void (*)()>(function) });
+  }
+
+  template <class F, class = decltype(+std::declval<F>())>
+  void bind(const std::string& name, F function) {
+    bind(name, +function);
+  }
+
+  /***
+
+  A Snapshot is the whole VM at one point (typically just after boot), a VM
+  built from one or restore()d to one shares its pages copy on write, see
+  Nga_Pages
+
+  ***/
+
+  struct Snapshot {
+    Nga_Pages::File pages;
+    int64_t sp, rp, ip;
+    std::array<CELL, STACK_DEPTH> data;
+    std::array<CELL, ADDRESSES> address;
+    // the words bind() defined are in the pages, the functions they call here
+    std::vector<Device> devices;
+    std::vector<Binding> bindings;
+  };
+
+  std::shared_ptr<const Snapshot> snapshot() const {
+    return std::make_shared<const Snapshot>(Snapshot{ pages.freeze(), sp, rp, ip, data, address,
+      { devices.begin(), devices.begin() + device_count }, { bindings.begin(), bindings.begin() + binding_count } });
+  }
+
+  explicit RETRO_VM(const Snapshot& from, CELL CELL_MIN = 0, CELL CELL_MAX = 0)
+    : RETRO_VM(nullptr, 0, CELL_MIN, CELL_MAX)
+  {
+    restore(from);
+  }
+
+  void restore(const Snapshot& from) {
+    pages.attach(from.pages);
+    sp = from.sp;
+    rp = from.rp;
+    ip = from.ip;
+    data = from.data;
+    address = from.address;
+    device_count = (CELL)from.devices.size();
+    std::copy(from.devices.begin(), from.devices.end(), devices.begin());
+    binding_count = (CELL)from.bindings.size();
+    std::copy(from.bindings.begin(), from.bindings.end(), bindings.begin());
+    code_changed = true;
+  }
+
+  CELL fetch(CELL at) const {
+    return memory[at];
+  }
+
+  // the host's stores go through here so that execute() sees them
+  void store(CELL at, CELL value) {
+    memory[at] = value;
+    stored(at, value);
+  }
+
+  int64_t depth() const {
+    return sp;
+  }
 
   CELL stack_pop() {
     sp--;
@@ -157,42 +786,81 @@ protected:
     data[sp] = value;
   }
 
+protected:
+
 
   /***
 
-
+  The character devices, 0 writes to std::cout and 1 reads from std::cin
 
   ***/
 
-  void generic_output() {
-    std::cout << (char)stack_pop();
+  static void generic_output(RETRO_VM& vm, void*) {
+    std::cout << (char)vm.stack_pop();
   }
 
-  void generic_output_query() {
-    stack_push(0);
-    stack_push(0);
-  }
-
-  void generic_input() {
+  static void generic_input(RETRO_VM& vm, void*) {
     char in;
     std::cin >> in;
-    stack_push(in);
-    if (TOS == 127) TOS = 8;
+    vm.stack_push(in == 127 ? 8 : in);
   }
 
-  void generic_input_query() {
-    stack_push(0);
-    stack_push(1);
-  }
+  /***
 
-protected:
+  The host device: pops the number of a binding and calls it
 
+  ***/
 
-  /***
+  static void host_call(RETRO_VM& vm, void*) {
+    const CELL which = vm.stack_pop();
+    if (which >= 0 && which < vm.binding_count)
+      vm.bindings[which].call(vm, vm.bindings[which]);
+  }
 
+  void add_binding(const std::string& name, const Binding& binding) {
+    if (binding_count == MAX_BINDINGS)
+      throw std::length_error("no room for another host function");
+    bindings[binding_count] = binding;
+    evaluate(":" + name + " #" + std::to_string(binding_count) + " #" + std::to_string(HOST_DEVICE) + " io:invoke ;");
+    binding_count++;
+  }
 
+  static void call_host(RETRO_VM& vm, const Binding& binding) {
+    binding.host(vm, binding.context);
+  }
 
-  ***/
+  template <class R, class... A>
+  static void call_typed(RETRO_VM& vm, const Binding& binding) {
+    apply_typed(vm, reinterpret_cast<R (*)(A...)>(binding.function), std::index_sequence_for<A...>());
+  }
+
+  // the arguments are the cells above base, a stack too shallow for them calls nothing
+  template <class R, class... A, size_t... I>
+  static void apply_typed(RETRO_VM& vm, R (*function)(A...), std::index_sequence<I...>) {
+    const int64_t base = vm.sp - (int64_t)sizeof...(A);
+    if (base < 0)
+      return;
+    if constexpr (std::is_void<R>::value) {
+      function(vm.argument<std::decay_t<A>>(vm.data[base + 1 + I])...);
+      vm.sp = base;
+    }
+    else {
+      const R result = function(vm.argument<std::decay_t<A>>(vm.data[base + 1 + I])...);
+      vm.sp = base;
+      if constexpr (std::is_same<R, bool>::value)
+        vm.stack_push(result ? -1 : 0);
+      else
+        vm.stack_push((CELL)result);
+    }
+  }
+
+  template <class T>
+  T argument(const CELL cell) const {
+    if constexpr (std::is_same<T, std::string>::value)
+      return extract_string(cell);
+    else
+      return (T)cell;
+  }
 
 private:
 
@@ -204,7 +872,61 @@ private:
     VM_IQ, VM_II
   };
 
-  #define NUM_OPS VM_II + 1
+  /***
+
+  A cell decoded for execute(): its opcodes without the VM_NOPs, or INVALID
+  when a slot holds something that is not an opcode
+
+  ***/
+
+  struct Decoded {
+    static constexpr uint8_t INVALID = 0xFF;
+    uint8_t count;
+    uint8_t ops[4];
+  };
+
+  static Decoded decode(CELL opcode) {
+    Decoded code{};
+    CELL raw = opcode;
+    for (int i = 0; i < 4; i++) {
+      const CELL current = raw & 0xFF;
+      if (current > VM_II) {
+        code.count = Decoded::INVALID;
+        return code;
+      }
+      if (current != VM_NOP)
+        code.ops[code.count++] = (uint8_t)current;
+      raw = raw >> 8;
+    }
+    return code;
+  }
+
+  /***
+
+  decoded[at], decoded the first time it is needed: the decoded pages start out
+  as zero bytes, which read as a cell with no opcodes, so an empty entry is
+  decoded from memory (again, for a cell that really has none, which is cheap)
+  while every other entry is kept up to date by stored()
+
+  ***/
+
+  Decoded decode_at(CELL at) {
+    Decoded code = decoded[at];
+    if (code.count == 0)
+      code = decoded[at] = decode(memory[at]);
+    return code;
+  }
+
+  void stored(CELL at, CELL value) {
+    decoded[at] = decode(value);
+    if (compiled && compiled[at])
+      code_changed = true;
+  }
+
+  [[noreturn]] static void invalid_instruction() {
+    printf("Invalid instruction!\n");
+    exit(1);
+  }
 
   void inst_nop() {
   }
@@ -220,7 +942,10 @@ private:
     data[sp] = NOS;
   }
 
+  // ccall and store drop twice, the second one after an underflow leaves the stack alone
   void inst_drop() {
+    if (sp < 0)
+      return;
     data[sp] = 0;
     if (--sp < 0)
       ip = IMAGE_SIZE;
@@ -260,6 +985,8 @@ private:
   void inst_ccall() {
     CELL a, b;
     a = TOS; inst_drop();  /* False */
+    if (sp < 0)
+      return;
     b = TOS; inst_drop();  /* Flag  */
     if (b != 0) {
       rp++;
@@ -305,8 +1032,13 @@ private:
   }
 
   void inst_store() {
+    if (sp < 1) {
+      inst_drop();  /* no value to store */
+      return;
+    }
     if (TOS <= IMAGE_SIZE && TOS >= 0) {
       memory[TOS] = NOS;
+      stored(TOS, NOS);
       inst_drop();
       inst_drop();
     }
@@ -381,32 +1113,39 @@ private:
 
   void inst_ie() {
     sp++;
-    TOS = IO_queryHandlers.count();
+    TOS = device_count;
   }
 
+  // a device that is not there reports type -1 and does nothing
   void inst_iq() {
     CELL Device = TOS;
     inst_drop();
-    IO_queryHandlers[Device]();
+    const bool present = Device >= 0 && Device < device_count;
+    stack_push(present ? devices[Device].version : 0);
+    stack_push(present ? devices[Device].type : -1);
   }
 
   void inst_ii() {
     CELL Device = TOS;
     inst_drop();
-    IO_deviceHandlers[Device]();
+    if (Device >= 0 && Device < device_count)
+      devices[Device].invoke(*this, devices[Device].context);
   }
 
   Handler instructions[NUM_OPS] = {
-    inst_nop, inst_lit, inst_dup, inst_drop, inst_swap, inst_push, inst_pop,
-    inst_jump, inst_call, inst_ccall, inst_return, inst_eq, inst_neq, inst_lt,
-    inst_gt, inst_fetch, inst_store, inst_add, inst_sub, inst_mul, inst_divmod,
-    inst_and, inst_or, inst_xor, inst_shift, inst_zret, inst_halt, inst_ie,
-    inst_iq, inst_ii
+    &RETRO_VM::inst_nop, &RETRO_VM::inst_lit, &RETRO_VM::inst_dup, &RETRO_VM::inst_drop, &RETRO_VM::inst_swap, &RETRO_VM::inst_push, &RETRO_VM::inst_pop,
+    &RETRO_VM::inst_jump, &RETRO_VM::inst_call, &RETRO_VM::inst_ccall, &RETRO_VM::inst_return, &RETRO_VM::inst_eq, &RETRO_VM::inst_neq, &RETRO_VM::inst_lt,
+    &RETRO_VM::inst_gt, &RETRO_VM::inst_fetch, &RETRO_VM::inst_store, &RETRO_VM::inst_add, &RETRO_VM::inst_sub, &RETRO_VM::inst_mul, &RETRO_VM::inst_divmod,
+    &RETRO_VM::inst_and, &RETRO_VM::inst_or, &RETRO_VM::inst_xor, &RETRO_VM::inst_shift, &RETRO_VM::inst_zret, &RETRO_VM::inst_halt, &RETRO_VM::inst_ie,
+    &RETRO_VM::inst_iq, &RETRO_VM::inst_ii
   };
 
   void ngaProcessOpcode(CELL opcode) {
-    if (opcode != 0)
-      instructions[opcode]();
+    if (opcode != 0) {
+      if (profile)
+        (*profile)[opcode]++;
+      (this->*instructions[opcode])();
+    }
   }
 
   int ngaValidatePackedOpcodes(CELL opcode) {
@@ -442,10 +1181,25 @@ private:
 
   std::array<CELL, ADDRESSES> address;
 
-  std::array<CELL, IMAGE_SIZE + 1> memory;
+  static size_t decoded_offset() {
+    return Nga_Pages::round((IMAGE_SIZE + 1) * sizeof(CELL));
+  }
+
+  Nga_Pages pages;
+
+  CELL* const memory;
+
+  // memory as execute() runs it, kept in step by ngaLoadImage() and every store
+  Decoded* const decoded;
+
+  // the cells a RETRO_JIT has compiled, a store into one of them sets code_changed
+  const uint8_t* compiled = nullptr;
+  bool code_changed = false;
 
-  std::map<int, Handler> IO_deviceHandlers;
+  std::array<Device, MAX_DEVICES> devices{};
+  CELL device_count = 0;
 
-  std::map<int, Handler> IO_queryHandlers;
+  std::array<Binding, MAX_BINDINGS> bindings{};
+  CELL binding_count = 0;
 
 };
@@ -0,0 +1,753 @@
+/*** Nga JIT
+
+License: MIT License
+
+Author: Copyright (c) 2020-2020, Scott McCallum (github.com scott91e1)
+
+***/
+
+#pragma once
+
+#include "retroforth.hpp"
+
+#include <cstring>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define RETRO_JIT_X64 1
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+/***
+
+RETRO_JIT runs the words of a RETRO_VM as x86-64 code.
+
+The dispatcher interprets a cell at a time until an address has been run hot
+times, then translates the straight line of cells from there up to the first
+control transfer (ju ca cc re zr ha) into a block. Each instruction is a fixed
+template: the stack pointers and TOS live in registers, literals are immediates,
+and the I/O opcodes, sh, st and fe of a negative address call the VM's own
+instruction. A block ends by jumping straight into the block for the next ip, so
+execute() only sees cold code, flushes and the end of the word.
+
+A store into a compiled cell (or a reloaded image) throws every block away, as
+Nga code may change itself.
+
+The code buffer is never writable and executable at once: it is mapped read and
+write, made read and execute before anything runs, and compile() only opens the
+pages it is about to append to for writing, closing them again before the block
+can run. Execution is the same as RETRO_VM::execute() except
+after an out of range store, which stops the word at once instead of after the
+rest of its cell.
+
+Only 32 bit cells are compiled; other cell sizes, other CPUs and a system that
+will not give out executable memory fall back to RETRO_VM::execute().
+
+***/
+
+template <class VM>
+class RETRO_JIT {
+
+public:
+
+  typedef typename VM::Cell CELL;
+
+  static constexpr int64_t IMAGE_SIZE = VM::Image_Size;
+
+  // cells in a block, and the most code one of them can take
+  static constexpr int64_t MAX_CELLS = 64;
+  static constexpr size_t MAX_CELL_CODE = 4 * 96 + 64;
+  static constexpr size_t MAX_BLOCK_CODE = MAX_CELLS * MAX_CELL_CODE + 256;
+
+  static constexpr size_t CODE_SIZE = 4 << 20;
+
+  explicit RETRO_JIT(VM& vm, unsigned hot = 16)
+    : vm(vm), hot(hot), blocks(IMAGE_SIZE + 1), entries(IMAGE_SIZE + 1), heat(IMAGE_SIZE + 1), compiled(IMAGE_SIZE + 1)
+  {
+#ifdef RETRO_JIT_X64
+    if (sizeof(CELL) == 4) {
+#ifdef _WIN32
+      code = (uint8_t*)VirtualAlloc(nullptr, CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+      void* pages = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      code = pages == MAP_FAILED ? nullptr : (uint8_t*)pages;
+#endif
+      if (code && !protect(0, CODE_SIZE, false))
+        release();
+    }
+#endif
+    vm.compiled = compiled.data();
+    vm.code_changed = false;
+  }
+
+  ~RETRO_JIT() {
+    vm.compiled = nullptr;
+    release();
+  }
+
+  RETRO_JIT(const RETRO_JIT&) = delete;
+  RETRO_JIT& operator=(const RETRO_JIT&) = delete;
+
+  bool compiling() const {
+    return code != nullptr;
+  }
+
+  std::size_t block_count() const {
+    return compiled_blocks;
+  }
+
+  /***
+
+  RETRO_VM::execute() through the compiled blocks
+
+  ***/
+
+  void execute(CELL cell) {
+    if (!code) {
+      vm.execute(cell);
+      return;
+    }
+    State state{ vm.data.data(), vm.address.data(), vm.memory, 0, 0, 0, &vm, &vm.code_changed };
+    vm.rp = 1;
+    int64_t ip = cell;
+    while (ip < IMAGE_SIZE) {
+      if (vm.code_changed)
+        flush();
+      Block block = blocks[ip];
+      if (!block && heat[ip] <= hot && ++heat[ip] > hot)
+        block = compile(ip);
+      if (block) {
+        state.sp = vm.sp;
+        state.rp = vm.rp;
+        ip = block(&state);
+        vm.sp = state.sp;
+        vm.rp = state.rp;
+      }
+      else {
+        ip = step(ip);
+      }
+    }
+    vm.ip = ip;
+  }
+
+  void evaluate(const std::string& source) {
+    vm.evaluate_with(source, [this](CELL xt) { execute(xt); });
+  }
+
+private:
+
+  // what a block works on, the offsets are baked into the code
+  struct State {
+    CELL* data;
+    CELL* address;
+    CELL* memory;
+    int64_t sp;
+    int64_t rp;
+    int64_t ip;
+    VM* vm;
+    bool* code_changed;
+  };
+
+  typedef int64_t (*Block)(State*);
+
+  VM& vm;
+  const unsigned hot;
+
+  uint8_t* code = nullptr;
+  size_t code_used = 0;
+  std::size_t compiled_blocks = 0;
+
+  std::vector<Block> blocks;
+  std::vector<const uint8_t*> entries;
+  std::vector<uint16_t> heat;
+  std::vector<uint8_t> compiled;
+
+  // one cell on the VM's own instructions
+  int64_t step(int64_t ip) {
+    vm.ip = ip;
+    const typename VM::Decoded cell = vm.decode_at(ip);
+    if (cell.count == VM::Decoded::INVALID)
+      VM::invalid_instruction();
+    for (int slot = 0; slot < cell.count; slot++) {
+      (vm.*vm.instructions[cell.ops[slot]])();
+      if (vm.sp < 0)
+        return vm.ip = IMAGE_SIZE;
+    }
+    vm.ip++;
+    if (vm.rp == 0)
+      vm.ip = IMAGE_SIZE;
+    return vm.ip;
+  }
+
+  // no more compiling, what has been compiled is dropped with the code buffer
+  void release() {
+#ifdef RETRO_JIT_X64
+    if (code) {
+#ifdef _WIN32
+      VirtualFree(code, 0, MEM_RELEASE);
+#else
+      munmap(code, CODE_SIZE);
+#endif
+    }
+#endif
+    code = nullptr;
+  }
+
+  void flush() {
+    std::fill(blocks.begin(), blocks.end(), nullptr);
+    std::fill(entries.begin(), entries.end(), nullptr);
+    std::fill(heat.begin(), heat.end(), 0);
+    std::fill(compiled.begin(), compiled.end(), 0);
+    code_used = 0;
+    vm.code_changed = false;
+  }
+
+  // a compiled instruction that calls the VM's, IMAGE_SIZE when it stopped the word
+  template <void (VM::*inst)()>
+  static int64_t call(State* state) {
+    VM& vm = *state->vm;
+    vm.sp = state->sp;
+    vm.rp = state->rp;
+    vm.ip = 0;
+    (vm.*inst)();
+    state->sp = vm.sp;
+    state->rp = vm.rp;
+    return vm.ip == IMAGE_SIZE ? IMAGE_SIZE : -1;
+  }
+
+#ifdef RETRO_JIT_X64
+
+  /***
+
+  x86-64 encoding, just the forms the templates use
+
+  ***/
+
+  enum Reg { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7, R12 = 12, R13 = 13, R14 = 14, R15 = 15 };
+
+  // [base + index * 4 + disp], no index when it is -1
+  struct Mem {
+    int base;
+    int index;
+    int32_t disp;
+  };
+
+  // the registers a block keeps its state in: TOS in ecx, the data stack, sp,
+  // memory, the address stack, rp and the State
+  static constexpr int T = RCX, D = RBX, S = R12, M = R13, A = R14, R = R15, ST = RBP;
+
+  static constexpr Mem TOS_M{ D, S, 0 }, NOS_M{ D, S, -4 }, TORS_M{ A, R, 0 };
+
+  static constexpr Mem field(int32_t offset) {
+    return Mem{ ST, -1, offset };
+  }
+
+  static constexpr int32_t SP = offsetof(State, sp), RP = offsetof(State, rp), IP = offsetof(State, ip);
+
+  class Emitter {
+  public:
+    explicit Emitter(uint8_t* at) : start(at), at(at) {}
+
+    uint8_t* const start;
+    uint8_t* at;
+
+    void byte(uint8_t value) { *at++ = value; }
+
+    void dword(int32_t value) { std::memcpy(at, &value, 4); at += 4; }
+
+    void qword(int64_t value) { std::memcpy(at, &value, 8); at += 8; }
+
+    void bytes(std::initializer_list<uint8_t> values) {
+      for (const uint8_t value : values)
+        byte(value);
+    }
+
+    void rex(bool wide, int reg, int index, int base) {
+      const uint8_t prefix = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((index & 8) ? 2 : 0) | ((base & 8) ? 1 : 0);
+      if (prefix != 0x40)
+        byte(prefix);
+    }
+
+    // op reg, [mem] (or op [mem], reg, as the opcode says)
+    void rm(bool wide, std::initializer_list<uint8_t> opcode, int reg, const Mem& mem) {
+      rex(wide, reg, mem.index < 0 ? 0 : mem.index, mem.base);
+      bytes(opcode);
+      const int mod = mem.disp == 0 && (mem.base & 7) != RBP ? 0 : (mem.disp >= -128 && mem.disp <= 127 ? 1 : 2);
+      if (mem.index >= 0) {
+        byte((uint8_t)(mod << 6 | (reg & 7) << 3 | 4));
+        byte((uint8_t)(0x80 | (mem.index & 7) << 3 | (mem.base & 7)));
+      }
+      else if ((mem.base & 7) == RSP) {
+        byte((uint8_t)(mod << 6 | (reg & 7) << 3 | 4));
+        byte(0x24);
+      }
+      else {
+        byte((uint8_t)(mod << 6 | (reg & 7) << 3 | (mem.base & 7)));
+      }
+      if (mod == 1)
+        byte((uint8_t)(int8_t)mem.disp);
+      else if (mod == 2)
+        dword(mem.disp);
+    }
+
+    // op rm, reg (or an opcode extension in reg)
+    void rr(bool wide, std::initializer_list<uint8_t> opcode, int reg, int rm) {
+      rex(wide, reg, 0, rm);
+      bytes(opcode);
+      byte((uint8_t)(0xC0 | (reg & 7) << 3 | (rm & 7)));
+    }
+
+    // a rel32 jump (jcc with a condition) whose target is filled in by bind()
+    uint8_t* jump(uint8_t condition = 0) {
+      if (condition)
+        bytes({ 0x0F, condition });
+      else
+        byte(0xE9);
+      uint8_t* patch = at;
+      dword(0);
+      return patch;
+    }
+
+    void bind(uint8_t* patch, const uint8_t* target) {
+      const int32_t offset = (int32_t)(target - (patch + 4));
+      std::memcpy(patch, &offset, 4);
+    }
+  };
+
+  static constexpr uint8_t JMP = 0, JAE = 0x83, JZ = 0x84, JNZ = 0x85, JS = 0x88;
+
+  // the jumps of a block to its exits, bound when they are emitted at its end
+  struct Exits {
+    std::vector<uint8_t*> exit, leave, synced, under, stop;
+  };
+
+  static void inc(Emitter& e, int reg) { e.rr(true, { 0xFF }, 0, reg); }
+
+  static void dec(Emitter& e, int reg) { e.rr(true, { 0xFF }, 1, reg); }
+
+  static void spill(Emitter& e) { e.rm(false, { 0x89 }, T, TOS_M); }
+
+  static void reload(Emitter& e) { e.rm(false, { 0x8B }, T, TOS_M); }
+
+  static void drop(Emitter& e, Exits& exits) {
+    dec(e, S);
+    exits.under.push_back(e.jump(JS));
+    reload(e);
+  }
+
+  // sp-- then T = [TOS] op T, for the instructions that leave NOS op TOS
+  static void binary(Emitter& e, Exits& exits, std::initializer_list<uint8_t> opcode) {
+    dec(e, S);
+    exits.under.push_back(e.jump(JS));
+    e.rm(false, opcode, T, TOS_M);
+  }
+
+  static void compare(Emitter& e, Exits& exits, uint8_t setcc) {
+    dec(e, S);
+    exits.under.push_back(e.jump(JS));
+    e.rm(false, { 0x8B }, RAX, TOS_M);
+    e.rr(false, { 0x39 }, T, RAX);
+    e.bytes({ 0x0F, setcc, 0xC0 });
+    e.rr(false, { 0x0F, 0xB6 }, T, RAX);
+    e.rr(false, { 0xF7 }, 3, T);
+  }
+
+  // rax = ip, with the sign of a cell
+  static void load_ip_from(Emitter& e, const Mem& cell) {
+    e.rm(false, { 0x8B }, RAX, cell);
+    e.rr(true, { 0x63 }, RAX, RAX);
+  }
+
+  template <void (VM::*inst)()>
+  static void helper(Emitter& e, Exits& exits) {
+    spill(e);
+    e.rm(true, { 0x89 }, S, field(SP));
+    e.rm(true, { 0x89 }, R, field(RP));
+#ifdef _WIN32
+    e.rr(true, { 0x89 }, ST, RCX);
+#else
+    e.rr(true, { 0x89 }, ST, RDI);
+#endif
+    e.bytes({ 0x48, 0xB8 });
+    e.qword((int64_t)(intptr_t)&RETRO_JIT::template call<inst>);
+    e.bytes({ 0xFF, 0xD0 });
+    e.rm(true, { 0x8B }, S, field(SP));
+    e.rm(true, { 0x8B }, R, field(RP));
+    e.bytes({ 0x48, 0x83, 0xF8, 0xFF });
+    exits.synced.push_back(e.jump(JNZ));
+    reload(e);
+  }
+
+  /***
+
+  Translates the cells from entry into a block, nullptr when the first one
+  cannot be
+
+  ***/
+
+  Block compile(const int64_t entry) {
+    if (CODE_SIZE - code_used < MAX_BLOCK_CODE)
+      flush();
+    const size_t from = code_used;
+    if (!code || !protect(from, from + MAX_BLOCK_CODE, true)) {
+      heat[entry] = (uint16_t)(hot + 1);
+      return nullptr;
+    }
+
+    Emitter e(code + code_used);
+    Exits exits;
+
+    // push rbx, rbp, r12-r15 and keep the stack aligned (and shadow space on Windows)
+    e.bytes({ 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 });
+#ifdef _WIN32
+    e.bytes({ 0x48, 0x83, 0xEC, 40 });
+    e.rr(true, { 0x89 }, RCX, ST);
+#else
+    e.bytes({ 0x48, 0x83, 0xEC, 8 });
+    e.rr(true, { 0x89 }, RDI, ST);
+#endif
+    e.rm(true, { 0x8B }, D, field(offsetof(State, data)));
+    e.rm(true, { 0x8B }, A, field(offsetof(State, address)));
+    e.rm(true, { 0x8B }, M, field(offsetof(State, memory)));
+    e.rm(true, { 0x8B }, S, field(SP));
+    e.rm(true, { 0x8B }, R, field(RP));
+    reload(e);
+
+    // where other blocks jump in, with everything already in registers
+    const uint8_t* const body = e.at;
+
+    int64_t ip = entry;
+    int64_t cells = 0;
+    bool ended = false;
+    while (cells < MAX_CELLS && ip < IMAGE_SIZE && !ended) {
+      const typename VM::Decoded cell = vm.decode_at(ip);
+      if (!translatable(cell, ip))
+        break;
+      ended = translate(e, exits, cell, ip);
+      cells++;
+    }
+
+    if (cells == 0) {
+      heat[entry] = (uint16_t)(hot + 1);
+      seal(from);
+      return nullptr;
+    }
+
+    if (!ended) {
+      e.byte(0xB8);
+      e.dword((int32_t)ip);
+      exits.exit.push_back(e.jump(JMP));
+    }
+
+    // exit: rax is the next ip, go straight on to its block when it has one
+    for (uint8_t* patch : exits.exit)
+      e.bind(patch, e.at);
+    e.bytes({ 0x48, 0x3D });
+    e.dword((int32_t)IMAGE_SIZE);
+    exits.leave.push_back(e.jump(JAE));
+    e.bytes({ 0x48, 0xBA });
+    e.qword((int64_t)(intptr_t)entries.data());
+    e.bytes({ 0x48, 0x8B, 0x14, 0xC2, 0x48, 0x85, 0xD2 });
+    exits.leave.push_back(e.jump(JZ));
+    e.bytes({ 0xFF, 0xE2 });
+
+    // stop: rp reached 0
+    for (uint8_t* patch : exits.stop)
+      e.bind(patch, e.at);
+    e.byte(0xB8);
+    e.dword((int32_t)IMAGE_SIZE);
+
+    // leave: back to execute() with rax
+    for (uint8_t* patch : exits.leave)
+      e.bind(patch, e.at);
+    spill(e);
+
+    // synced: data[sp] is already in memory
+    uint8_t* const synced = e.at;
+    for (uint8_t* patch : exits.synced)
+      e.bind(patch, synced);
+    e.rm(true, { 0x89 }, S, field(SP));
+    e.rm(true, { 0x89 }, R, field(RP));
+#ifdef _WIN32
+    e.bytes({ 0x48, 0x83, 0xC4, 40 });
+#else
+    e.bytes({ 0x48, 0x83, 0xC4, 8 });
+#endif
+    e.bytes({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3 });
+
+    // under: the data stack underflowed, there is no TOS to write back
+    for (uint8_t* patch : exits.under)
+      e.bind(patch, e.at);
+    e.byte(0xB8);
+    e.dword((int32_t)IMAGE_SIZE);
+    e.bind(e.jump(JMP), synced);
+
+    const Block block = (Block)(void*)e.start;
+    code_used += e.at - e.start;
+    if (!seal(from))
+      return nullptr;
+    compiled_blocks++;
+    blocks[entry] = block;
+    entries[entry] = body;
+    return block;
+  }
+
+  // the pages of code[from, to) writable for compile() or executable, false when the system refuses
+  bool protect(const size_t from, const size_t to, const bool writable) {
+    const size_t page = Nga_Pages::page_size();
+    const size_t first = from / page * page;
+    const size_t last = std::min(CODE_SIZE, (to + page - 1) / page * page);
+#ifdef _WIN32
+    DWORD previous;
+    if (!VirtualProtect(code + first, last - first, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &previous))
+      return false;
+    if (!writable)
+      FlushInstructionCache(GetCurrentProcess(), code + first, last - first);
+    return true;
+#else
+    return mprotect(code + first, last - first, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+#endif
+  }
+
+  // the pages compile() opened from from on executable again, or no more compiling when they cannot be
+  bool seal(const size_t from) {
+    if (protect(from, from + MAX_BLOCK_CODE, false))
+      return true;
+    flush();
+    release();
+    return false;
+  }
+
+  static bool is_control(const uint8_t op) {
+    return op == VM::VM_JUMP || op == VM::VM_CALL || op == VM::VM_CCALL || op == VM::VM_RETURN || op == VM::VM_ZRET || op == VM::VM_HALT;
+  }
+
+  // a literal after a jump would come from the new ip, those cells are left to step()
+  static bool translatable(const typename VM::Decoded& cell, int64_t ip) {
+    if (cell.count == VM::Decoded::INVALID)
+      return false;
+    bool control = false;
+    for (int slot = 0; slot < cell.count; slot++) {
+      if (cell.ops[slot] == VM::VM_LIT && (control || ++ip >= IMAGE_SIZE))
+        return false;
+      control = control || is_control(cell.ops[slot]);
+    }
+    return true;
+  }
+
+  /***
+
+  Emits one cell at ip and moves ip past it and its literals, true when the
+  cell transfers control and so ends the block. Once a cell has transferred
+  control its ip lives in State::ip.
+
+  ***/
+
+  bool translate(Emitter& e, Exits& exits, const typename VM::Decoded& cell, int64_t& ip) {
+    compiled[ip] = 1;
+    bool dynamic = false, pops = false, stores = false;
+
+    for (int slot = 0; slot < cell.count; slot++) {
+      const uint8_t op = cell.ops[slot];
+      if (is_control(op) && !dynamic) {
+        e.rm(true, { 0xC7 }, 0, field(IP));
+        e.dword((int32_t)ip);
+        dynamic = true;
+      }
+      switch (op) {
+      case VM::VM_LIT:
+        ip++;
+        compiled[ip] = 1;
+        spill(e);
+        inc(e, S);
+        e.byte(0xB9);
+        e.dword((int32_t)vm.memory[ip]);
+        break;
+      case VM::VM_DUP:
+        spill(e);
+        inc(e, S);
+        break;
+      case VM::VM_DROP:
+        drop(e, exits);
+        break;
+      case VM::VM_SWAP:
+        e.rm(false, { 0x8B }, RAX, NOS_M);
+        e.rm(false, { 0x89 }, T, NOS_M);
+        e.rr(false, { 0x89 }, RAX, T);
+        break;
+      case VM::VM_PUSH:
+        inc(e, R);
+        e.rm(false, { 0x89 }, T, TORS_M);
+        drop(e, exits);
+        break;
+      case VM::VM_POP:
+        spill(e);
+        inc(e, S);
+        e.rm(false, { 0x8B }, T, TORS_M);
+        dec(e, R);
+        pops = true;
+        break;
+      case VM::VM_JUMP:
+        e.rr(true, { 0x63 }, RAX, T);
+        dec(e, RAX);
+        e.rm(true, { 0x89 }, RAX, field(IP));
+        drop(e, exits);
+        break;
+      case VM::VM_CALL:
+        inc(e, R);
+        e.rm(true, { 0x8B }, RAX, field(IP));
+        e.rm(false, { 0x89 }, RAX, TORS_M);
+        e.rr(true, { 0x63 }, RAX, T);
+        dec(e, RAX);
+        e.rm(true, { 0x89 }, RAX, field(IP));
+        drop(e, exits);
+        break;
+      case VM::VM_CCALL: {
+        e.rr(false, { 0x89 }, T, RDX);
+        drop(e, exits);
+        e.rr(false, { 0x89 }, T, RAX);
+        drop(e, exits);
+        e.rr(false, { 0x85 }, RAX, RAX);
+        uint8_t* skip = e.jump(JZ);
+        inc(e, R);
+        e.rm(true, { 0x8B }, RAX, field(IP));
+        e.rm(false, { 0x89 }, RAX, TORS_M);
+        e.rr(true, { 0x63 }, RAX, RDX);
+        dec(e, RAX);
+        e.rm(true, { 0x89 }, RAX, field(IP));
+        e.bind(skip, e.at);
+        break;
+      }
+      case VM::VM_RETURN:
+        load_ip_from(e, TORS_M);
+        e.rm(true, { 0x89 }, RAX, field(IP));
+        dec(e, R);
+        break;
+      case VM::VM_EQ:
+        compare(e, exits, 0x94);
+        break;
+      case VM::VM_NEQ:
+        compare(e, exits, 0x95);
+        break;
+      case VM::VM_LT:
+        compare(e, exits, 0x9C);
+        break;
+      case VM::VM_GT:
+        compare(e, exits, 0x9F);
+        break;
+      case VM::VM_FETCH: {
+        e.rr(false, { 0x85 }, T, T);
+        uint8_t* negative = e.jump(JS);
+        e.rr(true, { 0x63 }, RAX, T);
+        e.rm(false, { 0x8B }, T, Mem{ M, RAX, 0 });
+        uint8_t* done = e.jump(JMP);
+        e.bind(negative, e.at);
+        helper<&VM::inst_fetch>(e, exits);
+        e.bind(done, e.at);
+        break;
+      }
+      case VM::VM_STORE:
+        helper<&VM::inst_store>(e, exits);
+        stores = true;
+        break;
+      case VM::VM_ADD:
+        binary(e, exits, { 0x03 });
+        break;
+      case VM::VM_SUB:
+        dec(e, S);
+        exits.under.push_back(e.jump(JS));
+        e.rm(false, { 0x8B }, RAX, TOS_M);
+        e.rr(false, { 0x29 }, T, RAX);
+        e.rr(false, { 0x89 }, RAX, T);
+        break;
+      case VM::VM_MUL:
+        binary(e, exits, { 0x0F, 0xAF });
+        break;
+      case VM::VM_DIVMOD:
+        e.rm(false, { 0x8B }, RAX, NOS_M);
+        e.byte(0x99);
+        e.rr(false, { 0xF7 }, 7, T);
+        e.rm(false, { 0x89 }, RDX, NOS_M);
+        e.rr(false, { 0x89 }, RAX, T);
+        break;
+      case VM::VM_AND:
+        binary(e, exits, { 0x23 });
+        break;
+      case VM::VM_OR:
+        binary(e, exits, { 0x0B });
+        break;
+      case VM::VM_XOR:
+        binary(e, exits, { 0x33 });
+        break;
+      case VM::VM_SHIFT:
+        helper<&VM::inst_shift>(e, exits);
+        break;
+      case VM::VM_ZRET: {
+        e.rr(false, { 0x85 }, T, T);
+        uint8_t* skip = e.jump(JNZ);
+        drop(e, exits);
+        load_ip_from(e, TORS_M);
+        e.rm(true, { 0x89 }, RAX, field(IP));
+        dec(e, R);
+        e.bind(skip, e.at);
+        break;
+      }
+      case VM::VM_HALT:
+        e.rm(true, { 0xC7 }, 0, field(IP));
+        e.dword((int32_t)IMAGE_SIZE);
+        break;
+      case VM::VM_IE:
+        helper<&VM::inst_ie>(e, exits);
+        break;
+      case VM::VM_IQ:
+        helper<&VM::inst_iq>(e, exits);
+        break;
+      case VM::VM_II:
+        helper<&VM::inst_ii>(e, exits);
+        stores = true;
+        break;
+      }
+    }
+    ip++;
+
+    if (dynamic) {
+      // rax = ip + 1, or IMAGE_SIZE when the address stack is empty
+      e.rm(true, { 0x8B }, RAX, field(IP));
+      inc(e, RAX);
+      e.rr(true, { 0x85 }, R, R);
+      exits.stop.push_back(e.jump(JZ));
+      exits.exit.push_back(e.jump(JMP));
+      return true;
+    }
+    if (pops) {
+      e.rr(true, { 0x85 }, R, R);
+      exits.stop.push_back(e.jump(JZ));
+    }
+    if (stores) {
+      // the cell may have changed compiled code, go back to execute() to flush it
+      e.rm(true, { 0x8B }, RAX, field(offsetof(State, code_changed)));
+      e.bytes({ 0x80, 0x38, 0x00 });
+      uint8_t* unchanged = e.jump(JZ);
+      e.byte(0xB8);
+      e.dword((int32_t)ip);
+      exits.leave.push_back(e.jump(JMP));
+      e.bind(unchanged, e.at);
+    }
+    return false;
+  }
+
+#else
+
+  Block compile(int64_t entry) {
+    heat[entry] = (uint16_t)(hot + 1);
+    return nullptr;
+  }
+
+#endif
+
+};
@@ -0,0 +1,128 @@
+/*** Nga pool
+
+License: MIT License
+
+Author: Copyright (c) 2020-2020, Scott McCallum (github.com scott91e1)
+
+***/
+
+#pragma once
+
+#include "header.hpp"
+
+#include "retroforth.hpp"
+
+/***
+
+RETRO_POOL runs policy checks on the workers of a ThreadPool, each worker with
+its own RETRO_VM.
+
+Every VM starts from one Snapshot, taken once the bios has booted, bind() has
+bound the host functions (with RETRO_VM::bind()) and the prelude (the policy
+words) has been evaluated. The snapshot carries the bindings to every VM. A VM maps the snapshot's pages
+copy on write and is restored to it after every check, which throws away only
+the pages that check dirtied, so a check never sees what another left behind.
+A VM that cannot be restored (its pages could not be mapped again) is dropped
+instead and the next check on that worker builds it afresh from the snapshot.
+
+The VMs are all built up front (one per worker the pool can run, plus one for
+threads that are not workers) and post() hands the task to ThreadPool::post(),
+so once the pool is warm a check costs no heap allocation as long as the task
+fits inline. Look up the words a check calls with xt() beforehand, the
+dictionary walk allocates.
+
+***/
+
+template <class VM>
+class RETRO_POOL final {
+
+public:
+
+  typedef typename VM::Cell CELL;
+
+  RETRO_POOL(ThreadPool& pool, const std::string& prelude = "", const std::function<void(VM&)>& bind = nullptr)
+    : m_pool(pool)
+  {
+    {
+      VM boot;
+      if (bind)
+        bind(boot);
+      boot.evaluate(prelude);
+      m_snapshot = boot.snapshot();
+    }
+    for (std::size_t i = 0; i <= pool.capacity(); i++)
+      m_vms.push_back(std::make_unique<VM>(*m_snapshot));
+  }
+
+  RETRO_POOL(RETRO_POOL const&) = delete;
+  RETRO_POOL& operator=(const RETRO_POOL&) = delete;
+
+  const typename VM::Snapshot& snapshot() const {
+    return *m_snapshot;
+  }
+
+  // the execution token of a word in the snapshot, 0 when there is none
+  CELL xt(const std::string& name) {
+    return run([&](VM& vm) { return vm.d_xt(name); });
+  }
+
+  /***
+
+  task(VM&) on one of the pool's workers, fire and forget like ThreadPool::post
+
+  ***/
+
+  template<class TaskT>
+  void post(TaskT&& task, const Schedule& schedule = Schedule()) {
+    m_pool.post([this, task = std::forward<TaskT>(task)]() mutable { run(task); }, schedule);
+  }
+
+  /***
+
+  task(VM&) on the calling thread, with the worker's own VM on a worker of the
+  pool and the shared spare VM (one caller at a time) anywhere else
+
+  ***/
+
+  template<class TaskT>
+  auto run(TaskT&& task) -> decltype(task(std::declval<VM&>())) {
+    if (ThreadPool::current() == &m_pool)
+      return check(m_vms[ThreadPool::current_worker()], task);
+
+    std::lock_guard<std::mutex> lock(m_spare);
+    return check(m_vms.back(), task);
+  }
+
+private:
+
+  // puts the VM back to the snapshot however the task ends, without throwing out of a destructor
+  struct Restore {
+    std::unique_ptr<VM>& vm;
+    const typename VM::Snapshot& snapshot;
+    ~Restore() {
+      try {
+        vm->restore(snapshot);
+      }
+      catch (...) {
+        vm.reset();
+      }
+    }
+  };
+
+  template<class TaskT>
+  auto check(std::unique_ptr<VM>& vm, TaskT& task) -> decltype(task(*vm)) {
+    if (!vm)
+      vm = std::make_unique<VM>(*m_snapshot);
+    Restore restore{ vm, *m_snapshot };
+    return task(*vm);
+  }
+
+  ThreadPool& m_pool;
+
+  std::shared_ptr<const typename VM::Snapshot> m_snapshot;
+
+  std::vector<std::unique_ptr<VM>> m_vms;
+
+  std::mutex m_spare;
+
+};
@@ -0,0 +1,322 @@
+/***
+
+License: MIT License
+
+Author: Copyright (c) 2020-2020, Scott McCallum (github.com scott91e1)
+
+Differential test of RETRO_JIT against RETRO_VM::execute()
+
+every program runs from the same image on a VM of each kind, afterwards the data
+stack, all of memory and everything written to std::cout have to match
+
+every fixed program also runs on a VM restored from a snapshot after another
+program has run on it, which has to match a VM that only ran the program, and
+on VMs that loaded the bios from image files of 32 and 64 bit cells, and some
+call host functions bound with RETRO_VM::bind()
+
+raw cells that underflow the data stack (cc, st, two drops) have to stop both
+kinds with the stack just emptied, nothing written below it
+
+  g++ -std=c++17 -O2 -Isrc tests/retroforth_diff.cpp -o retroforth_diff
+  ./retroforth_diff [random programs] [seed]
+
+the fixed programs cover every opcode, the random ones are arithmetic built so
+that the stack never underflows, the raw cells cover that
+
+***/
+
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <vector>
+#include <iostream>
+
+#include "retroforth_jit.hpp"
+
+using VM = RETRO_VM<int32_t, 524288, 128, 1024>;
+
+static const char* const programs[] = {
+  "#1 #2 + n:put nl 'hello s:put nl",
+  "#7 #3 /mod n:put sp n:put #-7 #2 /mod n:put sp n:put",
+  "#1 #4 shift n:put #-32 #-2 shift n:put #-32 #2 shift n:put",
+  "#3 #4 over n:put n:put n:put #5 n:negate n:abs n:put",
+  "#3 #4 eq? n:put #3 #3 -eq? n:put #-3 #4 lt? n:put #3 #4 gt? n:put #255 #15 and #1 or #6 xor n:put",
+  ":fib dup #2 lt? [ ] [ dup n:dec fib swap #2 - fib + ] choose ; #20 fib n:put",
+  "'Acc var #100 [ @Acc #3 + !Acc ] times @Acc n:put",
+  ":sq dup * ; #0 #1000 [ #3 sq + ] times n:put",
+  "#0 #500 [ dup #250 gt? [ #1 - ] [ #2 + ] choose ] times n:put",
+  "#0 #50 [ 'policy:allow s:hash + ] times n:put",
+  "#0 #10 [ 'times d:lookup + ] times n:put",
+  "'abc 'abd s:eq? n:put 'hello s:length n:put 'hello s:reverse s:put",
+  // rewrites the literal of a word that has run enough to be compiled
+  ":k #5 ; #0 #100 [ k + ] times n:put &k n:inc #7 swap store #0 #100 [ k + ] times n:put",
+  // words defined after others were compiled
+  ":a #1 ; #20 [ a drop ] times :b #2 ; :a #3 ; #20 [ a b + drop ] times a b + n:put",
+  "#0 #20 [ #1 + dup #10 eq? [ drop #100 ] if ] times n:put",
+  "#-1 fetch n:put #-2 fetch n:put #-3 fetch n:put",
+  "#10 [ I n:put sp ] indexed-times",
+  // host functions, see bind_host()
+  "#0 #50 [ 'policy:allow host:hash + ] times n:put #1 #2 #3 host:digits n:put #3 host:even? n:put",
+  "'Buffer d:create #8 allot &Buffer #8 host:fill &Buffer #8 host:sum n:put",
+  // a string argument at an address outside the image is empty
+  "#-50000000 host:hash n:put #-1 host:hash n:put #600000 host:hash n:put",
+};
+
+static int32_t host_hash(const std::string& text) {
+  uint32_t hash = 5381;
+  for (const char c : text)
+    hash = hash * 33 + (uint8_t)c;
+  return (int32_t)hash;
+}
+
+// the host words the programs call, bound again wherever a VM loads an image
+static void bind_host(VM& vm) {
+  vm.bind("host:hash", &host_hash);
+  vm.bind("host:digits", [](int32_t a, int32_t b, int32_t c) { return a * 100 + b * 10 + c; });
+  vm.bind("host:even?", [](int32_t n) { return n % 2 == 0; });
+  // (at count -) stores 1..count at at
+  vm.bind("host:fill", [](VM& vm, void*) {
+    const int32_t count = vm.stack_pop(), at = vm.stack_pop();
+    std::vector<int32_t> cells(count);
+    for (int32_t i = 0; i < count; i++)
+      cells[i] = i + 1;
+    vm.write_cells(at, cells.data(), cells.size());
+  });
+  // (at count - sum)
+  vm.bind("host:sum", [](VM& vm, void*) {
+    const int32_t count = vm.stack_pop(), at = vm.stack_pop();
+    std::vector<int32_t> cells(count);
+    vm.read_cells(at, cells.data(), cells.size());
+    int32_t sum = 0;
+    for (const int32_t cell : cells)
+      sum += cell;
+    vm.stack_push(sum);
+  });
+}
+
+static std::string random_program(std::mt19937& random) {
+  static const char* const binary[] = { "+", "-", "*", "and", "or", "xor", "eq?", "-eq?", "lt?", "gt?", "swap", "nip", "n:max", "n:min" };
+  static const char* const unary[] = { "dup", "n:negate", "n:abs", "n:inc", "n:dec", "n:zero?", "#3 fetch +", "#2 shift", "#-3 shift" };
+
+  std::ostringstream text;
+  text << ":w ";
+  int depth = 0;
+  const int length = 4 + random() % 40;
+  for (int i = 0; i < length; i++) {
+    const unsigned choice = random() % 10;
+    if (depth < 2 || choice < 3) {
+      text << "#" << (int32_t)(random() % 2001) - 1000 << " ";
+      depth++;
+    }
+    else if (choice < 7) {
+      const char* word = binary[random() % (sizeof(binary) / sizeof(binary[0]))];
+      text << word << " ";
+      depth -= std::string(word) == "swap" ? 0 : 1;
+    }
+    else if (choice < 8) {
+      text << "#" << 1 + random() % 97 << " /mod + ";
+    }
+    else if (choice < 9) {
+      const char* word = unary[random() % (sizeof(unary) / sizeof(unary[0]))];
+      text << word << " ";
+      depth += std::string(word) == "dup" ? 1 : 0;
+    }
+    else {
+      text << "dup #0 lt? [ n:negate ] if ";
+    }
+  }
+  while (depth-- > 1)
+    text << "+ ";
+  text << "; #0 #" << 1 + random() % 50 << " [ w + ] times n:put";
+  return text.str();
+}
+
+static std::string run(VM& vm, const std::string& program, RETRO_JIT<VM>* jit) {
+  std::ostringstream output;
+  std::streambuf* const console = std::cout.rdbuf(output.rdbuf());
+  if (jit)
+    jit->evaluate(program);
+  else
+    vm.evaluate(program);
+  std::cout.rdbuf(console);
+  return output.str();
+}
+
+static std::string compare(VM& expected, VM& actual, const std::string& want, const std::string& got) {
+  std::string problem;
+  if (want != got)
+    problem = "output \"" + got + "\" instead of \"" + want + "\"";
+  else if (expected.depth() != actual.depth())
+    problem = "depth " + std::to_string(actual.depth()) + " instead of " + std::to_string(expected.depth());
+  for (int32_t at = 0; problem.empty() && at <= VM::Image_Size; at++) {
+    if (expected.fetch(at) != actual.fetch(at))
+      problem = "memory[" + std::to_string(at) + "] is " + std::to_string(actual.fetch(at)) + " instead of " + std::to_string(expected.fetch(at));
+  }
+  while (problem.empty() && expected.depth() > 0) {
+    const int32_t want_top = expected.stack_pop(), got_top = actual.stack_pop();
+    if (want_top != got_top)
+      problem = "stack holds " + std::to_string(got_top) + " instead of " + std::to_string(want_top);
+  }
+  return problem;
+}
+
+static bool check(const std::string& program, unsigned hot) {
+  auto expected = std::make_unique<VM>();
+  auto actual = std::make_unique<VM>();
+  bind_host(*expected);
+  bind_host(*actual);
+  RETRO_JIT<VM> jit(*actual, hot);
+
+  const std::string want = run(*expected, program, nullptr);
+  const std::string got = run(*actual, program, &jit);
+
+  const std::string problem = compare(*expected, *actual, want, got);
+  if (!problem.empty()) {
+    std::cout << "FAIL (hot " << hot << ") " << program << std::endl << "  " << problem << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// program on a VM built from a snapshot, after before ran on it and it was restored
+static bool check_restored(const std::string& before, const std::string& program, unsigned hot) {
+  auto expected = std::make_unique<VM>();
+  bind_host(*expected);
+  auto actual = std::make_unique<VM>(*expected->snapshot());
+  RETRO_JIT<VM> jit(*actual, hot);
+
+  const auto snapshot = actual->snapshot();
+  run(*actual, before, &jit);
+  actual->restore(*snapshot);
+
+  const std::string want = run(*expected, program, nullptr);
+  const std::string got = run(*actual, program, &jit);
+
+  const std::string problem = compare(*expected, *actual, want, got);
+  if (!problem.empty()) {
+    std::cout << "FAIL (restored, hot " << hot << ") " << before << " then " << program << std::endl << "  " << problem << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// ops packed into one cell run again and again on an empty stack, each run has to stop at sp -1
+static bool check_underflow(const std::vector<uint8_t>& ops, unsigned hot) {
+  auto expected = std::make_unique<VM>();
+  auto actual = std::make_unique<VM>();
+  RETRO_JIT<VM> jit(*actual, hot);
+
+  int32_t cell = 0;
+  for (size_t slot = 0; slot < ops.size(); slot++)
+    cell |= (int32_t)ops[slot] << (slot * 8);
+  const int32_t at = VM::Image_Size - 1;
+  expected->store(at, cell);
+  actual->store(at, cell);
+
+  std::string problem;
+  for (int run = 0; run < 20 && problem.empty(); run++) {
+    expected->execute(at);
+    jit.execute(at);
+    problem = compare(*expected, *actual, "", "");
+    if (problem.empty() && expected->depth() != -1)
+      problem = "depth " + std::to_string(expected->depth()) + " after the underflow";
+    // back to an empty stack
+    expected->stack_push(0);
+    actual->stack_push(0);
+  }
+  if (!problem.empty()) {
+    std::cout << "FAIL (underflow, hot " << hot << ") cell " << cell << std::endl << "  " << problem << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// the bios as retro-muri.py would write it, with cells of width bytes
+static std::string write_image(const size_t width) {
+  const std::string path = "retroforth_diff." + std::to_string(width * 8) + ".ngaImage";
+  FILE* file = fopen(path.c_str(), "wb");
+  for (const int cell : retro_bios) {
+    const int64_t value = cell;
+    for (size_t i = 0; i < width; i++)
+      fputc((int)(value >> (i * 8) & 0xFF), file);
+  }
+  fclose(file);
+  return path;
+}
+
+// program on a VM that loaded the bios from image
+static bool check_image(const std::string& image, const std::string& program, unsigned hot) {
+  auto expected = std::make_unique<VM>();
+  auto actual = std::make_unique<VM>(nullptr, 0);
+  if (actual->ngaLoadImage(image.c_str(), nullptr, 0) != (int32_t)(sizeof(retro_bios) / sizeof(retro_bios[0]))) {
+    std::cout << "FAIL " << image << " did not load" << std::endl;
+    return false;
+  }
+  bind_host(*expected);
+  bind_host(*actual);
+  RETRO_JIT<VM> jit(*actual, hot);
+
+  const std::string want = run(*expected, program, nullptr);
+  const std::string got = run(*actual, program, &jit);
+
+  const std::string problem = compare(*expected, *actual, want, got);
+  if (!problem.empty()) {
+    std::cout << "FAIL (" << image << ", hot " << hot << ") " << program << std::endl << "  " << problem << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  const int count = argc > 1 ? std::atoi(argv[1]) : 200;
+  const unsigned seed = argc > 2 ? (unsigned)std::atoi(argv[2]) : 1;
+
+  {
+    auto vm = std::make_unique<VM>();
+    RETRO_JIT<VM> jit(*vm);
+    if (!jit.compiling())
+      std::cout << "no JIT on this platform, checking the fallback only" << std::endl;
+  }
+
+  int failed = 0, checked = 0;
+  for (const unsigned hot : { 0u, 16u }) {
+    for (const char* program : programs) {
+      failed += !check(program, hot);
+      checked++;
+    }
+  }
+
+  const std::size_t fixed = sizeof(programs) / sizeof(programs[0]);
+  for (std::size_t i = 0; i < fixed; i++) {
+    failed += !check_restored(programs[(i + 5) % fixed], programs[i], i % 2 ? 16 : 0);
+    checked++;
+  }
+
+  for (const size_t width : { 4, 8 }) {
+    const std::string image = write_image(width);
+    for (std::size_t i = 0; i < fixed; i++) {
+      failed += !check_image(image, programs[i], i % 2 ? 0 : 16);
+      checked++;
+    }
+    std::remove(image.c_str());
+  }
+
+  // Nga's opcodes: dr 3, cc 9, st 16, ad 17
+  const std::vector<uint8_t> underflows[] = { { 9 }, { 16 }, { 3, 3 }, { 9, 3, 17 } };
+  for (const unsigned hot : { 0u, 16u }) {
+    for (const auto& ops : underflows) {
+      failed += !check_underflow(ops, hot);
+      checked++;
+    }
+  }
+
+  std::mt19937 random(seed);
+  for (int i = 0; i < count; i++) {
+    failed += !check(random_program(random), i % 2 ? 16 : 0);
+    checked++;
+  }
+
+  std::cout << checked - failed << " of " << checked << " programs agree" << std::endl;
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,135 @@
+"""End to end throughput of PyABI_pyd calls, with pytest-benchmark.
+
+Every benchmark submits calls and collects their results, so it covers argument
+parsing, marshaling, the pool and the way back. Runs are stored and compared with
+
+    pytest tests/test_benchmarks.py --benchmark-autosave
+    pytest tests/test_benchmarks.py --benchmark-compare --benchmark-compare-fail=mean:10%
+
+calls_per_s in each benchmark's extra_info is the rate for the whole batch.
+Skipped unless pytest-benchmark (see requirements.txt) is installed and PyABI_pyd
+is built.
+"""
+import select
+import time
+
+import pytest
+
+pytest.importorskip("pytest_benchmark")
+m = pytest.importorskip("PyABI_pyd")
+
+
+def drain(count):
+    """Collect count results, whichever calls they belong to, sleeping on completion_fd in between."""
+    fd = m.completion_fd()
+    while count > 0:
+        results = m.deque_results()
+        count -= len(results)
+        if count > 0 and not results:
+            if fd < 0:
+                time.sleep(0.0001)
+            else:
+                assert select.select([fd], [], [], 10)[0], "no call finished in 10s"
+
+
+def round_trip(submit):
+    call_id = submit()
+    assert m.wait(call_id, timeout=10)[1]
+
+
+def calls_per_s(benchmark, calls):
+    """The rate for the whole batch into extra_info, unless --benchmark-disable left nothing timed."""
+    if benchmark.stats:
+        benchmark.extra_info["calls_per_s"] = calls / benchmark.stats.stats.mean
+
+
+@pytest.fixture(autouse=True)
+def nothing_left_over():
+    """Every call on the default pool, whatever another test routed elsewhere."""
+    for function in (m.hello_world, m.call_python):
+        m.route(function, "default")
+    m.deque_results()
+    yield
+    m.deque_results()
+
+
+SHAPES = {
+    "positional": lambda: m.hello_world("utf-8", 1, False),
+    "keywords": lambda: m.hello_world(encoding="utf-8", the_id=1, must_log=False),
+    "defaults": lambda: m.hello_world("utf-8", 1),
+    "scheduled": lambda: m.hello_world("utf-8", 1, False, priority=1, timeout=10.0),
+}
+
+PAYLOADS = {
+    "bytes 1KiB": b"x" * 1024,
+    "bytes 1MiB": b"x" * (1 << 20),
+    "nested": [{"id": i, "name": "n%d" % i, "tags": [i, (i, -i), None]} for i in range(100)],
+    "ints 1k": list(range(1000)),
+}
+
+
+@pytest.mark.parametrize("shape", list(SHAPES))
+def test_call_latency(benchmark, shape):
+    """One call at a time: submit, then wait for its result."""
+    benchmark.group = "latency"
+    benchmark(round_trip, SHAPES[shape])
+
+
+@pytest.mark.parametrize("payload", list(PAYLOADS))
+def test_payload_latency(benchmark, payload):
+    """One call at a time with a payload the worker's Python only takes the len() of."""
+    benchmark.group = "payload"
+    value = PAYLOADS[payload]
+    benchmark(round_trip, lambda: m.call_python("builtins:len", (value,)))
+
+
+@pytest.mark.parametrize("batch", [16, 256, 4096])
+def test_call_throughput(benchmark, batch):
+    """batch calls submitted one by one, then collected."""
+    benchmark.group = "throughput"
+    benchmark.extra_info["calls"] = batch
+
+    def run():
+        for _ in range(batch):
+            m.hello_world("utf-8", 1, False)
+        drain(batch)
+
+    benchmark(run)
+    calls_per_s(benchmark, batch)
+
+
+@pytest.mark.parametrize("batch", [16, 256, 4096])
+def test_submit_many_throughput(benchmark, batch):
+    """batch calls in one submit_many(), then collected."""
+    benchmark.group = "submit_many"
+    benchmark.extra_info["calls"] = batch
+    calls = [("utf-8", i, False) for i in range(batch)]
+
+    def run():
+        m.submit_many(m.hello_world, calls)
+        drain(batch)
+
+    benchmark(run)
+    calls_per_s(benchmark, batch)
+
+
+@pytest.mark.parametrize("workers", [1, 2, 4, 8])
+def test_worker_throughput(benchmark, workers):
+    """1024 calls on a default pool resized to workers."""
+    pool = m.pools()["default"]
+    if workers > pool["max_workers"]:
+        pytest.skip("the default pool holds at most %d workers" % pool["max_workers"])
+    benchmark.group = "workers"
+    benchmark.extra_info["calls"] = 1024
+
+    def run():
+        for _ in range(1024):
+            m.hello_world("utf-8", 1, False)
+        drain(1024)
+
+    m.resize_pool("default", workers)
+    try:
+        benchmark(run)
+    finally:
+        m.resize_pool("default", pool["workers"])
+    calls_per_s(benchmark, 1024)
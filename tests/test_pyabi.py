@@ -1,5 +1,522 @@
+import pytest
+
 from pyabi import __version__
 
 
 def test_version():
     assert __version__ == "0.42.12"
+
+
+def test_completions_resolve_in_any_order():
+    import asyncio
+    import os
+
+    from pyabi.aio import Completions
+
+    class Module:
+        def __init__(self):
+            self.read_fd, self.write_fd = os.pipe()
+            os.set_blocking(self.read_fd, False)
+            self.queued = []
+
+        def completion_fd(self):
+            return self.read_fd
+
+        def deque_results(self):
+            try:
+                os.read(self.read_fd, 64)
+            except BlockingIOError:
+                pass
+            queued, self.queued = self.queued, []
+            return queued
+
+        def finish(self, call_id):
+            self.queued.append((call_id, True, call_id * 10))
+            os.write(self.write_fd, b"\x01")
+
+    async def main():
+        module = Module()
+        completions = Completions(module, asyncio.get_running_loop())
+        first = completions.wait(1)
+        module.finish(2)
+        module.finish(1)
+        assert await first == (1, True, 10)
+        assert await completions.wait(2) == (2, True, 20)
+
+        cancelled = []
+        module.cancel = cancelled.append
+        waiting = completions.wait(3)
+        waiting.cancel()
+        await asyncio.sleep(0)
+        assert cancelled == [3]
+        module.finish(3)
+        await asyncio.sleep(0)
+        completions.close()
+
+    asyncio.run(main())
+
+
+def test_stats_snapshots_reset_every_interval():
+    import threading
+
+    from pyabi.stats import Snapshots
+
+    class Module:
+        def __init__(self):
+            self.resets = 0
+
+        def stats(self, reset=False):
+            self.resets += reset
+            return {"total": {"count": self.resets}}
+
+    taken = []
+    done = threading.Event()
+
+    def callback(timestamp, stats):
+        taken.append(stats["total"]["count"])
+        if len(taken) == 2:
+            done.set()
+
+    snapshots = Snapshots(Module(), 0.01, callback)
+    assert done.wait(5)
+    snapshots.close()
+    assert taken[:2] == [2, 3]
+
+
+@pytest.fixture
+def single_worker():
+    """Routes the extension's exports to a fresh one-worker pool, back to the default pool afterwards."""
+    module = pytest.importorskip("PyABI_pyd")
+    functions = (module.hello_world, module.call_python)
+
+    def route(name):
+        module.create_pool(name, workers=1)
+        for function in functions:
+            module.route(function, name)
+        module.limit_pool(name, 0)
+        return module
+
+    yield route
+    for function in functions:
+        module.route(function, "default")
+
+
+def _busy(module, name, seconds=1.0):
+    """Keep the pool's only worker busy, back once the sleep has started."""
+    import time
+
+    sleeper = module.call_python("time:sleep", (seconds,))
+    while module.pools()[name]["queued"]:
+        time.sleep(0.001)
+    return sleeper
+
+
+def _finished(module, call_ids, timeout=30):
+    """The CallIDs in the order deque_results() hands them back, sleeping on completion_fd."""
+    import select
+
+    fd = module.completion_fd()
+    waiting, order = set(call_ids), []
+    while waiting:
+        for call_id, success, result in module.deque_results():
+            if call_id in waiting:
+                waiting.discard(call_id)
+                order.append(call_id)
+        if waiting:
+            assert select.select([fd], [], [], timeout)[0], "nothing finished in time"
+    return order
+
+
+def test_wait_returns_the_result_or_none(single_worker):
+    module = single_worker("wait")
+    call_id = module.hello_world("utf-8", 1, False)
+    assert module.wait(call_id, timeout=10) == (call_id, True, None)
+    sleeper = _busy(module, "wait", 0.5)
+    assert module.wait(sleeper, timeout=0.01) is None
+    assert module.wait(sleeper, timeout=10)[:2] == (sleeper, True)
+
+
+def test_results_come_back_as_memoryviews_and_containers():
+    import gc
+    import weakref
+
+    module = pytest.importorskip("PyABI_pyd")
+    call_id = module.hello_results(2, 3, nested=False)
+    call_id, success, matrix = module.wait(call_id, timeout=10)
+    assert success and isinstance(matrix, memoryview)
+    assert matrix.readonly and matrix.format == "d" and matrix.shape == (2, 3)
+    assert matrix.tolist() == [[0.0, 1.0, 2.0], [3.0, 4.0, 5.0]]
+    with pytest.raises(TypeError):
+        matrix[0, 0] = 1.0
+
+    pinned = weakref.ref(matrix.obj)
+    del matrix
+    gc.collect()
+    assert pinned() is None
+
+    call_id, success, result = module.wait(module.hello_results(2, 2), timeout=10)
+    assert success
+    assert result["rows"] == [(0, "row 0"), (1, "row 1")]
+    assert result["shape"] == (2, 2)
+    assert result["matrix"].tolist() == [[0.0, 1.0], [2.0, 3.0]]
+    assert not module.wait(module.hello_results(-1, 2), timeout=10)[1]
+
+
+def test_priorities_run_high_first(single_worker):
+    module = single_worker("priorities")
+    _busy(module, "priorities", 0.2)
+    low = module.hello_world("utf-8", 1, False, priority=-1)
+    normal = module.hello_world("utf-8", 2, False)
+    high = module.hello_world("utf-8", 3, False, priority=1)
+    assert _finished(module, [low, normal, high]) == [high, normal, low]
+
+
+def test_deadline_fails_a_call_that_starts_late(single_worker):
+    module = single_worker("deadlines")
+    _busy(module, "deadlines", 0.2)
+    late = module.hello_world("utf-8", 1, False, deadline=0.01)
+    call_id, success, result = module.wait(late, timeout=10)
+    assert not success and isinstance(result, module.DeadlineExceeded)
+
+
+def test_cancel_a_queued_call(single_worker):
+    module = single_worker("cancel")
+    sleeper = _busy(module, "cancel", 0.2)
+    queued = module.hello_world("utf-8", 1, False)
+    assert module.cancel(queued)
+    call_id, success, result = module.wait(queued, timeout=10)
+    assert not success and isinstance(result, module.Cancelled)
+    assert module.wait(sleeper, timeout=10)[1] is True
+    assert not module.cancel(queued)
+
+
+def test_cancel_makes_room_under_reject(single_worker):
+    module = single_worker("withdraw")
+    sleeper = _busy(module, "withdraw", 0.3)
+    module.limit_pool("withdraw", 2, "reject")
+    first = module.hello_world("utf-8", 1, False)
+    second = module.hello_world("utf-8", 2, False)
+    with pytest.raises(module.Overloaded):
+        module.hello_world("utf-8", 3, False)
+
+    assert module.cancel(second)
+    assert module.pools()["withdraw"]["queued"] == 1
+    third = module.hello_world("utf-8", 4, False)
+    assert not module.wait(second, timeout=10)[1]
+    for call_id in (sleeper, first, third):
+        assert module.wait(call_id, timeout=10)[1] is True
+    assert module.pools()["withdraw"]["queued"] == 0
+    assert module.hello_world("utf-8", 5, False) and module.hello_world("utf-8", 6, False)
+    module.limit_pool("withdraw", 0, "reject")
+
+
+def test_limit_pool_overflow(single_worker):
+    import time
+
+    module = single_worker("overflow")
+    _busy(module, "overflow", 0.5)
+    module.limit_pool("overflow", 2, "reject")
+    first = module.hello_world("utf-8", 1, False)
+    module.hello_world("utf-8", 2, False)
+    with pytest.raises(module.Overloaded):
+        module.hello_world("utf-8", 3, False)
+
+    module.limit_pool("overflow", 2, "shed_oldest")
+    last = module.hello_world("utf-8", 4, False)
+    call_id, success, result = module.wait(first, timeout=10)
+    assert not success and isinstance(result, module.Overloaded)
+    assert module.wait(last, timeout=10)[1] is True
+
+    module.limit_pool("overflow", 1, "block")
+    _busy(module, "overflow", 0.3)
+    module.hello_world("utf-8", 5, False)
+    start = time.monotonic()
+    blocked = module.hello_world("utf-8", 6, False)
+    assert time.monotonic() - start > 0.1
+    assert module.wait(blocked, timeout=10)[1] is True
+    assert module.pools()["overflow"]["rejected"] == 1
+
+
+def test_must_log_takes_any_truthy_value(single_worker):
+    module = single_worker("must_log")
+    for must_log in (1, 0, "", [None]):
+        call_id = module.hello_world("utf-8", 1, must_log)
+        assert module.wait(call_id, timeout=10)[1] is True
+
+
+def test_after_waits_for_its_inputs(single_worker):
+    module = single_worker("after")
+    sleeper = _busy(module, "after", 0.2)
+    later = module.hello_world("utf-8", 1, False, priority=1, after=[sleeper])
+    assert module.wait(later, timeout=0.05) is None
+    assert _finished(module, [later, sleeper]) == [sleeper, later]
+
+
+def test_cancel_keeps_an_older_calls_mark(single_worker):
+    module = single_worker("cancel_wraparound")
+    _busy(module, "cancel_wraparound")
+    older = module.hello_world("utf-8", 1, False)
+    assert module.cancel(older)
+    module.submit_many(module.hello_world, [("utf-8", i, False) for i in range(65535)])
+    newer = module.hello_world("utf-8", 2, False)
+    assert newer == older + 65536
+    assert not module.cancel(newer)
+    assert module.wait(older, timeout=30)[1] is False
+    assert module.wait(newer, timeout=30)[1] is True
+    assert not module.cancel(newer)
+
+
+def test_after_survives_an_older_call_in_its_slot(single_worker):
+    module = single_worker("after_wraparound")
+    sleeper = _busy(module, "after_wraparound")
+    module.submit_many(module.hello_world, [("utf-8", i, False) for i in range(65535)])
+    newer = module.hello_world("utf-8", 1, False)
+    assert newer == sleeper + 65536
+    later = module.hello_world("utf-8", 2, False, after=newer)
+    assert module.wait(later, timeout=30)[1] is True
+
+
+def test_after_rejects_a_slot_an_older_call_is_watched_in(single_worker):
+    module = single_worker("after_rejected")
+    _busy(module, "after_rejected")
+    older = module.hello_world("utf-8", 1, False)
+    module.hello_world("utf-8", 2, False, after=older)
+    module.submit_many(module.hello_world, [("utf-8", i, False) for i in range(65534)])
+    newer = module.hello_world("utf-8", 3, False)
+    assert newer == older + 65536
+    with pytest.raises(ValueError):
+        module.hello_world("utf-8", 4, False, after=newer)
+
+
+def _round_trip(module, value):
+    """value marshaled to a worker's interpreter, through copy.copy and back."""
+    call_id, success, result = module.wait(module.call_python("copy:copy", [value]), timeout=10)
+    assert success, result
+    return result
+
+
+def test_buffers_and_containers_round_trip():
+    module = pytest.importorskip("PyABI_pyd")
+    payload = bytes(range(256)) * 64
+    assert _round_trip(module, payload) == payload
+    assert _round_trip(module, bytearray(b"abc")) == b"abc"
+    assert _round_trip(module, memoryview(payload)[16:32]) == payload[16:32]
+    assert _round_trip(module, memoryview(payload)[::2]) == payload[::2]
+    nested = {"a": [1, 2.5, None, True], "b": ("x", b"y", {"c": []})}
+    assert _round_trip(module, nested) == nested
+    with pytest.raises(TypeError):
+        module.call_python("copy:copy", [object()])
+
+
+def test_a_queued_call_pins_its_buffer(single_worker):
+    module = single_worker("pinned")
+    _busy(module, "pinned", 0.3)
+    data = bytearray(b"pinned")
+    call_id = module.call_python("copy:copy", [data])
+    with pytest.raises(BufferError):
+        data.extend(b"!")
+    assert module.wait(call_id, timeout=10)[1:] == (True, b"pinned")
+    module.deque_results()
+    data.extend(b"!")
+
+
+def test_large_nested_arguments_round_trip():
+    module = pytest.importorskip("PyABI_pyd")
+    rows = [[i, -i, i * 0.5, str(i), i % 2 == 0, None] for i in range(10000)]
+    table = {str(i): {"row": rows[i], "key": (i, str(i))} for i in range(1000)}
+    assert _round_trip(module, rows) == rows
+    assert _round_trip(module, table) == table
+    deep = []
+    for _ in range(50):
+        deep = [1, {"x": deep}]
+    assert _round_trip(module, deep) == deep
+    assert _round_trip(module, [True, False, 0, 1, -(2**63), 2**63 - 1]) == [True, False, 0, 1, -(2**63), 2**63 - 1]
+
+
+def test_huge_integers_round_trip():
+    module = pytest.importorskip("PyABI_pyd")
+    values = [2**63, -(2**63) - 1, 2**511 + 12345, -(3**600), 2**1023 - 1, -(2**1023)]
+    assert _round_trip(module, values) == values
+    with pytest.raises(OverflowError):
+        module.call_python("copy:copy", [2**1023])
+
+
+def test_submit_many_numbers_its_calls_in_order(single_worker):
+    module = single_worker("batch")
+    calls = [("builtins:abs", [-i]) for i in range(300)]
+    ids = module.submit_many(module.call_python, calls)
+    assert list(ids) == list(range(ids[0], ids[0] + 300))
+    results = [module.wait(call_id, timeout=10) for call_id in ids]
+    assert results == [(call_id, True, i) for i, call_id in enumerate(ids)]
+
+    ids = module.submit_many(module.call_python, calls)
+    assert _finished(module, list(ids)) == list(ids)
+
+    first = module.hello_world("utf-8", 1, False)
+    with pytest.raises(TypeError):
+        module.submit_many(module.hello_world, [("utf-8", 2, False), ("utf-8", "three", False)])
+    assert module.hello_world("utf-8", 4, False) == first + 1
+
+
+def test_pools_are_created_resized_and_routed_to(single_worker):
+    import os
+
+    module = single_worker("routed")
+    module.create_pool("sized", workers=2, max_workers=4)
+    info = module.pools()["sized"]
+    assert (info["workers"], info["max_workers"]) == (2, 4)
+    with pytest.raises(ValueError):
+        module.create_pool("sized", workers=1)
+    module.resize_pool("sized", 4)
+    assert module.pools()["sized"]["workers"] == 4
+    module.resize_pool("sized", 1)
+    assert module.pools()["sized"]["workers"] == 1
+    with pytest.raises(ValueError):
+        module.resize_pool("sized", 5)
+    with pytest.raises(KeyError):
+        module.route(module.hello_world, "missing")
+    with pytest.raises(TypeError):
+        module.route(len, "routed")
+
+    cpu = min(os.sched_getaffinity(0))
+    module.create_pool("affine", workers=1, cpus=[cpu])
+    assert module.pools()["affine"]["cpus"] == [cpu]
+
+    sleeper = _busy(module, "routed", 0.3)
+    held = module.hello_world("utf-8", 1, False)
+    assert module.pools()["routed"]["queued"] == 1
+    module.route(module.hello_world, "sized")
+    moved = module.hello_world("utf-8", 2, False)
+    assert module.wait(moved, timeout=10)[1] is True
+    assert module.wait(held, timeout=0.01) is None
+    assert module.wait(sleeper, timeout=10)[1] is True
+    assert module.wait(held, timeout=10)[1] is True
+
+
+def test_dict_lookups_agree_with_python():
+    module = pytest.importorskip("PyABI_pyd")
+    small = {0: "zero", 1: "one", "a": "A", (1, "x"): "tuple", 2**100: "huge", -(2**70): "negative", b"k": "bytes", None: "none"}
+    large = dict(small, **{"key%d" % i: i for i in range(100)})
+    keys = [0, -0.0, False, 1, 1.0, True, 2**100, float(2**100), float(-(2**70)), (1.0, "x"), (True, "x"),
+            "a", b"k", None, 2, 1.5, float("nan"), float("inf"), "missing", "key0", "key99", "key100", 2**64]
+    for table in (small, large):
+        call_id, success, found = module.wait(module.hello_lookup(table, keys), timeout=10)
+        assert success, found
+        assert found == [table.get(key) for key in keys]
+
+
+def test_call_python_runs_in_a_sub_interpreter():
+    module = pytest.importorskip("PyABI_pyd")
+    if module.python_workers != "subinterpreter":
+        pytest.skip("the workers run Python in %s mode here" % module.python_workers)
+    imported = "'PyABI_pyd' in __import__('sys').modules"
+    assert eval(imported)
+    assert module.wait(module.call_python("builtins:eval", [imported, {}]), timeout=10)[1:] == (True, False)
+    assert _round_trip(module, {"nested": [1, (2.5, "three")]}) == {"nested": [1, (2.5, "three")]}
+
+    def target():
+        pass
+
+    target.__module__ = "__main__"
+    with pytest.raises(ValueError):
+        module.call_python(target)
+
+
+def test_deque_results_drains_in_batches_past_the_ring(single_worker):
+    import time
+
+    module = single_worker("drain")
+    module.deque_results()
+    ids = set(module.submit_many(module.hello_world, [("utf-8", i, False) for i in range(70000)]))
+    deadline = time.monotonic() + 30
+    while True:
+        pending = module.stats()["pending"]
+        if pending["returns"] + pending["parked"] >= len(ids):
+            break
+        assert time.monotonic() < deadline, pending
+        time.sleep(0.01)
+    assert pending["parked"] > 0
+
+    first = module.deque_results(1000)
+    assert len(first) == 1000
+    rest = module.deque_results()
+    mine = [(call_id, success) for call_id, success, result in first + rest if call_id in ids]
+    assert len(mine) == len(set(mine)) == len(ids)
+    assert all(success for call_id, success in mine)
+
+
+def test_calls_from_many_threads_all_finish_once(single_worker):
+    import threading
+
+    module = single_worker("stealing")
+    module.resize_pool("stealing", min(4, module.pools()["stealing"]["max_workers"]))
+    submitted = []
+
+    def submit(first):
+        ids = [module.hello_world("utf-8", first + i, False) for i in range(500)]
+        ids += module.submit_many(module.hello_world, [("utf-8", first + i, False) for i in range(500)])
+        submitted.append(ids)
+
+    threads = [threading.Thread(target=submit, args=(n * 1000,)) for n in range(8)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    ids = [call_id for batch in submitted for call_id in batch]
+    assert len(ids) == len(set(ids)) == 8000
+
+    assert sorted(_finished(module, ids)) == sorted(ids)
+    assert not set(ids) & {call_id for call_id, success, result in module.deque_results()}
+    assert module.pools()["stealing"]["queued"] == 0
+
+
+def test_dispatch_holds_on_to_no_memory(single_worker):
+    import tracemalloc
+
+    module = single_worker("steady")
+
+    def cycle():
+        ids = [module.hello_world("utf-8", i, False) for i in range(1000)]
+        ids += module.submit_many(module.hello_world, [("utf-8", i, False) for i in range(1000)])
+        _finished(module, ids)
+
+    tracemalloc.start()
+    try:
+        # CPython's free lists fill up while warming up, 2000 result tuples hold on to 128 KB
+        for _ in range(3):
+            cycle()
+        before = tracemalloc.get_traced_memory()[0]
+        for _ in range(20):
+            cycle()
+        growth = tracemalloc.get_traced_memory()[0] - before
+    finally:
+        tracemalloc.stop()
+    # a leak of one object per call would be a few MB
+    assert growth < 256 * 1024
+
+
+def test_exports_parse_their_arguments_from_the_signature():
+    import sys
+
+    module = pytest.importorskip("PyABI_pyd")
+    assert module.hello_world.__doc__ and module.hello_results.__doc__
+    for call in (lambda: module.hello_world(), lambda: module.hello_world(the_id=3),
+                 lambda: module.hello_results(2, cols=3, nested=False)):
+        assert module.wait(call(), timeout=10)[1] is True
+
+    with pytest.raises(TypeError):
+        module.hello_results(2)
+    with pytest.raises(TypeError):
+        module.hello_world("utf-8", 1, False, "extra")
+    with pytest.raises(TypeError):
+        module.hello_world(unknown=1)
+    with pytest.raises(TypeError):
+        module.hello_world("utf-8", the_id="one")
+    with pytest.raises(TypeError):
+        module.hello_world("utf-8", encoding="utf-8")
+
+    encoding = "".join(["utf", "-8"])
+    references = sys.getrefcount(encoding)
+    ids = [module.hello_world(encoding, i, False) for i in range(1000)]
+    _finished(module, ids)
+    assert sys.getrefcount(encoding) == references